@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <span>
 
 #include "apu.h"
@@ -8,6 +9,18 @@ constexpr uint8_t frame_counter_mode_bit = 1 << 7;
 constexpr uint8_t inhibit_irq_bit = 1 << 6;
 } // namespace
 
+audio_processing_unit::audio_processing_unit(
+    std::shared_ptr<event_scheduler> events, std::shared_ptr<audio_sink> audio)
+    : events{std::move(events)}, audio{std::move(audio)} {
+    this->events->set_handler(event::apu_frame, [this](uint64_t cycle) {
+        log(log_level::debug, "apu frame interrupt\n");
+        frame_interrupt = true;
+        this->events->assert_irq(irq_line::apu_frame);
+        start_frame_counter(cycle);
+    });
+    start_frame_counter(0);
+}
+
 void audio_processing_unit::pulse::play(std::span<std::int16_t> audio_buffer,
                                         int sample_rate_hz) {
     // FIXME: Doesn't work for some reasons, comment out to get some sound :-)
@@ -56,7 +69,19 @@ void audio_processing_unit::pulse::load_length_counter() {
     log(log_level::debug, "\tapu loaded length counter {}", length_counter);
 }
 
-void audio_processing_unit::cycle() { --cycles_til_irq; }
+void audio_processing_unit::start_frame_counter(uint64_t cycle) {
+    // Only the 4-step sequence interrupts.
+    if (frame_counter_mode || inhibit_irq) {
+        events->cancel(event::apu_frame);
+    } else {
+        events->schedule(event::apu_frame, cycle + frame_irq_period);
+    }
+}
+
+void audio_processing_unit::clear_frame_interrupt() {
+    frame_interrupt = false;
+    events->release_irq(irq_line::apu_frame);
+}
 
 void audio_processing_unit::set_frame_counter(uint8_t val) {
     log(log_level::debug, "\twrite APU frame counter");
@@ -64,18 +89,24 @@ void audio_processing_unit::set_frame_counter(uint8_t val) {
     logf(log_level::debug, " frame_counter_mode=%i", frame_counter_mode);
     inhibit_irq = val & inhibit_irq_bit;
     logf(log_level::debug, " inhibit_irq=%i", inhibit_irq);
+    if (inhibit_irq) {
+        clear_frame_interrupt();
+    }
+    // Writing restarts the sequence.
+    start_frame_counter(events->now());
 }
 
 void audio_processing_unit::play_audio() {
     // Not an exact emulation of the APU. Instead create the sound that is
     // expected.
-    for (auto &v : audio_buffer)
-        v = 0;
-
-    int required_samples{audio.required_samples()};
-    int sample_rate_hz{audio.sample_rate_hz()};
+    int const required_samples{std::clamp(
+        audio->required_samples(), 0, static_cast<int>(audio_buffer.size()))};
+    if (required_samples == 0)
+        return;
+    int sample_rate_hz{audio->sample_rate_hz()};
 
     auto section = std::span(audio_buffer.begin(), required_samples);
+    std::fill(section.begin(), section.end(), 0);
 
     pulse1.play(section, sample_rate_hz);
     pulse2.play(section, sample_rate_hz);
@@ -83,11 +114,10 @@ void audio_processing_unit::play_audio() {
     // Play triangle
     // Play noise
     // Play DMC
-    audio.queue(section);
+    audio->queue(section);
 }
 
 void audio_processing_unit::write_status(uint8_t val) {
-    // FIXME: For some reason this is never written to.
     log(log_level::debug, "\twriting APU status 2: {} 1: {}\n", val & 1, val & 1 << 1);
     pulse1.enable(val & 1);
     pulse2.enable(val & 1 << 1);
@@ -97,19 +127,11 @@ uint8_t audio_processing_unit::read_status() {
     log(log_level::debug, "\tread APU status\n");
     // Only implemented frame interrupt.
     uint8_t res{};
-    if (cycles_til_irq) {
+    if (frame_interrupt) {
         // Set frame interrupt bit
         res |= 1 << 6;
     }
     // ... more bits ...
-    cycles_til_irq = 5000;
+    clear_frame_interrupt();
     return res;
 }
-
-bool audio_processing_unit::IRQ() {
-    if (!inhibit_irq && cycles_til_irq <= 0) {
-        return true;
-    } else {
-        return false;
-    }
-}
@@ -1,11 +1,19 @@
 #pragma once
+#include <array>
 #include <cstdint>
+#include <memory>
 #include <span>
 
-#include "audio.h"
+#include "audio_sink.h"
+#include "scheduler.h"
 
 class audio_processing_unit final {
   public:
+    // Samples go to audio, the default drops them without generating any.
+    explicit audio_processing_unit(
+        std::shared_ptr<event_scheduler> events,
+        std::shared_ptr<audio_sink> audio = std::make_shared<null_audio_sink>());
+
     class pulse final {
         // FIXME: Pulse channels are missing envelope, sweep, duty cycle.
       public:
@@ -36,26 +44,29 @@ class audio_processing_unit final {
         uint8_t reg_length_timer{};
     };
 
-    void cycle();
     void set_frame_counter(uint8_t val);
     void play_audio();
 
     void write_status(uint8_t value);
     uint8_t read_status();
 
-    // Should interrupt trigger?
-    bool IRQ();
-
     // Any reason I should hide these?
     pulse pulse1{};
     pulse pulse2{};
 
   private:
-    audio_backend audio{};
+    std::shared_ptr<event_scheduler> const events{};
+    std::shared_ptr<audio_sink> const audio{};
 
     std::array<std::int16_t, 2048> audio_buffer{};
 
     bool frame_counter_mode = false;
     bool inhibit_irq = false;
-    int cycles_til_irq = 5000; // Should be 60 Hz (is not!).
+    // Set by the frame counter, cleared by reading the status.
+    bool frame_interrupt = false;
+    // 4-step sequence frame interrupt, in CPU cycles (~60 Hz).
+    static constexpr uint64_t frame_irq_period = 29830;
+    // Restart the frame counter sequence at cycle.
+    void start_frame_counter(uint64_t cycle);
+    void clear_frame_interrupt();
 };
@@ -1,3 +1,39 @@
 #include "audio.h"
 
-// Some SDL audio stuff
+#include <stdexcept>
+
+#include <SDL2/SDL_audio.h>
+#include <SDL2/SDL_error.h>
+
+#include "log.h"
+
+sdl_audio_sink::sdl_audio_sink() {
+    SDL_InitSubSystem(SDL_INIT_AUDIO);
+    SDL_AudioSpec spec{};
+    spec.freq = sample_rate_hz();
+    spec.format = AUDIO_S16SYS;
+    spec.channels = 1;
+    spec.samples = 1024;
+    spec.callback = nullptr;
+    device = SDL_OpenAudioDevice(nullptr, 0, &spec, nullptr, 0);
+    if (device == 0) {
+        log(log_level::error, "{}\n", SDL_GetError());
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        throw std::runtime_error("Failed to open audio device");
+    }
+    SDL_PauseAudioDevice(device, 0);
+}
+
+sdl_audio_sink::~sdl_audio_sink() {
+    SDL_CloseAudioDevice(device);
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+}
+
+int sdl_audio_sink::required_samples() {
+    return (1470 * 2 - static_cast<int>(SDL_GetQueuedAudioSize(device))) / 2;
+}
+
+void sdl_audio_sink::queue(std::span<int16_t const> samples) {
+    SDL_QueueAudio(device, samples.data(),
+                   static_cast<uint32_t>(samples.size_bytes()));
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Where the APU queues samples, 16 bit mono. The core does not depend on
+// SDL, sdl_audio_sink in audio.h plays them.
+class audio_sink {
+  public:
+    virtual ~audio_sink() = default;
+    // How many samples to queue now to keep playing smoothly.
+    virtual int required_samples() = 0;
+    virtual int sample_rate_hz() const = 0;
+    virtual void queue(std::span<int16_t const> samples) = 0;
+};
+
+// Wants no samples, so none are generated when running headless.
+class null_audio_sink final : public audio_sink {
+  public:
+    int required_samples() override { return 0; }
+    int sample_rate_hz() const override { return 44100; }
+    void queue(std::span<int16_t const>) override {}
+};
+
+// Collects one frame worth of samples per call, e.g. to write them to a
+// file.
+class buffer_audio_sink final : public audio_sink {
+  public:
+    explicit buffer_audio_sink(int sample_rate_hz = 44100)
+        : rate{sample_rate_hz} {}
+
+    int required_samples() override { return rate / 60; }
+    int sample_rate_hz() const override { return rate; }
+    void queue(std::span<int16_t const> samples) override {
+        buffer.insert(buffer.end(), samples.begin(), samples.end());
+    }
+
+    std::vector<int16_t> const &samples() const { return buffer; }
+
+  private:
+    int const rate;
+    std::vector<int16_t> buffer{};
+};
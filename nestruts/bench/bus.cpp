@@ -0,0 +1,49 @@
+// Throughput benchmark for memory_bus.
+//
+// Reads and writes RAM and ROM in the pattern of a typical program: opcode
+// fetches from ROM, zero page and stack accesses and indexed accesses to the
+// mirrored RAM.
+//
+// Usage: struts_bench_bus [accesses]
+
+#include "nestruts/log.h"
+#include "nestruts/mem.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+
+int main(int argc, char *argv[]) {
+    current_log_level = log_level::error;
+    long const accesses = argc > 1 ? std::atol(argv[1]) : 200'000'000;
+
+    auto bus = std::make_unique<memory_bus>(nullptr, nullptr, nullptr);
+    for (uint32_t adr{0x8000}; adr <= 0xFFFF; ++adr) {
+        bus->load_rom(static_cast<uint16_t>(adr), static_cast<uint8_t>(adr));
+    }
+
+    // Eight accesses per iteration: three ROM fetches, two zero page, one
+    // stack and two indexed RAM accesses through a mirror.
+    uint8_t sum{};
+    auto const start = std::chrono::steady_clock::now();
+    for (long i{0}; i < accesses / 8; ++i) {
+        auto const pc = static_cast<uint16_t>(0x8000 | (i * 3 & 0x7FFF));
+        sum += bus->read(pc);
+        sum += bus->read(pc + 1);
+        sum += bus->read(pc + 2);
+        auto const zp = static_cast<uint8_t>(i);
+        sum += bus->read(zp);
+        bus->write(zp, sum);
+        bus->write(0x0100 | static_cast<uint8_t>(i >> 3), sum);
+        auto const adr = static_cast<uint16_t>(0x0200 + (i & 0x17FF));
+        sum += bus->read(adr);
+        bus->write(adr, sum);
+    }
+    std::chrono::duration<double> const elapsed =
+        std::chrono::steady_clock::now() - start;
+    fmt::print("{} accesses in {:.3f} s: {:.1f} M accesses/s (checksum {})\n",
+               accesses / 8 * 8, elapsed.count(),
+               accesses / 8 * 8 / elapsed.count() / 1e6, sum);
+    return 0;
+}
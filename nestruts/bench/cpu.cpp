@@ -0,0 +1,89 @@
+// Throughput benchmark for core6502.
+//
+// Runs a small synthetic program from ROM and reports executed instructions
+// per second and emulated speed relative to a real NTSC 6502.
+//
+// Usage: struts_bench_cpu [instructions]
+
+#include "nestruts/core6502.h"
+#include "nestruts/log.h"
+#include "nestruts/mem.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+
+namespace {
+// A mix of loads, stores, arithmetic, read-modify-write and branches.
+constexpr std::array<uint8_t, 33> program{
+    0xA2, 0x00,       // $8000: LDX #$00
+    0xA0, 0x10,       // $8002: LDY #$10
+    0xBD, 0x00, 0x02, // $8004: LDA $0200,X
+    0x69, 0x01,       // $8007: ADC #$01
+    0x9D, 0x00, 0x02, // $8009: STA $0200,X
+    0x85, 0x10,       // $800C: STA $10
+    0x26, 0x10,       // $800E: ROL $10
+    0x45, 0x10,       // $8010: EOR $10
+    0xC9, 0x80,       // $8012: CMP #$80
+    0xE6, 0x11,       // $8014: INC $11
+    0x88,             // $8016: DEY
+    0xD0, 0x02,       // $8017: BNE $801B
+    0xA0, 0x10,       // $8019: LDY #$10
+    0xE8,             // $801B: INX
+    0xD0, 0xE6,       // $801C: BNE $8004
+    0x4C, 0x00, 0x80, // $801E: JMP $8000
+};
+
+// NTSC CPU clock
+constexpr double cpu_hz{1789773.0};
+
+std::unique_ptr<core6502> create_cpu() {
+    auto bus = std::make_unique<memory_bus>(nullptr, nullptr, nullptr);
+    for (std::size_t i{0}; i < program.size(); ++i) {
+        bus->load_rom(static_cast<uint16_t>(0x8000 + i), program[i]);
+    }
+    auto cpu = std::make_unique<core6502>(std::move(bus));
+    cpu->setpp(0x8000);
+    return cpu;
+}
+
+void report(char const *name, long instructions, core6502 &cpu,
+            std::chrono::duration<double> elapsed) {
+    fmt::print("{}: {} instructions in {:.3f} s: {:.1f} M instructions/s, "
+               "{:.1f}x realtime\n",
+               name, instructions, elapsed.count(),
+               instructions / elapsed.count() / 1e6,
+               cpu.get_cycles() / cpu_hz / elapsed.count());
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+    current_log_level = log_level::error;
+    long const instructions = argc > 1 ? std::atol(argv[1]) : 50'000'000;
+
+    // One instruction at a time through the interpreter.
+    auto stepped = create_cpu();
+    auto start = std::chrono::steady_clock::now();
+    for (long i{0}; i < instructions; ++i) {
+        stepped->cycle();
+    }
+    auto end = std::chrono::steady_clock::now();
+    report("cycle()", instructions, *stepped, end - start);
+
+    // The same number of cycles, and so instructions, through basic blocks.
+    auto blocks = create_cpu();
+    start = std::chrono::steady_clock::now();
+    blocks->run_until(stepped->get_cycles());
+    end = std::chrono::steady_clock::now();
+    report("run_until()", instructions, *blocks, end - start);
+
+    for (auto *cpu : {stepped.get(), blocks.get()}) {
+        if (cpu->is_faulted()) {
+            log(log_level::error, "CPU faulted:\n{}\n", cpu->dump_state());
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,71 @@
+// Throughput benchmark for the NTSC filter in ntsc.h.
+//
+// Filters a frame of random 8 x 8 tiles with four colours each, with a few
+// lines of colour emphasis, at every level the host supports and reports
+// frames per second. The emulator needs 60 on top of its own frame time.
+//
+// Usage: struts_bench_ntsc [frames]
+
+#include "nestruts/ntsc.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <string_view>
+#include <vector>
+
+#include "fmt/core.h"
+
+namespace {
+constexpr int width{256};
+constexpr int height{240};
+
+std::vector<uint8_t> create_frame() {
+    std::mt19937 random{1};
+    std::vector<uint8_t> frame(width * height);
+    for (int tile_y{0}; tile_y < height; tile_y += 8) {
+        for (int tile_x{0}; tile_x < width; tile_x += 8) {
+            std::array<uint8_t, 4> colours{};
+            for (auto &colour : colours) {
+                colour = static_cast<uint8_t>(random() % 64);
+            }
+            for (int y{tile_y}; y < tile_y + 8; ++y) {
+                for (int x{tile_x}; x < tile_x + 8; ++x) {
+                    frame[y * width + x] = colours[random() % 4];
+                }
+            }
+        }
+    }
+    return frame;
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+    long const frames = argc > 1 ? std::atol(argv[1]) : 1'000;
+    auto const frame = create_frame();
+    std::vector<uint8_t> emphasis(height);
+    for (int y{200}; y < height; ++y) {
+        emphasis[y] = static_cast<uint8_t>(y % 8);
+    }
+    std::vector<uint32_t> out(frame.size() * 4);
+    constexpr std::array<std::string_view, 3> level_names{"scalar", "sse2",
+                                                          "avx2"};
+    for (int level{0}; level <= static_cast<int>(host_simd_level); ++level) {
+        ntsc_filter filter{static_cast<simd_level>(level)};
+        unsigned checksum{};
+        auto const start = std::chrono::steady_clock::now();
+        for (long i{0}; i < frames; ++i) {
+            filter.filter(frame, emphasis, width, i, out.data());
+            checksum += out[i % out.size()];
+        }
+        std::chrono::duration<double> const elapsed =
+            std::chrono::steady_clock::now() - start;
+        fmt::print("ntsc {:>6}: {:8.1f} frames/s, {:6.3f} ms per frame "
+                   "(checksum {})\n",
+                   level_names[level], frames / elapsed.count(),
+                   elapsed.count() * 1e3 / frames, checksum);
+    }
+    return 0;
+}
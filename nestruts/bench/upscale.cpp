@@ -0,0 +1,86 @@
+// Throughput benchmark for the upscalers in upscale.h.
+//
+// Scales a frame of random 8 x 8 tiles with four colours each, in runs like
+// pixel art has, with every filter at every level the host supports and
+// reports megapixels per second read and written.
+//
+// Usage: struts_bench_upscale [frames]
+
+#include "nestruts/palette.h"
+#include "nestruts/upscale.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <string_view>
+#include <vector>
+
+#include "fmt/core.h"
+
+namespace {
+constexpr int width{256};
+constexpr int height{240};
+
+std::vector<uint32_t> create_frame() {
+    std::mt19937 random{1};
+    std::vector<uint32_t> frame(width * height);
+    for (int tile_y{0}; tile_y < height; tile_y += 8) {
+        for (int tile_x{0}; tile_x < width; tile_x += 8) {
+            std::array<uint32_t, 4> colours{};
+            for (auto &colour : colours) {
+                colour = to_argb(static_cast<uint8_t>(random() % 64), 0);
+            }
+            for (int y{tile_y}; y < tile_y + 8; ++y) {
+                for (int x{tile_x}; x < tile_x + 8; ++x) {
+                    auto &pixel = frame[y * width + x];
+                    if (x > tile_x && random() % 2) {
+                        pixel = frame[y * width + x - 1];
+                    } else if (y > tile_y && random() % 2) {
+                        pixel = frame[(y - 1) * width + x];
+                    } else {
+                        pixel = colours[random() % 4];
+                    }
+                }
+            }
+        }
+    }
+    return frame;
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+    long const frames = argc > 1 ? std::atol(argv[1]) : 1'000;
+    auto const frame = create_frame();
+    std::vector<uint32_t> out(frame.size() * 16);
+    constexpr std::array<std::string_view, 3> level_names{"scalar", "sse2",
+                                                          "avx2"};
+    for (int filter_index{0};
+         filter_index < static_cast<int>(upscale_filter::count);
+         ++filter_index) {
+        auto const filter = static_cast<upscale_filter>(filter_index);
+        int const factor = upscale_factor(filter);
+        for (int level{0}; level <= static_cast<int>(host_simd_level);
+             ++level) {
+            auto const scale =
+                find_upscaler(filter, static_cast<simd_level>(level));
+            unsigned checksum{};
+            auto const start = std::chrono::steady_clock::now();
+            for (long i{0}; i < frames; ++i) {
+                scale(frame.data(), width, height, out.data());
+                checksum += out[i % (frame.size() * factor * factor)];
+            }
+            std::chrono::duration<double> const elapsed =
+                std::chrono::steady_clock::now() - start;
+            double const in_pixels = frames * 1.0 * width * height;
+            fmt::print("{:>9} {:>6}: {:8.1f} M pixels/s in, {:8.1f} M "
+                       "pixels/s out (checksum {})\n",
+                       upscale_filter_name(filter), level_names[level],
+                       in_pixels / elapsed.count() / 1e6,
+                       in_pixels * factor * factor / elapsed.count() / 1e6,
+                       checksum);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include "compositor.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace {
+// The screen is 256 pixels wide, see picture_processing_unit.
+constexpr int last_x{255};
+
+// Composes one pixel, sets hit for sprite 0 hits.
+inline uint8_t composite_pixel(uint8_t background, uint8_t sprite,
+                               bool &hit) {
+    bool const background_opaque = background & 0x03;
+    if (!(sprite & 0x03))
+        return background;
+    hit = (sprite & 0x40) && background_opaque;
+    if ((sprite & 0x80) && background_opaque)
+        return background;
+    return sprite & 0x1F;
+}
+
+// The leftmost 8 pixels, where PPUMASK may hide either layer.
+int composite_left(scanline_layers const &layers, uint8_t *out, int begin,
+                   int end) {
+    int first_hit{-1};
+    for (int x{begin}; x < std::min(end, 8); ++x) {
+        bool hit{};
+        out[x] = composite_pixel(
+            layers.show_background_left ? layers.background[x] : 0,
+            layers.show_sprites_left ? layers.sprites[x] : 0, hit);
+        if (hit && first_hit < 0)
+            first_hit = x;
+    }
+    return first_hit;
+}
+} // namespace
+
+int composite_scalar(scanline_layers const &layers, uint8_t *out, int begin,
+                     int end) {
+    int first_hit = composite_left(layers, out, begin, end);
+    for (int x{std::max(begin, 8)}; x < end; ++x) {
+        bool hit{};
+        out[x] = composite_pixel(layers.background[x], layers.sprites[x], hit);
+        if (hit && first_hit < 0 && x != last_x)
+            first_hit = x;
+    }
+    return first_hit;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Both vector widths run the same steps:
+//   sprite_transparent = (sprite & 3) == 0
+//   use_background = sprite_transparent ||
+//                    (behind && background opaque)
+//   out = use_background ? background : sprite & 0x1F
+//   hit = sprite 0 && both opaque
+// Pixels left over at the end go through composite_scalar.
+
+__attribute__((target("sse2"))) int
+composite_sse2(scanline_layers const &layers, uint8_t *out, int begin,
+               int end) {
+    int first_hit = composite_left(layers, out, begin, end);
+    int x{std::max(begin, 8)};
+    auto const zero = _mm_setzero_si128();
+    auto const three = _mm_set1_epi8(0x03);
+    auto const sprite_zero = _mm_set1_epi8(0x40);
+    auto const index_bits = _mm_set1_epi8(0x1F);
+    for (; x + 16 <= end; x += 16) {
+        auto const background = _mm_loadu_si128(
+            reinterpret_cast<__m128i const *>(layers.background + x));
+        auto const sprite = _mm_loadu_si128(
+            reinterpret_cast<__m128i const *>(layers.sprites + x));
+        auto const background_transparent =
+            _mm_cmpeq_epi8(_mm_and_si128(background, three), zero);
+        auto const sprite_transparent =
+            _mm_cmpeq_epi8(_mm_and_si128(sprite, three), zero);
+        auto const behind = _mm_cmplt_epi8(sprite, zero);
+        auto const use_background = _mm_or_si128(
+            sprite_transparent,
+            _mm_andnot_si128(background_transparent, behind));
+        auto const result = _mm_or_si128(
+            _mm_and_si128(use_background, background),
+            _mm_andnot_si128(use_background,
+                             _mm_and_si128(sprite, index_bits)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x), result);
+        auto const hit = _mm_andnot_si128(
+            _mm_or_si128(sprite_transparent, background_transparent),
+            _mm_cmpeq_epi8(_mm_and_si128(sprite, sprite_zero), sprite_zero));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hit));
+        if (x + 16 > last_x)
+            mask &= ~(1u << (last_x - x));
+        if (mask && first_hit < 0)
+            first_hit = x + __builtin_ctz(mask);
+    }
+    int const rest_hit = composite_scalar(layers, out, x, end);
+    return first_hit < 0 ? rest_hit : first_hit;
+}
+
+__attribute__((target("avx2"))) int
+composite_avx2(scanline_layers const &layers, uint8_t *out, int begin,
+               int end) {
+    int first_hit = composite_left(layers, out, begin, end);
+    int x{std::max(begin, 8)};
+    auto const zero = _mm256_setzero_si256();
+    auto const three = _mm256_set1_epi8(0x03);
+    auto const sprite_zero = _mm256_set1_epi8(0x40);
+    auto const index_bits = _mm256_set1_epi8(0x1F);
+    for (; x + 32 <= end; x += 32) {
+        auto const background = _mm256_loadu_si256(
+            reinterpret_cast<__m256i const *>(layers.background + x));
+        auto const sprite = _mm256_loadu_si256(
+            reinterpret_cast<__m256i const *>(layers.sprites + x));
+        auto const background_transparent =
+            _mm256_cmpeq_epi8(_mm256_and_si256(background, three), zero);
+        auto const sprite_transparent =
+            _mm256_cmpeq_epi8(_mm256_and_si256(sprite, three), zero);
+        auto const behind = _mm256_cmpgt_epi8(zero, sprite);
+        auto const use_background = _mm256_or_si256(
+            sprite_transparent,
+            _mm256_andnot_si256(background_transparent, behind));
+        auto const result =
+            _mm256_blendv_epi8(_mm256_and_si256(sprite, index_bits),
+                               background, use_background);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + x), result);
+        auto const hit = _mm256_andnot_si256(
+            _mm256_or_si256(sprite_transparent, background_transparent),
+            _mm256_cmpeq_epi8(_mm256_and_si256(sprite, sprite_zero),
+                              sprite_zero));
+        auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+        if (x + 32 > last_x)
+            mask &= ~(1u << (last_x - x));
+        if (mask && first_hit < 0)
+            first_hit = x + __builtin_ctz(mask);
+    }
+    int const rest_hit = composite_sse2(layers, out, x, end);
+    return first_hit < 0 ? rest_hit : first_hit;
+}
+#endif
+
+compositor const composite_line = [] {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        return &composite_avx2;
+    return &composite_sse2;
+#else
+    return &composite_scalar;
+#endif
+}();
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+
+// One scanline of the layers rendered by the PPU, screen_width pixels each
+// starting at the left edge of the screen.
+struct scanline_layers {
+    // Palette RAM indices, zero where transparent.
+    uint8_t const *background{};
+    // Palette RAM indices, zero where transparent, with bit 6 set for
+    // sprite 0 and bit 7 for sprites behind the background.
+    uint8_t const *sprites{};
+    // PPUMASK bits showing each layer in the leftmost 8 pixels.
+    bool show_background_left{true};
+    bool show_sprites_left{true};
+};
+
+// Merges the pixels in [begin, end) of layers into out as palette RAM
+// indices, zero for the backdrop. Returns the first x where an opaque pixel
+// of sprite 0 overlaps opaque background, never at x 255, or -1.
+using compositor = int (*)(scanline_layers const &layers, uint8_t *out,
+                           int begin, int end);
+
+// Reference implementation, one pixel at a time.
+int composite_scalar(scanline_layers const &layers, uint8_t *out, int begin,
+                     int end);
+#if defined(__x86_64__) || defined(__i386__)
+// 16 and 32 pixels at a time. Only call composite_avx2 when
+// __builtin_cpu_supports("avx2").
+int composite_sse2(scanline_layers const &layers, uint8_t *out, int begin,
+                   int end);
+int composite_avx2(scanline_layers const &layers, uint8_t *out, int begin,
+                   int end);
+#endif
+
+// The fastest the host CPU supports.
+extern compositor const composite_line;
@@ -34,6 +34,9 @@ class controller {
         m_state |= static_cast<uint8_t>(b);
         // log(log_level::error, "new_state: {}\n", static_cast<int>(m_state));
     }
+    // Buttons currently held, one bit per button.
+    uint8_t state() const { return m_state; }
+    void set_state(uint8_t state) { m_state = state; }
     // Simulate a shift register.
     uint8_t read() {
         log(log_level::debug, "read state: ${:02x} updating: {}\n", m_state,
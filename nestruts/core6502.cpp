@@ -1,10 +1,67 @@
 #include "core6502.h"
+#include "core6502_ops.h"
 
 #include "log.h"
 #include "mem.h"
+#include <algorithm>
+#include <array>
 #include <cstdint>
+#include <span>
 
 namespace {
+constexpr uint16_t prg_rom_start = 0x8000;
+constexpr std::size_t max_block_size = 32;
+
+// Instruction pairs common in NES code that run as a single handler when
+// they appear in a block: loads followed by stores, and compares or counter
+// updates followed by a branch.
+constexpr std::array<std::pair<uint8_t, uint8_t>, 22> fused_pairs{{
+    {0xA9, 0x85}, // LDA #; STA zp
+    {0xA9, 0x8D}, // LDA #; STA abs
+    {0xA9, 0x9D}, // LDA #; STA abs,X
+    {0xA9, 0x99}, // LDA #; STA abs,Y
+    {0xA5, 0x85}, // LDA zp; STA zp
+    {0xAD, 0x8D}, // LDA abs; STA abs
+    {0xBD, 0x9D}, // LDA abs,X; STA abs,X
+    {0xB1, 0x91}, // LDA (zp),Y; STA (zp),Y
+    {0xC9, 0xD0}, // CMP #; BNE
+    {0xC9, 0xF0}, // CMP #; BEQ
+    {0xC9, 0x90}, // CMP #; BCC
+    {0xC9, 0xB0}, // CMP #; BCS
+    {0xE0, 0xD0}, // CPX #; BNE
+    {0xC0, 0xD0}, // CPY #; BNE
+    {0xCA, 0xD0}, // DEX; BNE
+    {0x88, 0xD0}, // DEY; BNE
+    {0xE8, 0xD0}, // INX; BNE
+    {0xC8, 0xD0}, // INY; BNE
+    {0xA5, 0xF0}, // LDA zp; BEQ
+    {0xA5, 0xD0}, // LDA zp; BNE
+    {0xAD, 0x10}, // LDA abs; BPL
+    {0x2C, 0x10}, // BIT abs; BPL
+}};
+
+// Instructions that can change the program counter end a basic block.
+constexpr bool ends_block(mnemonic name) {
+    switch (name) {
+    case mnemonic::invalid:
+    case mnemonic::BCC:
+    case mnemonic::BCS:
+    case mnemonic::BEQ:
+    case mnemonic::BMI:
+    case mnemonic::BNE:
+    case mnemonic::BPL:
+    case mnemonic::BVC:
+    case mnemonic::BRK:
+    case mnemonic::JMP:
+    case mnemonic::JSR:
+    case mnemonic::RTI:
+    case mnemonic::RTS:
+        return true;
+    default:
+        return false;
+    }
+}
+
 constexpr uint8_t carry_flag = 1;
 constexpr uint8_t zero_flag = 1 << 1;
 constexpr uint8_t interrupt_disable_flag = 1 << 2;
@@ -37,24 +94,69 @@ std::ostream &operator<<(std::ostream &stream, state s) {
     return stream;
 }
 
-core6502::core6502(std::unique_ptr<memory_bus> bus,
-                   std::function<bool()> irq_func)
-    : bus{std::move(bus)}, irq_func{irq_func}, sp{0xff} {
+core6502::core6502(std::unique_ptr<memory_bus> bus)
+    : bus{std::move(bus)}, events{this->bus->scheduler()}, sp{0xff} {
+    this->bus->on_rom_change(
+        [this](uint16_t adr, uint16_t size, rom_change change) {
+            invalidate_code(adr, size, change);
+        });
+    events.set_clock(&cycles);
+    events.set_deadline(&target_cycle);
     log(log_level::debug, "Created core6502\n");
 }
 
+core6502::~core6502() {
+    events.set_clock(nullptr);
+    events.set_deadline(nullptr);
+}
+
 void core6502::cycle() {
-    interrupt();
+    if (cycles >= events.next_event()) {
+        events.run_due(cycles);
+    }
+    if (events.pending()) {
+        interrupt();
+    }
     execute();
 }
 
+void core6502::run_until(uint64_t target) {
+    // Interrupts are only polled between blocks.
+    while (cycles < target && !faulted) {
+        if (cycles >= events.next_event()) {
+            events.run_due(cycles);
+        }
+        if (events.pending()) {
+            interrupt();
+        }
+        // Blocks stop at the next event so that it runs on time.
+        target_cycle = std::min(target, events.next_event());
+        auto const block = pp >= prg_rom_start && !static_blocks.empty()
+                               ? static_blocks[pp - prg_rom_start]
+                               : nullptr;
+        if (block) {
+            code_invalidated = false;
+            idle_loop_iterations = 0;
+            block(*this);
+        } else if (auto const *b = find_block()) {
+            run_block(*b);
+        } else {
+            idle_loop_iterations = 0;
+            execute();
+        }
+    }
+}
+
 void core6502::interrupt() {
-    if (irq_func() && !(status & interrupt_disable_flag)) {
+    if (events.take_nmi()) {
+        nmi();
+    } else if (events.irq() && !(status & interrupt_disable_flag)) {
         irq();
     }
 }
 
 void core6502::nmi() {
+    idle_loop_iterations = 0;
     logf(log_level::instr, "Triggered NMI\n");
     logf(log_level::debug, "\t push pp");
     pushpp();
@@ -63,9 +165,11 @@ void core6502::nmi() {
     logf(log_level::debug, "\n");
     uint16_t addr = bus->read(0xFFFA) + (bus->read(0xFFFB) << 8);
     set_pp(addr);
+    cycles += 7;
 }
 
 void core6502::irq() {
+    idle_loop_iterations = 0;
     logf(log_level::instr, "Triggered IRQ\n");
     logf(log_level::debug, "\t push pp");
     pushpp();
@@ -77,6 +181,7 @@ void core6502::irq() {
     set_pp(addr);
     logf(log_level::debug, "setting interrupt disable status flag\n");
     status |= interrupt_disable_flag;
+    cycles += 7;
 }
 
 void core6502::setpp(uint16_t new_pp) { pp = new_pp; }
@@ -96,11 +201,6 @@ state core6502::dump_state() {
 }
 bool core6502::is_faulted() { return faulted; }
 
-uint8_t core6502::fetch() {
-    uint8_t val = bus->read(pp++);
-    return val;
-}
-
 void core6502::push(uint8_t val) {
     bus->write(stack_offs + sp, val);
     set_sp(sp - 1);
@@ -111,612 +211,467 @@ uint8_t core6502::pop() {
     return bus->read(stack_offs + sp);
 }
 
-value_proxy core6502::bus_val(uint8_t opcode) {
-    logf(log_level::instr, " ");
-    switch (opcode) {
-    case 0x09:
-    case 0x29:
-    case 0x49:
-    case 0x69:
-    case 0xA0:
-    case 0xA2:
-    case 0xA9:
-    case 0xC0:
-    case 0xC9:
-    case 0xE0:
-    case 0xE9: {
-        uint8_t arg = fetch();
-        logf(log_level::instr, "#%02x", arg);
-        current_instruction.set_mode(adr_mode::immediate);
-        current_instruction.set_argument(arg);
-        return value_proxy{arg};
-    }
-    case 0x10:
-    case 0x30:
-    case 0x50:
-    case 0x90:
-    case 0xB0:
-    case 0xD0:
-    case 0xF0: {
-        uint8_t arg = fetch();
-        logf(log_level::instr, "*%i", static_cast<int8_t>(arg));
-        current_instruction.set_mode(adr_mode::relative);
-        current_instruction.set_argument(arg);
-        return value_proxy{arg};
+template <std::size_t... opcodes>
+constexpr std::array<core6502::handler, 256>
+core6502::make_dispatch_table(std::index_sequence<opcodes...>) {
+    return {&core6502::execute_op<opcode_table[opcodes].name,
+                                  opcode_table[opcodes].mode>...};
+}
+
+std::array<core6502::handler, 256> const core6502::dispatch_table =
+    make_dispatch_table(std::make_index_sequence<256>{});
+
+core6502::decoded_instruction core6502::decode_from_bus(uint16_t adr) {
+    decoded_instruction instruction{};
+    instruction.opcode = bus->read(adr);
+    auto const &entry = opcode_table[instruction.opcode];
+    instruction.fn = dispatch_table[instruction.opcode];
+    instruction.size = 1 + operand_size(entry.mode);
+    instruction.cycles = entry.cycles;
+    instruction.page_penalty = entry.page_penalty;
+    if (instruction.size > 1)
+        instruction.operand_low = bus->read(adr + 1);
+    if (instruction.size > 2)
+        instruction.operand_high = bus->read(adr + 2);
+    return instruction;
+}
+
+core6502::code_page &core6502::get_code_page(uint16_t adr) {
+    auto const index = (adr - prg_rom_start) / code_page_size;
+    auto &page = code_pages[index];
+    if (!page) {
+        // Only called between blocks.
+        stale_code_pages.clear();
+        auto &cached =
+            code_cache[bus->read_data(prg_rom_start + index * code_page_size)];
+        if (!cached)
+            cached = std::make_unique<code_page>();
+        page = cached.get();
     }
-    case 0x05:
-    case 0x06:
-    case 0x24:
-    case 0x25:
-    case 0x26:
-    case 0x45:
-    case 0x46:
-    case 0x65:
-    case 0x66:
-    case 0x84:
-    case 0x85:
-    case 0x86:
-    case 0xA4:
-    case 0xA5:
-    case 0xA6:
-    case 0xC4:
-    case 0xC5:
-    case 0xC6:
-    case 0xE4:
-    case 0xE5:
-    case 0xE6: {
-        uint8_t arg = fetch();
-        logf(log_level::instr, "$%02x", arg);
-        current_instruction.set_mode(adr_mode::zero_page);
-        current_instruction.set_argument(arg);
-        return (*bus)[zero(arg)];
+    return *page;
+}
+
+void core6502::invalidate_code(uint16_t adr, uint16_t size,
+                               rom_change change) {
+    if (adr + size <= prg_rom_start)
+        return;
+    uint16_t const first = std::max(adr, prg_rom_start);
+    auto const last = adr + size - 1;
+    for (auto i = (first - prg_rom_start) / code_page_size;
+         i <= (last - prg_rom_start) / code_page_size; ++i) {
+        code_pages[i] = nullptr;
+        if (change == rom_change::mapping)
+            continue;
+        // A block may still be running from the page.
+        auto const cached = code_cache.find(
+            bus->read_data(prg_rom_start + i * code_page_size));
+        if (cached != code_cache.end()) {
+            stale_code_pages.push_back(std::move(cached->second));
+            code_cache.erase(cached);
+        }
     }
-    case 0x15:
-    case 0x16:
-    case 0x35:
-    case 0x36:
-    case 0x55:
-    case 0x56:
-    case 0x75:
-    case 0x76:
-    case 0x94:
-    case 0x95:
-    case 0x96:
-    case 0xB4:
-    case 0xB5:
-    case 0xD5:
-    case 0xD6:
-    case 0xF5:
-    case 0xF6: {
-        uint8_t arg = fetch();
-        logf(log_level::instr, "$%02x,X", arg);
-        current_instruction.set_mode(adr_mode::x_indexed_zero_page);
-        current_instruction.set_argument(arg);
-        return (*bus)[zero_x(arg)];
+    if (!static_blocks.empty()) {
+        std::fill(static_blocks.begin() + (first - prg_rom_start),
+                  static_blocks.begin() + (last - prg_rom_start + 1), nullptr);
     }
-    case 0xB6: {
-        uint8_t arg = fetch();
-        logf(log_level::instr, "$%02x,Y", arg);
-        current_instruction.set_mode(adr_mode::y_indexed_zero_page);
-        current_instruction.set_argument(arg);
-        return (*bus)[zero_y(arg)];
+    code_invalidated = true;
+}
+
+void core6502::add_static_block(uint16_t adr, static_block block) {
+    if (adr < prg_rom_start)
+        return;
+    if (static_blocks.empty())
+        static_blocks.resize(0x10000 - prg_rom_start);
+    static_blocks[adr - prg_rom_start] = block;
+}
+
+core6502::decoded_instruction const &core6502::decode(uint16_t adr) {
+    // PRG ROM only changes through the bus notifying us, so instructions
+    // there are decoded once and served from the cache afterwards. Anything
+    // else, such as code in RAM, is decoded from the bus every time.
+    if (adr >= prg_rom_start) {
+        auto &cached = get_code_page(adr).decoded[adr % code_page_size];
+        if (cached.fn)
+            return cached;
+        auto const instruction = decode_from_bus(adr);
+        // Operands in the next page can be remapped independently.
+        if (adr % code_page_size + instruction.size <= code_page_size) {
+            cached = instruction;
+            return cached;
+        }
+        uncached = instruction;
+        return uncached;
     }
-    case 0x0D:
-    case 0x0E:
-    case 0x2C:
-    case 0x2D:
-    case 0x2E:
-    case 0x4D:
-    case 0x4E:
-    case 0x6D:
-    case 0x6E:
-    case 0x8C:
-    case 0x8D:
-    case 0x8E:
-    case 0xAC:
-    case 0xAD:
-    case 0xAE:
-    case 0xCC:
-    case 0xCD:
-    case 0xCE:
-    case 0xEC:
-    case 0xED:
-    case 0xEE: {
-        uint8_t low_adr = fetch();
-        uint8_t high_adr = fetch();
-        logf(log_level::instr, "$%02x%02x", high_adr, low_adr);
-        current_instruction.set_mode(adr_mode::absolute);
-        current_instruction.set_argument((high_adr << 8) + low_adr);
-        return (*bus)[absolute(low_adr, high_adr)];
-    }
-    case 0x1D:
-    case 0x1E:
-    case 0x3D:
-    case 0x3E:
-    case 0x5D:
-    case 0x5E:
-    case 0x7D:
-    case 0x7E:
-    case 0x9D:
-    case 0xBC:
-    case 0xBD:
-    case 0xDD:
-    case 0xDE:
-    case 0xFD:
-    case 0xFE: {
-        uint8_t low_adr = fetch();
-        uint8_t high_adr = fetch();
-        logf(log_level::instr, "$%02x%02x,X", high_adr, low_adr);
-        current_instruction.set_mode(adr_mode::x_indexed_absolute);
-        current_instruction.set_argument((high_adr << 8) + low_adr);
-        return (*bus)[absolute_x(low_adr, high_adr)];
+    uncached = decode_from_bus(adr);
+    return uncached;
+}
+
+void core6502::start_instruction(decoded_instruction const &instruction) {
+    logf(log_level::instr, "%#06x: ", pp);
+    opcode = instruction.opcode;
+    operand_low = instruction.operand_low;
+    operand_high = instruction.operand_high;
+    store.push(pp, opcode, operand_low, operand_high);
+    pp += instruction.size;
+    logf(log_level::instr, "%s", mnemonic_name(opcode_table[opcode].name));
+    page_crossed = false;
+}
+
+void core6502::finish_instruction(decoded_instruction const &instruction) {
+    cycles += instruction.cycles;
+    if (instruction.page_penalty && page_crossed) {
+        ++cycles;
     }
-    case 0x19:
-    case 0x39:
-    case 0x59:
-    case 0x79:
-    case 0x99:
-    case 0xB9:
-    case 0xBE:
-    case 0xD9:
-    case 0xF9: {
-        uint8_t low_adr = fetch();
-        uint8_t high_adr = fetch();
-        logf(log_level::instr, "$%02x%02x,Y", high_adr, low_adr);
-        current_instruction.set_mode(adr_mode::y_indexed_absolute);
-        current_instruction.set_argument((high_adr << 8) + low_adr);
-        return (*bus)[absolute_y(low_adr, high_adr)];
+    // OAM DMA halts the CPU, one more cycle if started on an odd cycle.
+    if (auto const stall = events.take_stall()) {
+        cycles += stall + (cycles & 1);
     }
-    case 0x01:
-    case 0x21:
-    case 0x41:
-    case 0x61:
-    case 0x81:
-    case 0xA1:
-    case 0xC1:
-    case 0xE1: {
-        uint8_t arg = fetch();
-        logf(log_level::instr, "($%02x,X)", arg);
-        current_instruction.set_mode(adr_mode::x_indexed_zero_page_indirect);
-        current_instruction.set_argument(arg);
-        return (*bus)[indirect_x(arg)];
+    logf(log_level::instr, "\n");
+}
+
+void core6502::execute() {
+    auto const &instruction = decode(pp);
+    start_instruction(instruction);
+    (this->*instruction.fn)();
+    finish_instruction(instruction);
+}
+
+core6502::block_op const *core6502::run_single(block_op const *op) {
+    start_instruction(op->instruction);
+    (this->*op->instruction.fn)();
+    finish_instruction(op->instruction);
+    return op + 1;
+}
+
+// Both handlers are known at compile time, so the pair is inlined into a
+// single handler without dispatching in between.
+template <uint8_t first, uint8_t second>
+core6502::block_op const *core6502::run_fused(block_op const *op) {
+    start_instruction(op[0].instruction);
+    execute_op<opcode_table[first].name, opcode_table[first].mode>();
+    finish_instruction(op[0].instruction);
+    if (cycles >= target_cycle || faulted || code_invalidated)
+        return op + 1;
+    start_instruction(op[1].instruction);
+    execute_op<opcode_table[second].name, opcode_table[second].mode>();
+    finish_instruction(op[1].instruction);
+    return op + 2;
+}
+
+core6502::block_handler core6502::fused_handler(uint8_t first,
+                                                uint8_t second) {
+    constexpr auto handlers = []<std::size_t... i>(std::index_sequence<i...>) {
+        return std::array<block_handler, fused_pairs.size()>{
+            &core6502::run_fused<fused_pairs[i].first,
+                                 fused_pairs[i].second>...};
+    }(std::make_index_sequence<fused_pairs.size()>{});
+    for (std::size_t i{0}; i < fused_pairs.size(); ++i) {
+        if (fused_pairs[i] == std::pair{first, second})
+            return handlers[i];
     }
-    case 0x11:
-    case 0x31:
-    case 0x51:
-    case 0x71:
-    case 0x91:
-    case 0xB1:
-    case 0xD1:
-    case 0xF1: {
-        uint8_t arg = fetch();
-        logf(log_level::instr, "($%02x),Y", arg);
-        current_instruction.set_mode(adr_mode::zero_page_indirect_y_indexed);
-        current_instruction.set_argument(arg);
-        return (*bus)[indirect_y(arg)];
+    return nullptr;
+}
+
+void core6502::build_block(uint16_t adr, block &b) {
+    auto &ops = b.ops;
+    uint16_t const start = adr;
+    while (ops.size() < max_block_size) {
+        auto const &instruction = decode(adr);
+        if (&instruction == &uncached)
+            break;
+        ops.push_back({&core6502::run_single, instruction});
+        adr += instruction.size;
+        // Blocks stay within their page so it can be invalidated on its own.
+        if (ends_block(opcode_table[instruction.opcode].name) ||
+            adr % code_page_size == 0)
+            break;
     }
-    default:
-        logf(log_level::error, "Unsupported opcode for bus_val %#4x", opcode);
-        faulted = true;
-        return value_proxy{static_cast<uint8_t>(0)};
+    if (ops.empty())
+        return;
+    // A short loop branching back to its own start that only polls memory.
+    auto const &last = ops.back().instruction;
+    b.idle_loop =
+        ops.size() <= max_idle_loop_size &&
+        is_branch(opcode_table[last.opcode].name) &&
+        static_cast<uint16_t>(adr + static_cast<int8_t>(last.operand_low)) ==
+            start &&
+        std::all_of(ops.begin(), ops.end() - 1, [](block_op const &op) {
+            return polls_memory(op.instruction.opcode,
+                                op.instruction.operand_low,
+                                op.instruction.operand_high);
+        });
+    match_native_loop(b, start);
+    for (std::size_t i{0}; i + 1 < ops.size(); ++i) {
+        auto const fused = fused_handler(ops[i].instruction.opcode,
+                                         ops[i + 1].instruction.opcode);
+        if (fused) {
+            ops[i].run = fused;
+            ++i;
+        }
     }
-    logf(log_level::instr, " ");
 }
 
-void core6502::execute() {
-    current_instruction = {};
-    current_instruction.set_pp(pp);
-    logf(log_level::instr, "%#06x: ", pp);
-    uint8_t opcode = fetch();
-    switch (opcode) {
-    case 0xA1:
-    case 0xA5:
-    case 0xA9:
-    case 0xAD:
-    case 0xB1:
-    case 0xB5:
-    case 0xB9:
-    case 0xBD:
-        logf(log_level::instr, "LDA");
-        current_instruction.set_mnemonic("LDA");
-        LDA(bus_val(opcode).value());
-        break;
-    case 0xA0:
-    case 0xA4:
-    case 0xAC:
-    case 0xB4:
-    case 0xBC:
-        logf(log_level::instr, "LDY");
-        current_instruction.set_mnemonic("LDY");
-        LDY(bus_val(opcode).value());
-        break;
-    case 0xA2:
-    case 0xA6:
-    case 0xAE:
-    case 0xB6:
-    case 0xBE:
-        logf(log_level::instr, "LDX");
-        current_instruction.set_mnemonic("LDX");
-        LDX(bus_val(opcode).value());
-        break;
-    case 0x61:
-    case 0x65:
-    case 0x69:
-    case 0x6D:
-    case 0x71:
-    case 0x75:
-    case 0x79:
-    case 0x7D:
-        logf(log_level::instr, "ADC");
-        current_instruction.set_mnemonic("ADC");
-        ADC(bus_val(opcode).value());
-        break;
-    case 0xE1:
-    case 0xE5:
-    case 0xE9:
-    case 0xED:
-    case 0xF1:
-    case 0xF5:
-    case 0xF9:
-    case 0xFD:
-        logf(log_level::instr, "SBC");
-        current_instruction.set_mnemonic("SBC");
-        SBC(bus_val(opcode).value());
-        break;
-    case 0x21:
-    case 0x25:
-    case 0x29:
-    case 0x2D:
-    case 0x31:
-    case 0x35:
-    case 0x39:
-    case 0x3D:
-        logf(log_level::instr, "AND");
-        current_instruction.set_mnemonic("AND");
-        AND(bus_val(opcode).value());
-        break;
-    case 0x01:
-    case 0x05:
-    case 0x09:
-    case 0x0D:
-    case 0x11:
-    case 0x15:
-    case 0x19:
-    case 0x1D:
-        logf(log_level::instr, "ORA");
-        current_instruction.set_mnemonic("ORA");
-        ORA(bus_val(opcode).value());
-        break;
-    case 0x41:
-    case 0x45:
-    case 0x49:
-    case 0x4D:
-    case 0x51:
-    case 0x55:
-    case 0x59:
-    case 0x5D:
-        logf(log_level::instr, "EOR");
-        current_instruction.set_mnemonic("EOR");
-        EOR(bus_val(opcode).value());
-        break;
-    case 0xC1:
-    case 0xC5:
-    case 0xC9:
-    case 0xCD:
-    case 0xD1:
-    case 0xD5:
-    case 0xD9:
-    case 0xDD:
-        logf(log_level::instr, "CMP");
-        current_instruction.set_mnemonic("CMP");
-        CMP(bus_val(opcode).value());
-        break;
-    case 0xE0:
-    case 0xE4:
-    case 0xEC:
-        logf(log_level::instr, "CPX");
-        current_instruction.set_mnemonic("CPX");
-        CPX(bus_val(opcode).value());
-        break;
-    case 0xC0:
-    case 0xC4:
-    case 0xCC:
-        logf(log_level::instr, "CPY");
-        current_instruction.set_mnemonic("CPY");
-        CPY(bus_val(opcode).value());
-        break;
-    case 0x24:
-    case 0x2C:
-        logf(log_level::instr, "BIT");
-        current_instruction.set_mnemonic("BIT");
-        BIT(bus_val(opcode).value());
-        break;
-    case 0x0A:
-        logf(log_level::instr, "ASL");
-        current_instruction.set_mnemonic("ASL");
-        current_instruction.set_mode(adr_mode::accumulator);
-        ASL();
-        break;
-    case 0x06:
-    case 0x0E:
-    case 0x16:
-    case 0x1E:
-    case 0x46:
-    case 0x4E:
-    case 0x56:
-    case 0x5E:
-        logf(log_level::instr, "ASL");
-        current_instruction.set_mnemonic("ASL");
-        ASL(bus_val(opcode));
-        break;
-    case 0x4A:
-        logf(log_level::instr, "LSR");
-        current_instruction.set_mnemonic("LSR");
-        current_instruction.set_mode(adr_mode::accumulator);
-        LSR();
-        break;
-    case 0x2A:
-        logf(log_level::instr, "ROL");
-        current_instruction.set_mnemonic("ROL");
-        current_instruction.set_mode(adr_mode::accumulator);
-        ROL();
-        break;
-    case 0x26:
-    case 0x2E:
-    case 0x36:
-    case 0x3E:
-        logf(log_level::instr, "ROL");
-        current_instruction.set_mnemonic("ROL");
-        ROL(bus_val(opcode));
-        break;
-    case 0x6A:
-        logf(log_level::instr, "ROR");
-        current_instruction.set_mnemonic("ROR");
-        current_instruction.set_mode(adr_mode::accumulator);
-        ROR();
-        break;
-    case 0x66:
-    case 0x6E:
-    case 0x76:
-    case 0x7E:
-        logf(log_level::instr, "ROR");
-        current_instruction.set_mnemonic("ROR");
-        ROR(bus_val(opcode));
-        break;
-    case 0x81:
-    case 0x85:
-    case 0x8D:
-    case 0x91:
-    case 0x95:
-    case 0x99:
-    case 0x9D:
-        logf(log_level::instr, "STA");
-        current_instruction.set_mnemonic("STA");
-        STA(bus_val(opcode));
-        break;
-    case 0x86:
-    case 0x8E:
-    case 0x96:
-        logf(log_level::instr, "STX");
-        current_instruction.set_mnemonic("STX");
-        STX(bus_val(opcode));
-        break;
-    case 0x84:
-    case 0x8C:
-    case 0x94:
-        logf(log_level::instr, "STY");
-        current_instruction.set_mnemonic("STY");
-        STY(bus_val(opcode));
-        break;
-    case 0xF0:
-        logf(log_level::instr, "BEQ");
-        current_instruction.set_mnemonic("BEQ");
-        BEQ(bus_val(opcode).value());
-        break;
-    case 0x30:
-        logf(log_level::instr, "BMI");
-        current_instruction.set_mnemonic("BMI");
-        BMI(bus_val(opcode).value());
-        break;
-    case 0xD0:
-        logf(log_level::instr, "BNE");
-        current_instruction.set_mnemonic("BNE");
-        BNE(bus_val(opcode).value());
-        break;
-    case 0xB0:
-        logf(log_level::instr, "BCS");
-        current_instruction.set_mnemonic("BCS");
-        BCS(bus_val(opcode).value());
-        break;
-    case 0x90:
-        logf(log_level::instr, "BCC");
-        current_instruction.set_mnemonic("BCC");
-        BCC(bus_val(opcode).value());
+// Matches loops counting X or Y up or down to zero that either fill memory
+// with A or copy from memory to memory or PPUDATA:
+//   STA $0200,X; STA $0300,X; ...; INX; BNE
+//   LDA ($10),Y; STA $2007; INY; BNE
+void core6502::match_native_loop(block &b, uint16_t start) {
+    auto const &ops = b.ops;
+    if (ops.size() < 3 || ops.size() > 6)
+        return;
+    uint16_t end = start;
+    for (auto const &op : ops) {
+        end += op.instruction.size;
+    }
+    auto const &branch = ops.back().instruction;
+    if (opcode_table[branch.opcode].name != mnemonic::BNE ||
+        static_cast<uint16_t>(end + static_cast<int8_t>(branch.operand_low)) !=
+            start)
+        return;
+    switch (opcode_table[ops[ops.size() - 2].instruction.opcode].name) {
+    case mnemonic::INX:
         break;
-    case 0x10:
-        logf(log_level::instr, "BPL");
-        current_instruction.set_mnemonic("BPL");
-        BPL(bus_val(opcode).value());
+    case mnemonic::DEX:
+        b.loop_decrement = true;
         break;
-    case 0x50:
-        logf(log_level::instr, "BVC");
-        current_instruction.set_mnemonic("BVC");
-        BVC(bus_val(opcode).value());
+    case mnemonic::INY:
+        b.loop_index_y = true;
         break;
-    case 0x20: {
-        logf(log_level::instr, "JSR");
-        current_instruction.set_mnemonic("JSR");
-        uint8_t low_adr = fetch();
-        uint8_t high_adr = fetch();
-        logf(log_level::instr, "$%02x%02x", high_adr, low_adr);
-        current_instruction.set_mode(adr_mode::absolute);
-        current_instruction.set_argument((high_adr << 8) + low_adr);
-        JSR(absolute(low_adr, high_adr));
+    case mnemonic::DEY:
+        b.loop_index_y = true;
+        b.loop_decrement = true;
         break;
+    default:
+        return;
     }
-    case 0x4C: {
-        logf(log_level::instr, "JMP");
-        current_instruction.set_mnemonic("JMP");
-        uint8_t low_adr = fetch();
-        uint8_t high_adr = fetch();
-        logf(log_level::instr, "$%02x%02x", high_adr, low_adr);
-        current_instruction.set_mode(adr_mode::absolute);
-        current_instruction.set_argument((high_adr << 8) + low_adr);
-        JMP(absolute(low_adr, high_adr));
-        break;
+    auto const is = [](decoded_instruction const &instruction, mnemonic name,
+                       adr_mode mode) {
+        auto const &decoded = opcode_table[instruction.opcode];
+        return decoded.name == name && decoded.mode == mode;
+    };
+    auto const indexed = b.loop_index_y ? adr_mode::y_indexed_absolute
+                                        : adr_mode::x_indexed_absolute;
+    auto const indexed_store = [&](decoded_instruction const &instruction) {
+        return is(instruction, mnemonic::STA, indexed) ||
+               (!b.loop_index_y &&
+                is(instruction, mnemonic::STA, adr_mode::x_indexed_zero_page));
+    };
+    auto const body = std::span{ops}.first(ops.size() - 2);
+    if (std::all_of(body.begin(), body.end(), [&](block_op const &op) {
+            return indexed_store(op.instruction);
+        })) {
+        b.loop = native_loop::fill;
+        return;
     }
-    case 0x6C: {
-        logf(log_level::instr, "JMP");
-        current_instruction.set_mnemonic("JMP");
-        uint8_t low_adr = fetch();
-        uint8_t high_adr = fetch();
-        logf(log_level::instr, "($%02x%02x)", high_adr, low_adr);
-        current_instruction.set_mode(adr_mode::absolute_indirect);
-        current_instruction.set_argument((high_adr << 8) + low_adr);
-        JMP(indirect(low_adr, high_adr));
-        break;
+    if (body.size() != 2)
+        return;
+    auto const &load = body[0].instruction;
+    auto const &store = body[1].instruction;
+    bool const ppu_data =
+        is(store, mnemonic::STA, adr_mode::absolute) &&
+        store.operand_high >= 0x20 && store.operand_high < 0x40 &&
+        store.operand_low % 8 == 7;
+    if ((is(load, mnemonic::LDA, indexed) ||
+         (b.loop_index_y &&
+          is(load, mnemonic::LDA, adr_mode::zero_page_indirect_y_indexed))) &&
+        (ppu_data || indexed_store(store))) {
+        b.loop = native_loop::copy;
     }
-    case 0x40:
-        logf(log_level::instr, "RTI");
-        current_instruction.set_mnemonic("RTI");
-        RTI();
-        break;
-    case 0x60:
-        logf(log_level::instr, "RTS");
-        current_instruction.set_mnemonic("RTS");
-        RTS();
-        break;
-    case 0xE6:
-    case 0xEE:
-    case 0xF6:
-    case 0xFE:
-        logf(log_level::instr, "INC");
-        current_instruction.set_mnemonic("INC");
-        INC(bus_val(opcode));
-        break;
-    case 0xC6:
-    case 0xCE:
-    case 0xD6:
-    case 0xDE:
-        logf(log_level::instr, "DEC");
-        current_instruction.set_mnemonic("DEC");
-        DEC(bus_val(opcode));
-        break;
-    case 0xE8:
-        logf(log_level::instr, "INX");
-        current_instruction.set_mnemonic("INX");
-        current_instruction.set_mode(adr_mode::implied);
-        INX();
-        break;
-    case 0xC8:
-        logf(log_level::instr, "INY");
-        current_instruction.set_mnemonic("INY");
-        current_instruction.set_mode(adr_mode::implied);
-        INY();
-        break;
-    case 0x48:
-        logf(log_level::instr, "PHA");
-        current_instruction.set_mnemonic("PHA");
-        current_instruction.set_mode(adr_mode::implied);
-        PHA();
-        break;
-    case 0x68:
-        logf(log_level::instr, "PLA");
-        current_instruction.set_mnemonic("PLA");
-        current_instruction.set_mode(adr_mode::implied);
-        PLA();
-        break;
-    case 0xAA:
-        logf(log_level::instr, "TAX");
-        current_instruction.set_mnemonic("TAX");
-        current_instruction.set_mode(adr_mode::implied);
-        TAX();
-        break;
-    case 0x8A:
-        logf(log_level::instr, "TXA");
-        current_instruction.set_mnemonic("TXA");
-        current_instruction.set_mode(adr_mode::implied);
-        TXA();
-        break;
-    case 0xA8:
-        logf(log_level::instr, "TAY");
-        current_instruction.set_mnemonic("TAY");
-        current_instruction.set_mode(adr_mode::implied);
-        TAY();
-        break;
-    case 0x98:
-        logf(log_level::instr, "TYA");
-        current_instruction.set_mnemonic("TYA");
-        current_instruction.set_mode(adr_mode::implied);
-        TYA();
-        break;
-    case 0x9A:
-        logf(log_level::instr, "TXS");
-        current_instruction.set_mnemonic("TXS");
-        current_instruction.set_mode(adr_mode::implied);
-        TXS();
-        break;
-    case 0xCA:
-        logf(log_level::instr, "DEX");
-        current_instruction.set_mnemonic("DEX");
-        current_instruction.set_mode(adr_mode::implied);
-        DEX();
-        break;
-    case 0x88:
-        logf(log_level::instr, "DEY");
-        current_instruction.set_mnemonic("DEY");
-        current_instruction.set_mode(adr_mode::implied);
-        DEY();
-        break;
-    case 0x38:
-        logf(log_level::instr, "SEC");
-        current_instruction.set_mnemonic("SEC");
-        current_instruction.set_mode(adr_mode::implied);
-        SEC();
-        break;
-    case 0x78:
-        logf(log_level::instr, "SEI");
-        current_instruction.set_mnemonic("SEI");
-        current_instruction.set_mode(adr_mode::implied);
-        SEI();
-        break;
-    case 0x18:
-        logf(log_level::instr, "CLC");
-        current_instruction.set_mnemonic("CLC");
-        current_instruction.set_mode(adr_mode::implied);
-        CLC();
-        break;
-    case 0xD8:
-        logf(log_level::instr, "CLD");
-        current_instruction.set_mnemonic("CLD");
-        current_instruction.set_mode(adr_mode::implied);
-        CLD();
-        break;
-    case 0x08:
-        logf(log_level::instr, "PHP");
-        current_instruction.set_mnemonic("PHP");
-        current_instruction.set_mode(adr_mode::implied);
-        PHP();
-        break;
-    case 0x28:
-        logf(log_level::instr, "PLP");
-        current_instruction.set_mnemonic("PLP");
-        current_instruction.set_mode(adr_mode::implied);
-        PLP();
-        break;
-    case 0x00:
-        logf(log_level::instr, "BRK");
-        current_instruction.set_mnemonic("BRK");
-        current_instruction.set_mode(adr_mode::implied);
-        BRK();
-        break;
-    default:
-        logf(log_level::error, "Unrecognized instruction %#04x\n", opcode);
-        faulted = true;
-        break;
+}
+
+core6502::block const *core6502::find_block() {
+    if (pp < prg_rom_start)
+        return nullptr;
+    auto &b = get_code_page(pp).blocks[pp % code_page_size];
+    if (b.ops.empty())
+        build_block(pp, b);
+    return b.ops.empty() ? nullptr : &b;
+}
+
+void core6502::run_block(block const &b) {
+    code_invalidated = false;
+    bool const idle_loop = b.idle_loop && idle_loop_skipping;
+    if (!idle_loop || pp != idle_loop_pp) {
+        idle_loop_iterations = 0;
+        idle_loop_pp = pp;
     }
-    logf(log_level::instr, "\n");
-    store.push(current_instruction);
+    if (b.loop != native_loop::none && run_native_loop(b))
+        return;
+    state entry{};
+    if (idle_loop)
+        entry = dump_state();
+    uint64_t const entry_cycles = cycles;
+
+    auto const *op = b.ops.data();
+    auto const *const end = op + b.ops.size();
+    while (op != end && cycles < target_cycle && !faulted &&
+           !code_invalidated) {
+        op = (this->*op->run)(op);
+    }
+
+    if (idle_loop && op == end && pp == idle_loop_pp && !faulted &&
+        !code_invalidated) {
+        ++idle_loop_iterations;
+        skip_idle_loop(entry, cycles - entry_cycles);
+    }
+}
+
+// Runs as many iterations of a matched fill or copy loop as the cycle budget
+// allows without interpreting them. Iterations touching anything but RAM,
+// ROM or PPUDATA are left to the interpreter. Returns false if no iteration
+// was run.
+bool core6502::run_native_loop(block const &b) {
+    uint16_t const start = pp;
+    uint16_t end = start;
+    unsigned base_cycles{0};
+    for (auto const &op : b.ops) {
+        end += op.instruction.size;
+        base_cycles += op.instruction.cycles;
+    }
+    bool const branch_page_crossed = (start >> 8) != (end >> 8);
+    auto &index = b.loop_index_y ? y : x;
+    uint8_t const first = index;
+    // Iterations until the counter reaches zero.
+    unsigned const iterations = first == 0        ? 256
+                                : b.loop_decrement ? first
+                                                   : 256 - first;
+    auto const counter = [&](unsigned i) -> uint8_t {
+        return b.loop_decrement ? first - i : first + i;
+    };
+    auto const is_ram = [](unsigned adr) { return adr < 0x2000; };
+    auto const is_rom = [](unsigned adr) {
+        return adr >= prg_rom_start && adr <= 0xFFFF;
+    };
+
+    auto const &load = b.ops[0].instruction;
+    auto const &load_mode = opcode_table[load.opcode].mode;
+    // Copy source before indexing.
+    unsigned source{};
+    if (b.loop == native_loop::copy) {
+        source = load_mode == adr_mode::zero_page_indirect_y_indexed
+                     ? bus->read(load.operand_low) +
+                           (bus->read(load.operand_low + 1) << 8)
+                     : load.operand_low + (load.operand_high << 8);
+    }
+    // Address of an indexed store, or -1 if it is not plain RAM.
+    auto const store_address = [&](decoded_instruction const &store,
+                                   uint8_t i) -> int {
+        auto const mode = opcode_table[store.opcode].mode;
+        unsigned const adr =
+            mode == adr_mode::x_indexed_zero_page
+                ? store.operand_low + i
+                : store.operand_low + (store.operand_high << 8) + i;
+        // Zero page indexing wraps, keep fills contiguous instead.
+        if (mode == adr_mode::x_indexed_zero_page && adr > 0xFF)
+            return -1;
+        return is_ram(adr) ? static_cast<int>(adr) : -1;
+    };
+    auto const &copy_store = b.ops[1].instruction;
+    bool const ppu_data = b.loop == native_loop::copy &&
+                          opcode_table[copy_store.opcode].mode ==
+                              adr_mode::absolute;
+
+    // Count the iterations that fit the budget and only touch memory
+    // without side effects, charging exactly the interpreted cycles.
+    unsigned count{0};
+    uint64_t loop_cycles{0};
+    for (; count < iterations; ++count) {
+        uint8_t const i = counter(count);
+        uint64_t iteration_cycles = base_cycles;
+        if (b.loop == native_loop::copy) {
+            unsigned const adr = source + i;
+            if (!is_ram(adr) && !is_rom(adr))
+                break;
+            if (opcode_table[load.opcode].page_penalty &&
+                (adr >> 8) != (source >> 8))
+                ++iteration_cycles;
+            if (!ppu_data) {
+                auto const destination = store_address(copy_store, i);
+                if (destination < 0)
+                    break;
+                // The interpreter would reload a pointer overwritten by the
+                // copy.
+                int const offset = destination % 0x800 - load.operand_low;
+                if (load_mode == adr_mode::zero_page_indirect_y_indexed &&
+                    (offset == 0 || offset == 1))
+                    break;
+            }
+        } else if (std::any_of(b.ops.begin(), b.ops.end() - 2,
+                               [&](block_op const &op) {
+                                   return store_address(op.instruction, i) <
+                                          0;
+                               })) {
+            break;
+        }
+        // Taken branch back to the start.
+        if (count + 1 < iterations)
+            iteration_cycles += branch_page_crossed ? 2 : 1;
+        if (cycles + loop_cycles + iteration_cycles > target_cycle)
+            break;
+        loop_cycles += iteration_cycles;
+    }
+    if (count == 0)
+        return false;
+
+    if (b.loop == native_loop::fill) {
+        // The counter values visited as at most two runs of consecutive
+        // values, one more when counting down from zero.
+        auto const fill = [&](uint8_t low, unsigned size) {
+            for (auto it = b.ops.begin(); it != b.ops.end() - 2; ++it) {
+                bus->fill_ram(store_address(it->instruction, low), size,
+                              accumulator);
+            }
+        };
+        if (!b.loop_decrement) {
+            fill(first, count);
+        } else if (first != 0) {
+            fill(first - count + 1, count);
+        } else {
+            fill(0, 1);
+            if (count > 1)
+                fill(257 - count, count - 1);
+        }
+    } else {
+        std::array<uint8_t, 256> data{};
+        for (unsigned n{0}; n < count; ++n) {
+            uint8_t const i = counter(n);
+            data[n] = bus->read(source + i);
+            if (!ppu_data)
+                bus->write(store_address(copy_store, i), data[n]);
+        }
+        if (ppu_data)
+            bus->write_ppu_data(std::span{data}.first(count));
+        set_accumulator(data[count - 1]);
+    }
+
+    uint16_t adr = start;
+    for (auto const &op : b.ops) {
+        store.push(adr, op.instruction.opcode, op.instruction.operand_low,
+                   op.instruction.operand_high);
+        adr += op.instruction.size;
+    }
+    index = counter(count);
+    set_zero_flag(index);
+    set_negative_flag(index);
+    cycles += loop_cycles;
+    pp = count == iterations ? end : start;
+    return true;
+}
+
+void core6502::skip_idle_loop(state const &entry, uint64_t iteration_cycles) {
+    // The first iteration may have had side effects, such as reading
+    // PPUSTATUS clearing vblank. After that the reads are repeatable, so if
+    // an iteration ends in the state it started in, every following
+    // iteration does the same until something outside the CPU changes
+    // memory. Nothing does during run_until(), so whole iterations up to
+    // the cycle budget are skipped and the rest is interpreted as usual.
+    if (idle_loop_iterations < 2 || dump_state() != entry)
+        return;
+    auto const skipped =
+        (target_cycle - std::min(cycles, target_cycle)) / iteration_cycles *
+        iteration_cycles;
+    cycles += skipped;
+    skipped_cycles += skipped;
 }
 
 uint16_t core6502::zero(uint8_t adr) { return adr; }
@@ -736,11 +691,15 @@ uint16_t core6502::absolute(uint8_t low, uint8_t high) {
 }
 
 uint16_t core6502::absolute_x(uint8_t low, uint8_t high) {
-    return (high << 8) + low + x;
+    uint16_t mod_adr = (high << 8) + low + x;
+    page_crossed = (mod_adr >> 8) != high;
+    return mod_adr;
 }
 
 uint16_t core6502::absolute_y(uint8_t low, uint8_t high) {
-    return (high << 8) + low + y;
+    uint16_t mod_adr = (high << 8) + low + y;
+    page_crossed = (mod_adr >> 8) != high;
+    return mod_adr;
 }
 
 uint16_t core6502::indirect_x(uint8_t adr) {
@@ -754,6 +713,7 @@ uint16_t core6502::indirect_y(uint8_t adr) {
     uint8_t high = bus->read(adr + 1);
     uint16_t raw_adr = low + (high << 8);
     uint16_t mod_adr = raw_adr + y;
+    page_crossed = (mod_adr >> 8) != high;
     return mod_adr;
 }
 
@@ -836,7 +796,9 @@ void core6502::AND(uint8_t val) {
 
 void core6502::ASL() { set_accumulator(ASL(accumulator)); }
 
-void core6502::ASL(value_proxy val) { val.set(ASL(val.value())); }
+void core6502::ASL(value_proxy val) {
+    val.modify([this](uint8_t v) { return ASL(v); });
+}
 
 uint8_t core6502::ASL(uint8_t val) {
     // Set carry flag
@@ -913,7 +875,9 @@ void core6502::BIT(uint8_t val) {
 
 void core6502::LSR() { set_accumulator(LSR(accumulator)); }
 
-void core6502::LSR(value_proxy val) { val.set(LSR(val.value())); }
+void core6502::LSR(value_proxy val) {
+    val.modify([this](uint8_t v) { return LSR(v); });
+}
 
 uint8_t core6502::LSR(uint8_t val) {
     if (0x01 & val)
@@ -930,7 +894,9 @@ void core6502::ROL() {
     set_zero_flag(accumulator);
 }
 
-void core6502::ROL(value_proxy val) { val.set(ROL(val.value())); }
+void core6502::ROL(value_proxy val) {
+    val.modify([this](uint8_t v) { return ROL(v); });
+}
 
 uint8_t core6502::ROL(uint8_t val) {
     bool carry_set = status & carry_flag;
@@ -949,7 +915,9 @@ void core6502::ROR() {
     set_zero_flag(accumulator);
 }
 
-void core6502::ROR(value_proxy val) { val.set(ROR(val.value())); }
+void core6502::ROR(value_proxy val) {
+    val.modify([this](uint8_t v) { return ROR(v); });
+}
 
 uint8_t core6502::ROR(uint8_t val) {
     bool carry_set = status & carry_flag;
@@ -976,9 +944,10 @@ void core6502::EOR(uint8_t val) {
 }
 
 void core6502::INC(value_proxy val) {
-    val.set(val.value() + 1);
-    set_zero_flag(val.value());
-    set_negative_flag(val.value());
+    uint8_t const res =
+        val.modify([](uint8_t v) { return static_cast<uint8_t>(v + 1); });
+    set_zero_flag(res);
+    set_negative_flag(res);
 }
 
 void core6502::INX() {
@@ -1032,9 +1001,10 @@ void core6502::TYA() {
 void core6502::TXS() { set_sp(x); }
 
 void core6502::DEC(value_proxy val) {
-    val.set(val.value() - 1);
-    set_zero_flag(val.value());
-    set_negative_flag(val.value());
+    uint8_t const res =
+        val.modify([](uint8_t v) { return static_cast<uint8_t>(v - 1); });
+    set_zero_flag(res);
+    set_negative_flag(res);
 }
 
 void core6502::DEX() {
@@ -1057,53 +1027,47 @@ void core6502::CLC() { status &= ~carry_flag; }
 
 void core6502::CLD() { status &= ~decimal_flag; }
 
+void core6502::branch(uint8_t offset) {
+    int8_t sval = (int8_t)offset;
+    uint16_t target = pp + sval;
+    // A taken branch costs one extra cycle, two if it crosses a page.
+    cycles += (target >> 8) == (pp >> 8) ? 1 : 2;
+    set_pp(target);
+}
+
 void core6502::BEQ(uint8_t val) {
-    if (status & zero_flag) {
-        int8_t sval = (int8_t)val;
-        set_pp(pp + sval);
-    }
+    if (status & zero_flag)
+        branch(val);
 }
 
 void core6502::BMI(uint8_t val) {
-    if (status & negative_flag) {
-        int8_t sval = (int8_t)val;
-        set_pp(pp + sval);
-    }
+    if (status & negative_flag)
+        branch(val);
 }
 
 void core6502::BNE(uint8_t val) {
-    if (!(status & zero_flag)) {
-        int8_t sval = (int8_t)val;
-        set_pp(pp + sval);
-    }
+    if (!(status & zero_flag))
+        branch(val);
 }
 
 void core6502::BCS(uint8_t val) {
-    if (status & carry_flag) {
-        int8_t sval = (int8_t)val;
-        set_pp(pp + sval);
-    }
+    if (status & carry_flag)
+        branch(val);
 }
 
 void core6502::BCC(uint8_t val) {
-    if (!(status & carry_flag)) {
-        int8_t sval = (int8_t)val;
-        set_pp(pp + sval);
-    }
+    if (!(status & carry_flag))
+        branch(val);
 }
 
 void core6502::BPL(uint8_t val) {
-    if (!(status & negative_flag)) {
-        int8_t sval = (int8_t)val;
-        set_pp(pp + sval);
-    }
+    if (!(status & negative_flag))
+        branch(val);
 }
 
 void core6502::BVC(uint8_t val) {
-    if (!(status & overflow_flag)) {
-        int8_t sval = (int8_t)val;
-        set_pp(pp + sval);
-    }
+    if (!(status & overflow_flag))
+        branch(val);
 }
 
 void core6502::pushpp() {
@@ -2,10 +2,15 @@
 #include "fmt/ostream.h"
 #include "instruction_store.h"
 #include "mem.h"
+#include "opcodes.h"
+#include <array>
 #include <cstdint>
-#include <functional>
 #include <memory>
 #include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 struct state {
     uint8_t status{};
@@ -23,24 +28,53 @@ template <> struct fmt::formatter<state> : fmt::ostream_formatter {};
 
 class core6502 final {
   public:
-    core6502(std::unique_ptr<memory_bus> bus, std::function<bool()> irq_func);
+    // Interrupts and device events come from the scheduler of bus.
+    explicit core6502(std::unique_ptr<memory_bus> bus);
+    ~core6502();
     void cycle();
+    // Execute instructions until at least target_cycle cycles have elapsed.
+    void run_until(uint64_t target_cycle);
+    // Take a pending NMI or IRQ.
     void interrupt();
     void nmi();
     void irq();
 
     void setpp(uint16_t new_pp);
+    uint16_t get_pp() const { return pp; }
+
+    // Statically recompiled code, see tools/recompile.cpp. A static block
+    // runs instructions starting at the current pp and returns when it
+    // reaches the end of its block or execute_static() refuses to continue.
+    using static_block = void (*)(core6502 &cpu);
+    void add_static_block(uint16_t adr, static_block block);
+    // Execute a single instruction with opcode code at pp. Returns false
+    // without executing when the cycle budget is spent, the CPU faulted or
+    // code was invalidated, the caller then returns to run_until().
+    template <uint8_t code> bool execute_static(uint8_t low, uint8_t high);
 
     uint8_t get_acc();
     uint8_t get_x() { return x; };
+    uint64_t get_cycles() const { return cycles; }
     bool is_faulted();
     state dump_state();
+    // Record executed instructions for the disassembly written on exit.
+    // On by default.
+    void set_recording(bool enabled) { store.set_enabled(enabled); }
+    void write_disassembly(std::string const &filename) const {
+        store.write(filename);
+    }
+    // Skip whole iterations of loops that only poll memory which cannot
+    // change before the end of run_until(), e.g. waiting for vblank. On by
+    // default, turn off to interpret every iteration.
+    void set_idle_loop_skipping(bool enabled) { idle_loop_skipping = enabled; }
+    // Cycles skipped in idle loops since the last call.
+    uint64_t take_skipped_cycles() { return std::exchange(skipped_cycles, 0); }
 
   private:
     const uint16_t stack_offs{0x100};
 
     std::unique_ptr<memory_bus> const bus{};
-    std::function<bool()> const irq_func{};
+    event_scheduler &events;
 
     // status register
     uint8_t status{};
@@ -56,17 +90,123 @@ class core6502 final {
     uint16_t pp{};
     bool faulted{};
 
-    instruction_info current_instruction{};
+    // Elapsed CPU cycles since power on.
+    uint64_t cycles{};
+    // Cycle budget of the current run_until(), up to the next event. The
+    // scheduler lowers it for events and interrupts posted during a block.
+    uint64_t target_cycle{};
+    // Set when indexed addressing crossed a page boundary.
+    bool page_crossed{};
+
+    // Instruction being executed
+    uint8_t opcode{};
+    uint8_t operand_low{};
+    uint8_t operand_high{};
+
     instruction_store store{};
 
-    uint8_t fetch();
     void push(uint8_t val);
     uint8_t pop();
-    value_proxy bus_val(uint8_t opcode);
     void pushpp();
 
     void execute();
 
+    // Dispatch
+    using handler = void (core6502::*)();
+
+    struct decoded_instruction {
+        handler fn{};
+        uint8_t opcode{};
+        uint8_t operand_low{};
+        uint8_t operand_high{};
+        // Opcode and operand bytes
+        uint8_t size{};
+        uint8_t cycles{};
+        bool page_penalty{};
+    };
+    decoded_instruction decode_from_bus(uint16_t adr);
+    // Cached for PRG ROM, otherwise returns a copy in uncached.
+    decoded_instruction const &decode(uint16_t adr);
+    decoded_instruction uncached{};
+    void start_instruction(decoded_instruction const &instruction);
+    void finish_instruction(decoded_instruction const &instruction);
+
+    // Basic blocks are straight-line runs of PRG ROM instructions ending at
+    // the first instruction that can branch. They are executed without
+    // returning to run_until().
+    struct block_op;
+    using block_handler = block_op const *(core6502::*)(block_op const *);
+    struct block_op {
+        // Runs one or more instructions, returns the next op.
+        block_handler run{};
+        decoded_instruction instruction{};
+    };
+    block_op const *run_single(block_op const *op);
+    template <uint8_t first, uint8_t second>
+    block_op const *run_fused(block_op const *op);
+    static block_handler fused_handler(uint8_t first, uint8_t second);
+    // Memory clear and copy loops run natively, see match_native_loop().
+    enum class native_loop : uint8_t { none, fill, copy };
+    struct block {
+        std::vector<block_op> ops{};
+        // Branches back to its start and only reads memory without side
+        // effects, see build_block().
+        bool idle_loop{};
+        native_loop loop{};
+        // Loop counter is Y rather than X.
+        bool loop_index_y{};
+        // Loop counter is decremented rather than incremented.
+        bool loop_decrement{};
+    };
+    void build_block(uint16_t adr, block &b);
+    static void match_native_loop(block &b, uint16_t start);
+    block const *find_block();
+    void run_block(block const &b);
+    bool run_native_loop(block const &b);
+
+    // Idle loop skipping
+    bool idle_loop_skipping{true};
+    uint64_t skipped_cycles{};
+    // Start of the idle loop being run and how many iterations in a row
+    // have completed.
+    uint16_t idle_loop_pp{};
+    uint32_t idle_loop_iterations{};
+    void skip_idle_loop(state const &entry, uint64_t iteration_cycles);
+
+    // Code caches for one 4 K page of PRG ROM. Cached instructions and blocks
+    // never cross a page so pages can be invalidated independently.
+    static constexpr uint16_t code_page_size{0x1000};
+    struct code_page {
+        // Predecoded instructions, filled on first execution.
+        std::array<decoded_instruction, code_page_size> decoded{};
+        // Blocks by start address, empty until first executed.
+        std::array<block, code_page_size> blocks{};
+    };
+    // Caches by the host memory mapped at a page, so a bank that is switched
+    // out and back in keeps its cache.
+    std::unordered_map<uint8_t const *, std::unique_ptr<code_page>>
+        code_cache{};
+    // Cache of each mapped page, looked up again after bank switching.
+    std::array<code_page *, 8> code_pages{};
+    // Caches of changed ROM, freed once no block runs from them.
+    std::vector<std::unique_ptr<code_page>> stale_code_pages{};
+    // Stops the running block.
+    bool code_invalidated{};
+    code_page &get_code_page(uint16_t adr);
+    // Static blocks by PRG ROM address, empty when none are installed.
+    std::vector<static_block> static_blocks{};
+    void invalidate_code(uint16_t adr, uint16_t size, rom_change change);
+
+    template <mnemonic name, adr_mode mode> void execute_op();
+    template <std::size_t... opcodes>
+    static constexpr std::array<handler, 256>
+        make_dispatch_table(std::index_sequence<opcodes...>);
+    static std::array<handler, 256> const dispatch_table;
+
+    // Resolve the operands of the current instruction.
+    template <adr_mode mode> uint16_t address();
+    template <adr_mode mode> value_proxy operand();
+
     // Memory access
     uint16_t zero(uint8_t adr);
     uint16_t zero_x(uint8_t adr);
@@ -83,6 +223,7 @@ class core6502 final {
     void set_negative_flag(uint8_t val);
     void set_overflow_flag_add(uint8_t prev, uint8_t res);
     void compare(uint8_t reg, uint8_t val);
+    void branch(uint8_t offset);
     void set_accumulator(uint8_t val);
     void set_x(uint8_t val);
     void set_y(uint8_t val);
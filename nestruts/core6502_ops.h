@@ -0,0 +1,190 @@
+#pragma once
+// Instruction handler templates for core6502. Kept in a header so that
+// statically recompiled code can inline them, see tools/recompile.cpp.
+#include "core6502.h"
+#include "log.h"
+
+template <adr_mode mode> uint16_t core6502::address() {
+    if constexpr (mode == adr_mode::zero_page) {
+        logf(log_level::instr, " $%02x", operand_low);
+        return zero(operand_low);
+    } else if constexpr (mode == adr_mode::x_indexed_zero_page) {
+        logf(log_level::instr, " $%02x,X", operand_low);
+        return zero_x(operand_low);
+    } else if constexpr (mode == adr_mode::y_indexed_zero_page) {
+        logf(log_level::instr, " $%02x,Y", operand_low);
+        return zero_y(operand_low);
+    } else if constexpr (mode == adr_mode::absolute) {
+        logf(log_level::instr, " $%02x%02x", operand_high, operand_low);
+        return absolute(operand_low, operand_high);
+    } else if constexpr (mode == adr_mode::x_indexed_absolute) {
+        logf(log_level::instr, " $%02x%02x,X", operand_high, operand_low);
+        return absolute_x(operand_low, operand_high);
+    } else if constexpr (mode == adr_mode::y_indexed_absolute) {
+        logf(log_level::instr, " $%02x%02x,Y", operand_high, operand_low);
+        return absolute_y(operand_low, operand_high);
+    } else if constexpr (mode == adr_mode::absolute_indirect) {
+        logf(log_level::instr, " ($%02x%02x)", operand_high, operand_low);
+        return indirect(operand_low, operand_high);
+    } else if constexpr (mode == adr_mode::x_indexed_zero_page_indirect) {
+        logf(log_level::instr, " ($%02x,X)", operand_low);
+        return indirect_x(operand_low);
+    } else {
+        static_assert(mode == adr_mode::zero_page_indirect_y_indexed,
+                      "Addressing mode does not refer to memory");
+        logf(log_level::instr, " ($%02x),Y", operand_low);
+        return indirect_y(operand_low);
+    }
+}
+
+template <adr_mode mode> value_proxy core6502::operand() {
+    if constexpr (mode == adr_mode::immediate) {
+        logf(log_level::instr, " #%02x", operand_low);
+        return value_proxy{operand_low};
+    } else if constexpr (mode == adr_mode::relative) {
+        logf(log_level::instr, " *%i", static_cast<int8_t>(operand_low));
+        return value_proxy{operand_low};
+    } else {
+        return (*bus)[address<mode>()];
+    }
+}
+
+// One instantiation per opcode. The mnemonic and addressing mode are known at
+// compile time so every instantiation reduces to a single instruction.
+template <mnemonic name, adr_mode mode> void core6502::execute_op() {
+    if constexpr (name == mnemonic::LDA) {
+        LDA(operand<mode>().value());
+    } else if constexpr (name == mnemonic::LDX) {
+        LDX(operand<mode>().value());
+    } else if constexpr (name == mnemonic::LDY) {
+        LDY(operand<mode>().value());
+    } else if constexpr (name == mnemonic::STA) {
+        STA(operand<mode>());
+    } else if constexpr (name == mnemonic::STX) {
+        STX(operand<mode>());
+    } else if constexpr (name == mnemonic::STY) {
+        STY(operand<mode>());
+    } else if constexpr (name == mnemonic::ADC) {
+        ADC(operand<mode>().value());
+    } else if constexpr (name == mnemonic::SBC) {
+        SBC(operand<mode>().value());
+    } else if constexpr (name == mnemonic::AND) {
+        AND(operand<mode>().value());
+    } else if constexpr (name == mnemonic::ORA) {
+        ORA(operand<mode>().value());
+    } else if constexpr (name == mnemonic::EOR) {
+        EOR(operand<mode>().value());
+    } else if constexpr (name == mnemonic::CMP) {
+        CMP(operand<mode>().value());
+    } else if constexpr (name == mnemonic::CPX) {
+        CPX(operand<mode>().value());
+    } else if constexpr (name == mnemonic::CPY) {
+        CPY(operand<mode>().value());
+    } else if constexpr (name == mnemonic::BIT) {
+        BIT(operand<mode>().value());
+    } else if constexpr (name == mnemonic::ASL) {
+        if constexpr (mode == adr_mode::accumulator)
+            ASL();
+        else
+            ASL(operand<mode>());
+    } else if constexpr (name == mnemonic::LSR) {
+        if constexpr (mode == adr_mode::accumulator)
+            LSR();
+        else
+            LSR(operand<mode>());
+    } else if constexpr (name == mnemonic::ROL) {
+        if constexpr (mode == adr_mode::accumulator)
+            ROL();
+        else
+            ROL(operand<mode>());
+    } else if constexpr (name == mnemonic::ROR) {
+        if constexpr (mode == adr_mode::accumulator)
+            ROR();
+        else
+            ROR(operand<mode>());
+    } else if constexpr (name == mnemonic::INC) {
+        INC(operand<mode>());
+    } else if constexpr (name == mnemonic::DEC) {
+        DEC(operand<mode>());
+    } else if constexpr (name == mnemonic::BEQ) {
+        BEQ(operand<mode>().value());
+    } else if constexpr (name == mnemonic::BMI) {
+        BMI(operand<mode>().value());
+    } else if constexpr (name == mnemonic::BNE) {
+        BNE(operand<mode>().value());
+    } else if constexpr (name == mnemonic::BCS) {
+        BCS(operand<mode>().value());
+    } else if constexpr (name == mnemonic::BCC) {
+        BCC(operand<mode>().value());
+    } else if constexpr (name == mnemonic::BPL) {
+        BPL(operand<mode>().value());
+    } else if constexpr (name == mnemonic::BVC) {
+        BVC(operand<mode>().value());
+    } else if constexpr (name == mnemonic::JSR) {
+        JSR(address<mode>());
+    } else if constexpr (name == mnemonic::JMP) {
+        JMP(address<mode>());
+    } else if constexpr (name == mnemonic::RTI) {
+        RTI();
+    } else if constexpr (name == mnemonic::RTS) {
+        RTS();
+    } else if constexpr (name == mnemonic::BRK) {
+        BRK();
+    } else if constexpr (name == mnemonic::INX) {
+        INX();
+    } else if constexpr (name == mnemonic::INY) {
+        INY();
+    } else if constexpr (name == mnemonic::DEX) {
+        DEX();
+    } else if constexpr (name == mnemonic::DEY) {
+        DEY();
+    } else if constexpr (name == mnemonic::PHA) {
+        PHA();
+    } else if constexpr (name == mnemonic::PLA) {
+        PLA();
+    } else if constexpr (name == mnemonic::PHP) {
+        PHP();
+    } else if constexpr (name == mnemonic::PLP) {
+        PLP();
+    } else if constexpr (name == mnemonic::TAX) {
+        TAX();
+    } else if constexpr (name == mnemonic::TXA) {
+        TXA();
+    } else if constexpr (name == mnemonic::TAY) {
+        TAY();
+    } else if constexpr (name == mnemonic::TYA) {
+        TYA();
+    } else if constexpr (name == mnemonic::TXS) {
+        TXS();
+    } else if constexpr (name == mnemonic::SEC) {
+        SEC();
+    } else if constexpr (name == mnemonic::SEI) {
+        SEI();
+    } else if constexpr (name == mnemonic::CLC) {
+        CLC();
+    } else if constexpr (name == mnemonic::CLD) {
+        CLD();
+    } else {
+        static_assert(name == mnemonic::invalid, "Mnemonic not dispatched");
+        logf(log_level::error, "Unrecognized instruction %#04x\n", opcode);
+        faulted = true;
+    }
+}
+
+template <uint8_t code>
+bool core6502::execute_static(uint8_t low, uint8_t high) {
+    if (cycles >= target_cycle || faulted || code_invalidated)
+        return false;
+    constexpr auto entry = opcode_table[code];
+    decoded_instruction const instruction{nullptr,
+                                          code,
+                                          low,
+                                          high,
+                                          1 + operand_size(entry.mode),
+                                          entry.cycles,
+                                          entry.page_penalty};
+    start_instruction(instruction);
+    execute_op<entry.name, entry.mode>();
+    finish_instruction(instruction);
+    return true;
+}
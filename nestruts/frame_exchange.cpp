@@ -0,0 +1,68 @@
+#include "frame_exchange.h"
+
+frame_exchange::frame_exchange(std::shared_ptr<video_sink> next)
+    : next{std::move(next)}, takes_colours{this->next->wants_colours()} {}
+
+void frame_exchange::present(std::span<uint32_t const> frame, int width) {
+    auto &buffer = frames[back];
+    buffer.has_colours = false;
+    buffer.width = width;
+    buffer.argb.assign(frame.begin(), frame.end());
+    publish();
+}
+
+void frame_exchange::present_colours(std::span<uint8_t const> frame,
+                                     std::span<uint8_t const> emphasis,
+                                     int width) {
+    auto &buffer = frames[back];
+    buffer.has_colours = true;
+    buffer.width = width;
+    buffer.colours.assign(frame.begin(), frame.end());
+    buffer.emphasis.assign(emphasis.begin(), emphasis.end());
+    publish();
+}
+
+void frame_exchange::publish() {
+    // Release the frame to the presenter, acquire whatever it last
+    // presented to fill next.
+    auto const old = middle.exchange(back | fresh, std::memory_order_acq_rel);
+    if (old & fresh)
+        dropped.fetch_add(1, std::memory_order_relaxed);
+    back = old & index_mask;
+    middle.notify_one();
+}
+
+void frame_exchange::close() {
+    middle.fetch_or(closed, std::memory_order_release);
+    middle.notify_one();
+}
+
+bool frame_exchange::present_next() {
+    auto state = middle.load(std::memory_order_acquire);
+    if (!(state & (fresh | closed))) {
+        waited.fetch_add(1, std::memory_order_relaxed);
+        do {
+            middle.wait(state, std::memory_order_acquire);
+            state = middle.load(std::memory_order_acquire);
+        } while (!(state & (fresh | closed)));
+    }
+    if (!(state & fresh))
+        return false;
+    // Only this side clears fresh, but closed may be set meanwhile.
+    while (!middle.compare_exchange_weak(state, front | (state & closed),
+                                         std::memory_order_acq_rel,
+                                         std::memory_order_acquire)) {
+    }
+    front = state & index_mask;
+    auto const &frame = frames[front];
+    if (frame.has_colours)
+        next->present_colours(frame.colours, frame.emphasis, frame.width);
+    else
+        next->present(frame.argb, frame.width);
+    return true;
+}
+
+frame_exchange::stall_counts frame_exchange::stalls() const {
+    return {dropped.load(std::memory_order_relaxed),
+            waited.load(std::memory_order_relaxed)};
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "video_sink.h"
+
+// Hands frames from the emulation thread to the presentation thread through
+// three buffers, without locks. The emulator fills the back buffer while the
+// presenter shows the front one, each swaps its buffer with the middle one
+// when done. The emulator never waits: a frame the presenter has not taken
+// yet is dropped for the newer one.
+class frame_exchange final : public video_sink {
+  public:
+    // Frames go on to next from present_next, as colours if it wants them.
+    explicit frame_exchange(std::shared_ptr<video_sink> next);
+
+    // Emulation side.
+    void present(std::span<uint32_t const> frame, int width) override;
+    bool wants_colours() const override { return takes_colours; }
+    void present_colours(std::span<uint8_t const> frame,
+                         std::span<uint8_t const> emphasis,
+                         int width) override;
+    // No more frames, wakes up present_next for good.
+    void close();
+
+    // Presentation side. Waits for a frame that was not presented yet and
+    // presents it to next. Returns false once closed and the last frame was
+    // presented.
+    bool present_next();
+
+    struct stall_counts {
+        // Frames the emulator replaced before they were presented.
+        int64_t dropped{};
+        // Calls of present_next that had to wait for the emulator.
+        int64_t waited{};
+    };
+    // Safe from either thread.
+    stall_counts stalls() const;
+
+  private:
+    std::shared_ptr<video_sink> const next;
+    bool const takes_colours;
+
+    // ARGB or, when has_colours, colours and emphasis.
+    struct frame {
+        bool has_colours{};
+        int width{};
+        std::vector<uint32_t> argb{};
+        std::vector<uint8_t> colours{};
+        std::vector<uint8_t> emphasis{};
+    };
+    std::array<frame, 3> frames{};
+    // Index of the middle buffer, with fresh set while it holds a frame that
+    // was not taken yet and closed once the emulator is done.
+    static constexpr uint8_t index_mask{0x03};
+    static constexpr uint8_t fresh{0x04};
+    static constexpr uint8_t closed{0x08};
+    std::atomic<uint8_t> middle{1};
+    // Owned by the emulation and presentation side.
+    uint8_t back{0};
+    uint8_t front{2};
+    void publish();
+
+    std::atomic<int64_t> dropped{};
+    std::atomic<int64_t> waited{};
+};
@@ -1,44 +1,75 @@
 #include "gfx.h"
-#include "log.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
 #include <SDL2/SDL.h>
+#include <SDL2/SDL_hints.h>
 #include <SDL2/SDL_render.h>
-#include <SDL2/SDL_surface.h>
 
-graphics::graphics() {
+graphics::graphics(scaling mode) : mode{mode} {
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER);
-    window =
-        SDL_CreateWindow("Nestruts", SDL_WINDOWPOS_UNDEFINED,
-                         SDL_WINDOWPOS_UNDEFINED, 1400, 1000, SDL_WINDOW_SHOWN);
+    window = SDL_CreateWindow("Nestruts", SDL_WINDOWPOS_UNDEFINED,
+                              SDL_WINDOWPOS_UNDEFINED, 1400, 1000,
+                              SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    if (!renderer)
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+    if (!renderer) {
+        SDL_DestroyWindow(window);
+        throw std::runtime_error(std::string{"Failed to create renderer: "} +
+                                 SDL_GetError());
+    }
+    // Keep pixels sharp when scaling.
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "nearest");
 }
 
-graphics::~graphics() { SDL_DestroyWindow(window); }
-
-void graphics::clear() {
-    auto surf = SDL_GetWindowSurface(window);
-    SDL_LockSurface(surf);
-    SDL_FillRect(surf, nullptr, 0);
-    SDL_UnlockSurface(surf);
+graphics::~graphics() {
+    if (texture)
+        SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
 }
 
-void graphics::flip() { SDL_UpdateWindowSurface(window); }
-
-void graphics::draw() {}
+SDL_Rect graphics::target(int width, int height) const {
+    int output_width{};
+    int output_height{};
+    SDL_GetRendererOutputSize(renderer, &output_width, &output_height);
+    int w = output_width;
+    int h = output_height;
+    if (mode == scaling::integer) {
+        int const scale = std::max(
+            1, std::min(output_width / width, output_height / height));
+        w = width * scale;
+        h = height * scale;
+    } else if (mode == scaling::aspect) {
+        double const aspect_width = width * 8.0 / 7.0;
+        double const scale =
+            std::min(output_width / aspect_width,
+                     static_cast<double>(output_height) / height);
+        w = static_cast<int>(std::lround(aspect_width * scale));
+        h = static_cast<int>(std::lround(height * scale));
+    }
+    return {(output_width - w) / 2, (output_height - h) / 2, w, h};
+}
 
-// Draw a fat pixel
-void graphics::draw_pixel(int nes_x, int nes_y, rgb color) {
-    uint32_t color_argb = (color.red << 16) + (color.green << 8) + color.blue;
-    auto const surf = SDL_GetWindowSurface(window);
-    SDL_LockSurface(surf);
-    int fatness = 4;
-    if (current_log_level == log_level::debug)
-        fatness = 2;
-    auto const pixels = static_cast<uint32_t *>(surf->pixels);
-    auto const width = surf->pitch / sizeof(uint32_t);
-    for (int x = nes_x * fatness; x < nes_x * fatness + fatness; x++) {
-        for (int y = nes_y * fatness; y < nes_y * fatness + fatness; y++) {
-            if (x >= surf->w || y >= surf->h) continue;
-            *(pixels + x + y * width) = color_argb;
-        }
+void graphics::present(std::span<uint32_t const> frame, int width) {
+    auto const start = std::chrono::steady_clock::now();
+    int const height = static_cast<int>(frame.size()) / width;
+    if (!texture || width != texture_width || height != texture_height) {
+        if (texture)
+            SDL_DestroyTexture(texture);
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                                    SDL_TEXTUREACCESS_STREAMING, width, height);
+        texture_width = width;
+        texture_height = height;
     }
-    SDL_UnlockSurface(surf);
+    SDL_UpdateTexture(texture, nullptr, frame.data(),
+                      width * static_cast<int>(sizeof(uint32_t)));
+    SDL_Rect const destination = target(width, height);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0xFF);
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, texture, nullptr, &destination);
+    SDL_RenderPresent(renderer);
+    present_time = std::chrono::steady_clock::now() - start;
 }
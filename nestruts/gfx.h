@@ -1,21 +1,45 @@
 #pragma once
+#include <chrono>
 #include <cstdint>
+#include <span>
 
 #include "SDL2/SDL.h"
 
-// TODO: Refactor out rgb from here so we can do this nicer
-#include "palette.h"
+#include "video_sink.h"
 
-class graphics final {
+// How frames are scaled to the window.
+enum class scaling : uint8_t {
+    // By the largest whole number that fits, square pixels.
+    integer,
+    // As large as fits with the 8:7 pixels of NTSC.
+    aspect,
+    // To fill the window.
+    stretch,
+};
+
+// Presents frames to an SDL window. Each frame is uploaded once to a
+// streaming texture and scaled by the renderer, which falls back to SDL's
+// software renderer without a GPU.
+class graphics final : public video_sink {
   public:
-    graphics();
-    ~graphics();
+    explicit graphics(scaling mode = scaling::integer);
+    ~graphics() override;
 
-    void clear();
-    void flip();
-    void draw();
-    void draw_pixel(int x, int y, rgb color);
+    void present(std::span<uint32_t const> frame, int width) override;
+    void set_scaling(scaling mode) { this->mode = mode; }
+    // Spent uploading, scaling and presenting the last frame.
+    std::chrono::nanoseconds last_present_time() const { return present_time; }
 
   private:
     SDL_Window *window = nullptr;
+    SDL_Renderer *renderer = nullptr;
+    // Recreated when the size of the frames changes.
+    SDL_Texture *texture = nullptr;
+    int texture_width{};
+    int texture_height{};
+    scaling mode;
+    std::chrono::nanoseconds present_time{};
+
+    // Where a frame of width x height pixels goes in the window.
+    SDL_Rect target(int width, int height) const;
 };
@@ -1,15 +1,34 @@
 #include "instruction_store.h"
 
 #include "fmt/core.h"
-#include <fstream>
+#include "log.h"
+#include <cstdio>
 
 instruction_store::~instruction_store() {
-    FILE *file{fopen("disasm_dump", "w")};
-    for (auto &instr : m_instructions) {
-        auto const &instruction = instr.second;
-        fmt::print(file, "${:04x}: {}", instruction.pp(),
-                   instruction.mnemonic());
-        switch (instruction.mode()) {
+    if (m_visited.any())
+        write("disasm_dump");
+}
+
+void instruction_store::write(std::string const &filename) const {
+    FILE *file{fopen(filename.c_str(), "w")};
+    if (file == nullptr) {
+        log(log_level::error, "Failed to open file '{}'.\n", filename);
+        return;
+    }
+    for (std::size_t pp{0}; pp < m_visited.size(); ++pp) {
+        if (!m_visited[pp])
+            continue;
+        auto const &instruction = m_records[pp];
+        auto const &decoded = opcode_table[instruction.opcode];
+        uint16_t const argument =
+            decoded.mode == adr_mode::absolute ||
+                    decoded.mode == adr_mode::x_indexed_absolute ||
+                    decoded.mode == adr_mode::y_indexed_absolute ||
+                    decoded.mode == adr_mode::absolute_indirect
+                ? (instruction.operand_high << 8) + instruction.operand_low
+                : instruction.operand_low;
+        fmt::print(file, "${:04x}: {}", pp, mnemonic_name(decoded.name));
+        switch (decoded.mode) {
         case adr_mode::implied:
             // Print nothing
             break;
@@ -17,43 +36,42 @@ instruction_store::~instruction_store() {
             fmt::print(file, " A");
             break;
         case adr_mode::immediate:
-            fmt::print(file, " #{:02x}", instruction.argument());
+            fmt::print(file, " #{:02x}", argument);
             break;
         case adr_mode::absolute:
-            fmt::print(file, " ${:04x}", instruction.argument());
+            fmt::print(file, " ${:04x}", argument);
             break;
         case adr_mode::x_indexed_absolute:
-            fmt::print(file, " ${:04x},X", instruction.argument());
+            fmt::print(file, " ${:04x},X", argument);
             break;
         case adr_mode::y_indexed_absolute:
-            fmt::print(file, " ${:04x},Y", instruction.argument());
+            fmt::print(file, " ${:04x},Y", argument);
             break;
         case adr_mode::absolute_indirect:
-            fmt::print(file, " (${:04x})", instruction.argument());
+            fmt::print(file, " (${:04x})", argument);
             break;
         case adr_mode::zero_page:
-            fmt::print(file, " ${:02x}", instruction.argument());
+            fmt::print(file, " ${:02x}", argument);
             break;
         case adr_mode::x_indexed_zero_page:
-            fmt::print(file, " ${:02x},X", instruction.argument());
+            fmt::print(file, " ${:02x},X", argument);
             break;
         case adr_mode::y_indexed_zero_page:
-            fmt::print(file, " ${:02x},Y", instruction.argument());
+            fmt::print(file, " ${:02x},Y", argument);
             break;
         case adr_mode::x_indexed_zero_page_indirect:
-            fmt::print(file, " (${:02x},X)", instruction.argument());
+            fmt::print(file, " (${:02x},X)", argument);
             break;
         case adr_mode::zero_page_indirect_y_indexed:
-            fmt::print(file, " (${:02x}),Y", instruction.argument());
+            fmt::print(file, " (${:02x}),Y", argument);
             break;
         case adr_mode::relative:
-            fmt::print(file, " *{:02x}",
-                       static_cast<int8_t>(instruction.argument()));
+            fmt::print(file, " *{:02x}", static_cast<int8_t>(argument));
             break;
         }
         // Make it easier to tell subroutines apart
-        if (instruction.mnemonic() == "RTS" ||
-            instruction.mnemonic() == "RTI" || instruction.mnemonic() == "JMP")
+        if (decoded.name == mnemonic::RTS || decoded.name == mnemonic::RTI ||
+            decoded.name == mnemonic::JMP)
             fmt::print(file, "\n");
         fmt::print(file, "\n");
     }
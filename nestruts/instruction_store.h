@@ -1,46 +1,22 @@
 #pragma once
+#include <bitset>
 #include <cstdint>
-#include <map>
 #include <string>
+#include <vector>
 
-enum class adr_mode {
-    implied,
-    accumulator,
-    immediate,
-    absolute,
-    x_indexed_absolute,
-    y_indexed_absolute,
-    absolute_indirect,
-    zero_page,
-    x_indexed_zero_page,
-    y_indexed_zero_page,
-    x_indexed_zero_page_indirect,
-    zero_page_indirect_y_indexed,
-    relative
-};
-
-class instruction_info {
-    uint16_t m_pp{};
-    std::string m_mnemonic{};
-    adr_mode m_mode{};
-    uint16_t m_argument{};
-
-  public:
-    void set_pp(uint16_t pp) { m_pp = pp; }
-    void set_mnemonic(std::string mnemonic) {
-        m_mnemonic = std::move(mnemonic);
-    }
-    void set_mode(adr_mode mode) { m_mode = mode; }
-    void set_argument(std::uint16_t argument) { m_argument = argument; }
-
-    uint16_t pp() const { return m_pp; }
-    std::string mnemonic() const { return m_mnemonic; }
-    adr_mode mode() const { return m_mode; }
-    uint16_t argument() const { return m_argument; }
-};
+#include "opcodes.h"
 
+// Remembers the first instruction executed at every address. Recording is a
+// bit test per instruction, the disassembly is only formatted when written.
 class instruction_store {
-    std::map<uint16_t, instruction_info> m_instructions{};
+    struct record {
+        uint8_t opcode{};
+        uint8_t operand_low{};
+        uint8_t operand_high{};
+    };
+    bool m_enabled{true};
+    std::bitset<0x10000> m_visited{};
+    std::vector<record> m_records = std::vector<record>(0x10000);
 
   public:
     instruction_store() = default;
@@ -48,11 +24,19 @@ class instruction_store {
     instruction_store &operator=(instruction_store const &) = delete;
     instruction_store(instruction_store &&) = delete;
     instruction_store &operator=(instruction_store &&) = delete;
+    // Writes disasm_dump if anything was recorded.
     ~instruction_store();
 
-    void push(instruction_info instruction) {
-        if (!m_instructions.contains(instruction.pp())) {
-            m_instructions[instruction.pp()] = instruction;
-        }
+    void set_enabled(bool enabled) { m_enabled = enabled; }
+
+    void push(uint16_t pp, uint8_t opcode, uint8_t operand_low,
+              uint8_t operand_high) {
+        if (!m_enabled || m_visited[pp])
+            return;
+        m_visited[pp] = true;
+        m_records[pp] = {opcode, operand_low, operand_high};
     }
+
+    // Writes the recorded instructions in address order.
+    void write(std::string const &filename) const;
 };
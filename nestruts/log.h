@@ -2,22 +2,38 @@
 
 #include "fmt/core.h"
 #include "fmt/printf.h"
+#include <atomic>
 #include <utility>
 
 enum class log_level { trace, debug, instr, info, error };
 
-inline log_level current_log_level = log_level::debug;
+// Messages below this level are compiled out, set by the min_log_level
+// meson option. Release builds drop the per-instruction trace this way.
+#ifndef STRUTS_MIN_LOG_LEVEL
+#define STRUTS_MIN_LOG_LEVEL trace
+#endif
+inline constexpr log_level min_log_level = log_level::STRUTS_MIN_LOG_LEVEL;
+
+// Atomic as the front end emulates and presents on separate threads.
+inline std::atomic<log_level> current_log_level{log_level::debug};
+
+// Is level logged? Constant folded for constant levels below min_log_level,
+// which removes the whole call.
+inline bool log_enabled(log_level level) {
+    return level >= min_log_level &&
+           level >= current_log_level.load(std::memory_order_relaxed);
+}
 
 template <typename... Args>
 void log(log_level level, fmt::format_string<Args...> format, Args &&...args) {
-    if (level < current_log_level) {
+    if (!log_enabled(level)) {
         return;
     }
     fmt::print(format, std::forward<Args>(args)...);
 }
 
 template <typename... Args> void logf(log_level level, Args... args) {
-    if (level < current_log_level) {
+    if (!log_enabled(level)) {
         return;
     }
     fmt::printf(args...);
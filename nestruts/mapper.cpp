@@ -0,0 +1,339 @@
+#include "mapper.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "log.h"
+
+mapper::mapper(cartridge c, memory_bus &bus, picture_processing_unit *ppu)
+    : bus{bus}, ppu{ppu}, cart{std::move(c)} {
+    if (cart.chr_rom.empty())
+        chr_ram.resize(std::max<std::size_t>(cart.chr_ram_size, 0x2000));
+    bus.map_prg_ram(0x6000, prg_ram.data(), prg_ram.size());
+    if (ppu) {
+        ppu->set_mirroring(cart.nametable_mirroring);
+    }
+}
+
+void mapper::map_prg(uint16_t adr, uint16_t size, int bank) {
+    if (size > cart.prg_rom.size()) {
+        // Smaller ROMs are mirrored.
+        map_prg(adr, size / 2, bank * 2);
+        map_prg(adr + size / 2, size / 2, bank * 2 + 1);
+        return;
+    }
+    auto const banks = static_cast<int>(cart.prg_rom.size() / size);
+    bank = (bank % banks + banks) % banks;
+    bus.map_prg(adr, cart.prg_rom.data() + bank * size, size);
+}
+
+void mapper::map_chr(uint16_t adr, uint16_t size, int bank) {
+    if (!ppu)
+        return;
+    std::size_t const chr_size =
+        chr_ram.empty() ? cart.chr_rom.size() : chr_ram.size();
+    if (size > chr_size) {
+        map_chr(adr, size / 2, bank * 2);
+        map_chr(adr + size / 2, size / 2, bank * 2 + 1);
+        return;
+    }
+    auto const banks = static_cast<int>(chr_size / size);
+    bank = (bank % banks + banks) % banks;
+    if (chr_ram.empty()) {
+        ppu->map_chr(adr, cart.chr_rom.data() + bank * size, size);
+    } else {
+        ppu->map_chr_ram(adr, chr_ram.data() + bank * size, size);
+    }
+}
+
+void mapper::set_mirroring(mirroring m) {
+    if (ppu)
+        ppu->set_mirroring(m);
+}
+
+namespace {
+// Mapper 0, no bank switching.
+class nrom final : public mapper {
+  public:
+    nrom(cartridge cart, memory_bus &bus, picture_processing_unit *ppu)
+        : mapper{std::move(cart), bus, ppu} {
+        map_prg(0x8000, 0x4000, 0);
+        map_prg(0xC000, 0x4000, -1);
+        map_chr(0x0000, 0x2000, 0);
+    }
+
+    void write(uint16_t adr, uint8_t) override {
+        logf(log_level::error, "\tWarning: trying to write to ROM: %#6x\n",
+             adr);
+    }
+};
+
+// Mapper 1, loads its registers one bit per write through a shift register.
+class mmc1 final : public mapper {
+  public:
+    mmc1(cartridge cart, memory_bus &bus, picture_processing_unit *ppu)
+        : mapper{std::move(cart), bus, ppu} {
+        update();
+    }
+
+    void write(uint16_t adr, uint8_t val) override {
+        // Writes on consecutive cycles are ignored, only the first write of
+        // a read-modify-write instruction counts.
+        auto const cycle = bus.scheduler().now();
+        if (cycle == last_write_cycle)
+            return;
+        last_write_cycle = cycle;
+        if (val & 0x80) {
+            shift = shift_reset;
+            control |= 0x0C;
+            update();
+            return;
+        }
+        bool const full = shift & 0x01;
+        shift = (shift >> 1) | ((val & 0x01) << 4);
+        if (!full)
+            return;
+        switch ((adr >> 13) & 0x03) {
+        case 0:
+            control = shift;
+            break;
+        case 1:
+            chr_bank0 = shift;
+            break;
+        case 2:
+            chr_bank1 = shift;
+            break;
+        case 3:
+            prg_bank = shift;
+            break;
+        }
+        shift = shift_reset;
+        update();
+    }
+
+  private:
+    // The marker bit reaches bit 0 after four writes.
+    static constexpr uint8_t shift_reset{0x10};
+    uint8_t shift{shift_reset};
+    uint8_t control{0x0C};
+    uint8_t chr_bank0{};
+    uint8_t chr_bank1{};
+    uint8_t prg_bank{};
+    uint64_t last_write_cycle{std::numeric_limits<uint64_t>::max()};
+
+    void update() {
+        constexpr std::array<mirroring, 4> modes{
+            mirroring::single_screen_low, mirroring::single_screen_high,
+            mirroring::vertical, mirroring::horizontal};
+        set_mirroring(modes[control & 0x03]);
+        int const bank = prg_bank & 0x0F;
+        switch ((control >> 2) & 0x03) {
+        case 0:
+        case 1:
+            map_prg(0x8000, 0x8000, bank >> 1);
+            break;
+        case 2:
+            map_prg(0x8000, 0x4000, 0);
+            map_prg(0xC000, 0x4000, bank);
+            break;
+        case 3:
+            map_prg(0x8000, 0x4000, bank);
+            map_prg(0xC000, 0x4000, -1);
+            break;
+        }
+        if (control & 0x10) {
+            map_chr(0x0000, 0x1000, chr_bank0);
+            map_chr(0x1000, 0x1000, chr_bank1);
+        } else {
+            map_chr(0x0000, 0x2000, chr_bank0 >> 1);
+        }
+    }
+};
+
+// Mapper 2, switches the 16 K at $8000, the last bank is fixed at $C000.
+class uxrom final : public mapper {
+  public:
+    uxrom(cartridge cart, memory_bus &bus, picture_processing_unit *ppu)
+        : mapper{std::move(cart), bus, ppu} {
+        map_prg(0x8000, 0x4000, 0);
+        map_prg(0xC000, 0x4000, -1);
+        map_chr(0x0000, 0x2000, 0);
+    }
+
+    void write(uint16_t, uint8_t val) override { map_prg(0x8000, 0x4000, val); }
+};
+
+// Mapper 3, switches the 8 K of CHR ROM.
+class cnrom final : public mapper {
+  public:
+    cnrom(cartridge cart, memory_bus &bus, picture_processing_unit *ppu)
+        : mapper{std::move(cart), bus, ppu} {
+        map_prg(0x8000, 0x4000, 0);
+        map_prg(0xC000, 0x4000, -1);
+        map_chr(0x0000, 0x2000, 0);
+    }
+
+    void write(uint16_t, uint8_t val) override { map_chr(0x0000, 0x2000, val); }
+};
+
+// Mapper 4, 8 K PRG and 1 K/2 K CHR banks and a scanline counter IRQ.
+//
+// The counter is clocked when the PPU fetches sprite patterns at dot 260 of
+// the pre-render line and the 240 visible lines. Rather than clocking it
+// every scanline, clocks are counted from the frame timing when the
+// registers are accessed, and the IRQ is scheduled for the clock that
+// reaches zero. Rendering is assumed to be enabled.
+class mmc3 final : public mapper {
+  public:
+    mmc3(cartridge cart, memory_bus &bus, picture_processing_unit *ppu)
+        : mapper{std::move(cart), bus, ppu} {
+        bus.scheduler().set_handler(event::mapper_irq, [this](uint64_t cycle) {
+            catch_up(cycle);
+            if (counter == 0 && irq_enabled) {
+                log(log_level::debug, "mmc3 irq\n");
+                this->bus.scheduler().assert_irq(irq_line::mapper);
+            }
+            schedule_irq();
+        });
+        update();
+    }
+    ~mmc3() override {
+        bus.scheduler().cancel(event::mapper_irq);
+        bus.scheduler().set_handler(event::mapper_irq, {});
+    }
+
+    void write(uint16_t adr, uint8_t val) override {
+        bool const odd = adr & 0x01;
+        switch ((adr >> 13) & 0x03) {
+        case 0:
+            if (odd) {
+                banks[bank_select & 0x07] = val;
+            } else {
+                bank_select = val;
+            }
+            update();
+            break;
+        case 1:
+            // The odd register protects cartridge RAM, which is ignored.
+            if (!odd)
+                set_mirroring(val & 0x01 ? mirroring::horizontal
+                                         : mirroring::vertical);
+            break;
+        case 2:
+            catch_up(bus.scheduler().now());
+            if (odd) {
+                counter = 0;
+                reload = true;
+            } else {
+                latch = val;
+            }
+            schedule_irq();
+            break;
+        case 3:
+            catch_up(bus.scheduler().now());
+            irq_enabled = odd;
+            if (!odd)
+                bus.scheduler().release_irq(irq_line::mapper);
+            schedule_irq();
+            break;
+        }
+    }
+
+  private:
+    uint8_t bank_select{};
+    std::array<uint8_t, 8> banks{0, 2, 4, 5, 6, 7, 0, 1};
+    // Scanline counter
+    uint8_t latch{};
+    uint8_t counter{};
+    bool reload{};
+    bool irq_enabled{};
+    // Counter clocks since power on that have been applied.
+    uint64_t clocks{};
+
+    static constexpr uint64_t clocks_per_frame{241};
+    // PPU dots from the start of vblank to the pre-render line clock.
+    static constexpr uint64_t first_clock_dot{20 * 341 + 259};
+    static constexpr uint64_t dots_per_line{341};
+
+    // Cycle of clock n. Frames start at vblank as in the PPU, the first one
+    // at power on.
+    static uint64_t clock_cycle(uint64_t n) {
+        return frame_end_cycle(n / clocks_per_frame) +
+               (first_clock_dot + n % clocks_per_frame * dots_per_line) / 3;
+    }
+    // Number of clocks at or before cycle.
+    static uint64_t clocks_until(uint64_t cycle) {
+        uint64_t const frame = (2 * cycle + 1) / half_cycles_per_frame;
+        uint64_t const dots = 3 * (cycle - frame_end_cycle(frame)) + 3;
+        uint64_t const lines =
+            dots > first_clock_dot
+                ? std::min(clocks_per_frame,
+                           (dots - first_clock_dot + dots_per_line - 1) /
+                               dots_per_line)
+                : 0;
+        return frame * clocks_per_frame + lines;
+    }
+
+    void catch_up(uint64_t cycle) {
+        for (auto const target = clocks_until(cycle); clocks < target;) {
+            if (counter == 0 || reload) {
+                counter = latch;
+                reload = false;
+                ++clocks;
+            } else {
+                auto const n = std::min<uint64_t>(counter, target - clocks);
+                counter -= n;
+                clocks += n;
+            }
+        }
+    }
+
+    void schedule_irq() {
+        auto &events = bus.scheduler();
+        if (!irq_enabled) {
+            events.cancel(event::mapper_irq);
+            return;
+        }
+        // Clocks until the counter is zero after being clocked.
+        uint64_t const remaining =
+            counter == 0 || reload ? 1 + latch : counter;
+        events.schedule(event::mapper_irq, clock_cycle(clocks + remaining - 1));
+    }
+
+    void update() {
+        bool const prg_swap = bank_select & 0x40;
+        map_prg(prg_swap ? 0xC000 : 0x8000, 0x2000, banks[6]);
+        map_prg(0xA000, 0x2000, banks[7]);
+        map_prg(prg_swap ? 0x8000 : 0xC000, 0x2000, -2);
+        map_prg(0xE000, 0x2000, -1);
+        uint16_t const chr_swap = bank_select & 0x80 ? 0x1000 : 0x0000;
+        map_chr(chr_swap ^ 0x0000, 0x0800, banks[0] >> 1);
+        map_chr(chr_swap ^ 0x0800, 0x0800, banks[1] >> 1);
+        for (int i{0}; i < 4; ++i) {
+            map_chr(chr_swap ^ (0x1000 + i * 0x0400), 0x0400, banks[2 + i]);
+        }
+    }
+};
+} // namespace
+
+std::unique_ptr<mapper> make_mapper(cartridge cart, memory_bus &bus,
+                                    picture_processing_unit *ppu) {
+    switch (cart.mapper_number) {
+    case 0:
+        return std::make_unique<nrom>(std::move(cart), bus, ppu);
+    case 1:
+        return std::make_unique<mmc1>(std::move(cart), bus, ppu);
+    case 2:
+        return std::make_unique<uxrom>(std::move(cart), bus, ppu);
+    case 3:
+        return std::make_unique<cnrom>(std::move(cart), bus, ppu);
+    case 4:
+        return std::make_unique<mmc3>(std::move(cart), bus, ppu);
+    default:
+        throw std::runtime_error("Unsupported mapper " +
+                                 std::to_string(cart.mapper_number) + ".");
+    }
+}
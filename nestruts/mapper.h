@@ -0,0 +1,60 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "mem.h"
+#include "ppu.h"
+
+// Contents of a cartridge. The ROMs point into storage, e.g. a mapped ROM
+// file, which is kept alive as long as the cartridge.
+struct cartridge {
+    uint16_t mapper_number{};
+    std::shared_ptr<void const> storage{};
+    std::span<uint8_t const> prg_rom{};
+    std::span<uint8_t const> chr_rom{};
+    // Used when there is no CHR ROM, at least 8 K.
+    std::size_t chr_ram_size{};
+    mirroring nametable_mirroring{mirroring::horizontal};
+};
+
+// Bank switching hardware of a cartridge. Banks are switched by pointing the
+// page tables of the memory bus and PPU into the cartridge contents, nothing
+// is copied.
+class mapper {
+  public:
+    mapper(mapper const &) = delete;
+    mapper &operator=(mapper const &) = delete;
+    virtual ~mapper() = default;
+
+    // CPU write to $8000-$FFFF.
+    virtual void write(uint16_t adr, uint8_t val) = 0;
+
+  protected:
+    // Without a PPU, e.g. in tests, CHR is not mapped.
+    mapper(cartridge cart, memory_bus &bus, picture_processing_unit *ppu);
+
+    // Map PRG ROM or CHR bank number bank, counted in size bytes, at adr.
+    // Bank numbers wrap around the size of the cartridge, negative numbers
+    // count from the last bank.
+    void map_prg(uint16_t adr, uint16_t size, int bank);
+    void map_chr(uint16_t adr, uint16_t size, int bank);
+    void set_mirroring(mirroring m);
+
+    memory_bus &bus;
+    picture_processing_unit *const ppu;
+    cartridge cart;
+
+  private:
+    // 8 K of cartridge RAM at $6000.
+    std::array<uint8_t, 0x2000> prg_ram{};
+    std::vector<uint8_t> chr_ram{};
+};
+
+// Creates the mapper of cart, which maps its power on banks. Throws for
+// unsupported mappers.
+std::unique_ptr<mapper> make_mapper(cartridge cart, memory_bus &bus,
+                                    picture_processing_unit *ppu);
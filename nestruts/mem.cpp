@@ -1,52 +1,101 @@
 #include "mem.h"
 
 #include "log.h"
+#include "mapper.h"
+#include <algorithm>
+#include <cassert>
 #include <cstdint>
 #include <memory>
 
 memory_bus::memory_bus(std::shared_ptr<picture_processing_unit> p,
                        std::shared_ptr<audio_processing_unit> a,
-                       std::shared_ptr<controller> c)
-    : ram{}, rom{}, ppu{std::move(p)}, apu{std::move(a)}, ctrl{std::move(c)} {}
-
-void memory_bus::write(uint16_t adr, uint8_t val) {
-    // RAM
-    if (adr < 0x2000) {
-        logf(log_level::debug, "\tw %#06x=%#04x ", adr, val);
-        uint16_t mod_adr = adr % 0x800;
-        ram[mod_adr] = val;
-    }
-    // PPU
-    else if (adr < 0x4000) {
-        uint16_t ppu_reg = adr % 0x8;
-        switch (ppu_reg) {
-        case 0x0:
-            ppu->set_PPUCTRL(val);
-            break;
-        case 0x1:
-            ppu->set_PPUMASK(val);
-            break;
-        case 0x2:
-            logf(log_level::error, "unimplemented ppu write: %d\n", ppu_reg);
-            break;
-        case 0x3:
-            ppu->set_OAMADDR(val);
-            break;
-        case 0x4:
-            logf(log_level::error, "unimplemented ppu write: %d\n", ppu_reg);
-            break;
-        case 0x5:
-            ppu->write_PPUSCROLL(val);
-            break;
-        case 0x6:
-            ppu->write_PPUADDR(val);
-            break;
-        case 0x7:
-            ppu->write_PPUDATA(val);
-            break;
+                       std::shared_ptr<controller> c,
+                       std::shared_ptr<event_scheduler> e)
+    : ram{}, events{std::move(e)}, ppu{std::move(p)}, apu{std::move(a)},
+      ctrl{std::move(c)} {
+    for (std::size_t i{0}; i < pages.size(); ++i) {
+        auto &page = pages[i];
+        page.read = &memory_bus::read_unmapped;
+        page.write = &memory_bus::write_unmapped;
+        if (i < 0x20) {
+            // The 2 K of RAM is mirrored up to $2000.
+            page.write_data = ram.data() + (i << 8) % ram.size();
+            page.read_data = page.write_data;
+        } else if (i < 0x40) {
+            page.read = &memory_bus::read_ppu;
+            page.write = &memory_bus::write_ppu;
+        } else if (i == 0x40) {
+            page.read = &memory_bus::read_io;
+            page.write = &memory_bus::write_io;
+        } else if (i >= 0x80) {
+            static constexpr std::array<uint8_t, 0x100> blank{};
+            page.read_data = blank.data();
         }
-        // MISC
-    } else if (adr == 0x4000) {
+    }
+}
+
+memory_bus::~memory_bus() = default;
+
+void memory_bus::set_mapper(std::unique_ptr<mapper> m) {
+    cartridge_mapper = std::move(m);
+    for (std::size_t i{0x80}; i < pages.size(); ++i) {
+        pages[i].write = &memory_bus::write_mapper;
+    }
+}
+
+void memory_bus::map_prg(uint16_t adr, uint8_t const *data, uint16_t size) {
+    assert(adr >= 0x8000 && adr % 0x1000 == 0 && size % 0x1000 == 0);
+    bool changed{false};
+    for (std::size_t offs{0}; offs < size; offs += 0x100) {
+        auto &page = pages[(adr + offs) >> 8];
+        changed = changed || page.read_data != data + offs;
+        page.read_data = data + offs;
+    }
+    // Games often select the bank that is already mapped.
+    if (changed && rom_listener)
+        rom_listener(adr, size, rom_change::mapping);
+}
+
+void memory_bus::map_prg_ram(uint16_t adr, uint8_t *data, uint16_t size) {
+    for (std::size_t offs{0}; offs < size; offs += 0x100) {
+        auto &page = pages[(adr + offs) >> 8];
+        page.read_data = data + offs;
+        page.write_data = data + offs;
+    }
+}
+
+void memory_bus::write_ppu(uint16_t adr, uint8_t val) {
+    uint16_t ppu_reg = adr % 0x8;
+    switch (ppu_reg) {
+    case 0x0:
+        ppu->set_PPUCTRL(val);
+        break;
+    case 0x1:
+        ppu->set_PPUMASK(val);
+        break;
+    case 0x2:
+        logf(log_level::error, "unimplemented ppu write: %d\n", ppu_reg);
+        break;
+    case 0x3:
+        ppu->set_OAMADDR(val);
+        break;
+    case 0x4:
+        logf(log_level::error, "unimplemented ppu write: %d\n", ppu_reg);
+        break;
+    case 0x5:
+        ppu->write_PPUSCROLL(val);
+        break;
+    case 0x6:
+        ppu->write_PPUADDR(val);
+        break;
+    case 0x7:
+        ppu->write_PPUDATA(val);
+        break;
+    }
+}
+
+void memory_bus::write_io(uint16_t adr, uint8_t val) {
+    if (adr == 0x4000) {
         apu->pulse1.dlcn(val);
     } else if (adr == 0x4001) {
         apu->pulse1.sweep(val);
@@ -63,21 +112,42 @@ void memory_bus::write(uint16_t adr, uint8_t val) {
     } else if (adr == 0x4007) {
         apu->pulse2.length_counter_timer_high(val);
     } else if (adr == 0x4014) {
-        // OAM DMA
-        // Should take 513 or 514 cycles.
-        std::size_t offs = val << 8;
-        log(log_level::debug, "\toam copy from [${:04x}-${:04x}]", offs, offs + 0xFF);
-        ppu->dma_copy(std::span<uint8_t, 0x100>(ram.data() + offs, 0x100));
-    } else if (adr == 0x415) {
-        apu->write_status(adr);
+        // OAM DMA from page val, which may be RAM, one of its mirrors or
+        // cartridge memory.
+        // Takes 513 or 514 cycles, the CPU adds the odd cycle.
+        uint16_t const start = val << 8;
+        log(log_level::debug, "\toam copy from [${:04x}-${:04x}]", start,
+            start + 0xFF);
+        if (auto const *data = pages[val].read_data) {
+            ppu->dma_copy(std::span<uint8_t const, 0x100>(data, 0x100));
+        } else {
+            std::array<uint8_t, 0x100> copy{};
+            for (std::size_t offs{0}; offs < copy.size(); ++offs) {
+                copy[offs] = read(start + offs);
+            }
+            ppu->dma_copy(copy);
+        }
+        events->stall(513);
+    } else if (adr == 0x4015) {
+        apu->write_status(val);
     } else if (adr == 0x4016) {
         ctrl->write(val);
     } else if (adr == 0x4017) {
         logf(log_level::debug, "\tWrite APU frame counter");
         apu->set_frame_counter(val);
-    } else if ((adr >= 0x4000 && adr <= 0x4013) || adr == 0x4015) {
+    } else if (adr >= 0x4000 && adr <= 0x4013) {
         logf(log_level::debug, "\tWriting to unimplemented APU: %#6x\n", adr);
-    } else if (adr >= 0x8000) {
+    } else {
+        write_unmapped(adr, val);
+    }
+}
+
+void memory_bus::write_mapper(uint16_t adr, uint8_t val) {
+    cartridge_mapper->write(adr, val);
+}
+
+void memory_bus::write_unmapped(uint16_t adr, uint8_t) {
+    if (adr >= 0x8000) {
         logf(log_level::error, "\tWarning: trying to write to ROM: %#6x\n",
              adr);
     } else {
@@ -85,25 +155,19 @@ void memory_bus::write(uint16_t adr, uint8_t val) {
     }
 }
 
-uint8_t memory_bus::read(uint16_t adr) {
-    // RAM
-    if (adr < 0x2000) {
-        uint16_t mod_adr = adr % 0x800;
-        logf(log_level::debug, "r %#06x=%#04x ", adr, ram[mod_adr]);
-        return ram[mod_adr];
+uint8_t memory_bus::read_ppu(uint16_t adr) {
+    uint16_t ppu_reg = adr % 0x8;
+    switch (ppu_reg) {
+    case 0x2:
+        return ppu->read_PPUSTATUS();
+    default:
+        logf(log_level::error, "Unsupported ppu read\n");
+        return 0;
     }
-    // PPU
-    else if (adr < 0x4000) {
-        uint16_t ppu_reg = adr % 0x8;
-        switch (ppu_reg) {
-        case 0x2:
-            return ppu->read_PPUSTATUS();
-        default:
-            logf(log_level::error, "Unsupported ppu read\n");
-            return 0;
-        }
-        // MISC
-    } else if (adr == 0x4015) {
+}
+
+uint8_t memory_bus::read_io(uint16_t adr) {
+    if (adr == 0x4015) {
         return apu->read_status();
     } else if (adr == 0x4016) {
         return ctrl->read();
@@ -112,18 +176,27 @@ uint8_t memory_bus::read(uint16_t adr) {
              "\t Reading from unimplemented controller: %#6x\n", adr);
         // Assume 0 is ok to return.
         return 0;
-    } else if (adr >= 0x8000) {
-        // Remove base address
-        uint16_t mod_adr = adr - 0x8000;
-        return rom[mod_adr];
-    } else {
-        logf(log_level::error, "\tUnsupported read : %#6x\n", adr);
-        return 0;
     }
+    return read_unmapped(adr);
 }
 
-value_proxy memory_bus::operator[](uint16_t adr) {
-    return value_proxy{this, adr};
+uint8_t memory_bus::read_unmapped(uint16_t adr) {
+    logf(log_level::error, "\tUnsupported read : %#6x\n", adr);
+    return 0;
+}
+
+void memory_bus::fill_ram(uint16_t adr, uint16_t size, uint8_t val) {
+    // The 2 K of RAM is mirrored up to $2000.
+    for (uint16_t offs = adr % ram.size(); size > 0;) {
+        uint16_t const chunk = std::min<uint16_t>(size, ram.size() - offs);
+        std::fill_n(ram.begin() + offs, chunk, val);
+        size -= chunk;
+        offs = 0;
+    }
+}
+
+void memory_bus::write_ppu_data(std::span<uint8_t const> data) {
+    ppu->write_PPUDATA(data);
 }
 
 void memory_bus::load_rom(uint16_t adr, uint8_t val) {
@@ -132,7 +205,17 @@ void memory_bus::load_rom(uint16_t adr, uint8_t val) {
     } else if (adr == 0xFFFD) {
         logf(log_level::debug, "Writing reset vector high %#04x\n", val);
     }
+    if (!rom) {
+        rom = std::make_unique<std::array<uint8_t, 0x08000>>();
+        for (std::size_t i{0x80}; i < pages.size(); ++i) {
+            pages[i].read_data = rom->data() + ((i - 0x80) << 8);
+        }
+        if (rom_listener)
+            rom_listener(0x8000, 0x8000, rom_change::contents);
+    }
     // Remove base address
     uint16_t mod_adr = adr - 0x8000;
-    rom[mod_adr] = val;
+    (*rom)[mod_adr] = val;
+    if (rom_listener)
+        rom_listener(adr, 1, rom_change::contents);
 }
@@ -1,31 +1,130 @@
 #pragma once
 #include <array>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <span>
+#include <utility>
 
 #include "apu.h"
 #include "controller.h"
 #include "log.h"
 #include "ppu.h"
+#include "scheduler.h"
 
+class mapper;
 class value_proxy;
 
+// What changed in a range of PRG ROM.
+enum class rom_change : uint8_t {
+    // The bytes, e.g. by loading.
+    contents,
+    // Which bank is mapped, the banks themselves are unchanged.
+    mapping,
+};
+
 class memory_bus final {
   public:
     memory_bus(std::shared_ptr<picture_processing_unit> ppu,
                std::shared_ptr<audio_processing_unit> apu,
-               std::shared_ptr<controller> ctrl);
-    void write(uint16_t adr, uint8_t val);
-    uint8_t read(uint16_t adr);
+               std::shared_ptr<controller> ctrl,
+               std::shared_ptr<event_scheduler> events =
+                   std::make_shared<event_scheduler>());
+    ~memory_bus();
+    // RAM and ROM are accessed through the page table, I/O registers
+    // through the handler of their page. Debug builds trace RAM accesses.
+    void write(uint16_t adr, uint8_t val) {
+        auto const &page = pages[adr >> 8];
+        if (page.write_data) {
+            if constexpr (min_log_level <= log_level::debug) {
+                if (adr < 0x2000)
+                    logf(log_level::debug, "\tw %#06x=%#04x ", adr, val);
+            }
+            page.write_data[adr & 0xFF] = val;
+        } else {
+            (this->*page.write)(adr, val);
+        }
+    }
+    uint8_t read(uint16_t adr) {
+        auto const &page = pages[adr >> 8];
+        if (page.read_data) {
+            if constexpr (min_log_level <= log_level::debug) {
+                if (adr < 0x2000)
+                    logf(log_level::debug, "r %#06x=%#04x ", adr,
+                         page.read_data[adr & 0xFF]);
+            }
+            return page.read_data[adr & 0xFF];
+        }
+        return (this->*page.read)(adr);
+    }
+    // Writes the built-in 32 K of ROM, which is mapped until a mapper maps
+    // its own banks.
     void load_rom(uint16_t adr, uint8_t val);
+    // Called with the start and size of a PRG ROM range that changed.
+    using rom_change_listener =
+        std::function<void(uint16_t, uint16_t, rom_change)>;
+    void on_rom_change(rom_change_listener listener) {
+        rom_listener = std::move(listener);
+    }
+
+    // Cartridge hardware, receives writes to $8000-$FFFF.
+    void set_mapper(std::unique_ptr<mapper> m);
+    // Bank switching for mappers, points the size bytes of PRG ROM at adr to
+    // data without copying. Whole 4 K pages, as core6502 caches code per 4 K
+    // page of host memory.
+    void map_prg(uint16_t adr, uint8_t const *data, uint16_t size);
+    // Points the size bytes of cartridge RAM at adr to data.
+    void map_prg_ram(uint16_t adr, uint8_t *data, uint16_t size);
+    // Shared with the devices on the bus and the CPU.
+    event_scheduler &scheduler() const { return *events; }
 
+    // Resolves adr once, see value_proxy.
     value_proxy operator[](uint16_t adr);
+    // Memory backing the page of adr, null for I/O and, when writing, ROM.
+    uint8_t const *read_data(uint16_t adr) const {
+        auto const *data = pages[adr >> 8].read_data;
+        return data ? data + (adr & 0xFF) : nullptr;
+    }
+    uint8_t *write_data(uint16_t adr) const {
+        auto *data = pages[adr >> 8].write_data;
+        return data ? data + (adr & 0xFF) : nullptr;
+    }
+
+    // Bulk writes for loops core6502 runs natively. Equivalent to writing
+    // val to size consecutive RAM addresses, and to writing data to
+    // PPUDATA byte by byte.
+    void fill_ram(uint16_t adr, uint16_t size, uint8_t val);
+    void write_ppu_data(std::span<uint8_t const> data);
 
   private:
     // 2 K of RAM
     std::array<uint8_t, 0x0800> ram{};
-    // 32 K of ROM
-    std::array<uint8_t, 0x08000> rom{};
+    // 32 K of ROM, allocated by the first load_rom. Most instances get their
+    // ROM from a mapper.
+    std::unique_ptr<std::array<uint8_t, 0x08000>> rom{};
+
+    // One entry per 256 B page. Pages backed by memory point into it,
+    // otherwise the handler decodes the address.
+    using read_handler = uint8_t (memory_bus::*)(uint16_t adr);
+    using write_handler = void (memory_bus::*)(uint16_t adr, uint8_t val);
+    struct page {
+        uint8_t const *read_data{};
+        uint8_t *write_data{};
+        read_handler read{};
+        write_handler write{};
+    };
+    std::array<page, 0x100> pages{};
+    uint8_t read_ppu(uint16_t adr);
+    void write_ppu(uint16_t adr, uint8_t val);
+    uint8_t read_io(uint16_t adr);
+    void write_io(uint16_t adr, uint8_t val);
+    void write_mapper(uint16_t adr, uint8_t val);
+    uint8_t read_unmapped(uint16_t adr);
+    void write_unmapped(uint16_t adr, uint8_t val);
+
+    std::shared_ptr<event_scheduler> const events;
+    rom_change_listener rom_listener{};
+    std::unique_ptr<mapper> cartridge_mapper{};
 
     std::shared_ptr<picture_processing_unit> ppu;
     std::shared_ptr<audio_processing_unit> apu;
@@ -33,13 +132,20 @@ class memory_bus final {
 };
 
 // Behaves like a uint8_t for the user. When written to can either write to
-// an underlying memory location or a locally stored value.
+// an underlying memory location or a locally stored value. Memory locations
+// are resolved through the page table once, RAM and ROM are then accessed
+// directly.
 class value_proxy final {
   public:
     explicit value_proxy(uint8_t value) : m_value{value} {}
     explicit value_proxy(memory_bus *mem, uint16_t adr)
-        : m_mem{mem}, m_adr{adr} {}
+        : m_mem{mem}, m_read{mem->read_data(adr)},
+          m_write{mem->write_data(adr)}, m_adr{adr} {}
     void set(uint8_t val) {
+        if (m_write) {
+            *m_write = val;
+            return;
+        }
         if (!m_mem) {
             // TODO: Make hard error or even compile time error.
             log(log_level::error, "Writing to read-only memory");
@@ -47,10 +153,33 @@ class value_proxy final {
         }
         m_mem->write(m_adr, val);
     }
-    uint8_t value() { return m_mem ? m_mem->read(m_adr) : m_value; }
+    uint8_t value() {
+        if (m_read)
+            return *m_read;
+        return m_mem ? m_mem->read(m_adr) : m_value;
+    }
+    // Read-modify-write, returns the result of op. RAM is updated in place.
+    // Like the 6502, other locations see the unmodified value written back
+    // before the result.
+    template <typename Op> uint8_t modify(Op op) {
+        if (m_write) {
+            return *m_write = op(*m_write);
+        }
+        uint8_t const val = value();
+        set(val);
+        uint8_t const res = op(val);
+        set(res);
+        return res;
+    }
 
   private:
     memory_bus *m_mem{};
+    uint8_t const *m_read{};
+    uint8_t *m_write{};
     uint16_t m_adr{};
     uint8_t m_value{};
 };
+
+inline value_proxy memory_bus::operator[](uint16_t adr) {
+    return value_proxy{this, adr};
+}
@@ -3,131 +3,275 @@
 
 #include <SDL2/SDL_keyboard.h>
 #include <SDL2/SDL_scancode.h>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <exception>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
 
 #include "apu.h"
+#include "audio.h"
 #include "controller.h"
 #include "core6502.h"
+#include "frame_exchange.h"
+#include "gfx.h"
 #include "log.h"
 #include "mem.h"
+#include "ntsc.h"
 #include "rom.h"
+#include "upscale.h"
 
 using namespace std::literals;
 
 std::tuple<std::shared_ptr<picture_processing_unit>,
            std::unique_ptr<memory_bus>, std::shared_ptr<audio_processing_unit>,
            std::shared_ptr<controller>>
-start_system(std::string const& filename) {
+start_system(std::string const &filename, std::shared_ptr<video_sink> video) {
     // load PRG ROM
-    auto ppu = std::make_shared<picture_processing_unit>();
-    auto apu = std::make_shared<audio_processing_unit>();
+    auto events = std::make_shared<event_scheduler>();
+    auto ppu = std::make_shared<picture_processing_unit>(events,
+                                                         std::move(video));
+    // Keep going without sound rather than not at all.
+    std::shared_ptr<audio_sink> audio{};
+    try {
+        audio = std::make_shared<sdl_audio_sink>();
+    } catch (std::runtime_error const &error) {
+        log(log_level::error, "{}, continuing without sound\n", error.what());
+        audio = std::make_shared<null_audio_sink>();
+    }
+    auto apu = std::make_shared<audio_processing_unit>(events, audio);
     auto ctrl = std::make_shared<controller>();
-    auto bus = std::make_unique<memory_bus>(ppu, apu, ctrl);
+    auto bus = std::make_unique<memory_bus>(ppu, apu, ctrl, events);
     load_rom(filename, *ppu, *bus);
     return {std::move(ppu), std::move(bus), std::move(apu), std::move(ctrl)};
 }
 
-int run_game(std::string const &rom_filename) {
+// Buttons held on the keyboard, one bit per button as in controller.
+uint8_t keyboard_buttons() {
+    constexpr std::array<std::pair<SDL_Scancode, button>, 8> keys{{
+        {SDL_SCANCODE_LEFT, button::left},
+        {SDL_SCANCODE_RIGHT, button::right},
+        {SDL_SCANCODE_UP, button::up},
+        {SDL_SCANCODE_DOWN, button::down},
+        {SDL_SCANCODE_Z, button::b},
+        {SDL_SCANCODE_X, button::a},
+        {SDL_SCANCODE_RETURN, button::start},
+        {SDL_SCANCODE_LSHIFT, button::select},
+    }};
+    int numkeys{};
+    auto const *const keyboard_state = SDL_GetKeyboardState(&numkeys);
+    uint8_t state{};
+    for (auto const &[key, b] : keys) {
+        if (keyboard_state[key])
+            state |= static_cast<uint8_t>(b);
+    }
+    return state;
+}
+
+// Emulates on a thread of its own while this one presents frames and reads
+// input, so neither waits for the other: the next frame is emulated while
+// the last one is scaled and presented.
+int run_game(std::string const &rom_filename,
+             std::string const &record_filename, bool disassemble,
+             bool accurate, scaling mode,
+             std::optional<upscale_filter> filter, bool composite) {
     int status{0};
-    auto [ppu, bus, apu, ctrl] =
-        start_system(rom_filename);
+    // Controller state per frame, replayed by nestruts_static.
+    std::ofstream record{};
+    if (!record_filename.empty()) {
+        record.open(record_filename, std::ios::binary);
+        if (!record)
+            throw std::runtime_error("Failed to open file '" +
+                                     record_filename + "'.");
+    }
+    auto gfx = std::make_shared<graphics>(mode);
+    std::shared_ptr<video_sink> video{gfx};
+    if (filter)
+        video = std::make_shared<upscaling_video_sink>(*filter, gfx);
+    if (composite)
+        video = std::make_shared<ntsc_video_sink>(video);
+    auto exchange = std::make_shared<frame_exchange>(video);
+    auto [ppu, bus, apu, ctrl] = start_system(rom_filename, exchange);
     // The reset vector is always stored at this address in ROM.
     uint16_t const reset_vector = bus->read(0xFFFC) + (bus->read(0xFFFD) << 8);
-    auto cpu = std::make_unique<core6502>(std::move(bus),
-                                          [apu]() { return apu->IRQ(); });
+    auto cpu = std::make_unique<core6502>(std::move(bus));
     cpu->setpp(reset_vector);
-    // Actual NTSC: 29780.5. We run one instruction per cycle which is way
-    // faster than a real 6502 so ~1/3 should still be plenty.
-    constexpr int cycles_per_frame{10000};
+    cpu->set_recording(disassemble);
+    cpu->set_idle_loop_skipping(!accurate);
     // Warm up for one frame (enough?)
-    for (int i{0}; i < cycles_per_frame; ++i) {
-        if (!cpu->is_faulted()) {
-            cpu->cycle();
-        } else {
-            log(log_level::error, "CPU faulted:\n{}\n", cpu->dump_state());
-            status = 1;
-            break;
-        }
+    cpu->run_until(frame_end_cycle(1));
+    if (cpu->is_faulted()) {
+        log(log_level::error, "CPU faulted:\n{}\n", cpu->dump_state());
+        status = 1;
     }
-    int64_t const initial_frame_timestamp_ms = SDL_GetTicks64();
     log(log_level::info, "Warmup finished\n");
-    for (int32_t frames{0};; ++frames) {
-        // Aim for 60 frames per second
-        int64_t sleep_time_ms = initial_frame_timestamp_ms +
-                                frames * 1000 / 60 -
-                                static_cast<int64_t>(SDL_GetTicks64());
-        log(log_level::debug, "sleep time: {} ms\n", sleep_time_ms);
-        if (sleep_time_ms > 0) {
-            SDL_Delay(sleep_time_ms);
-        }
-        SDL_Event e;
-        while (SDL_PollEvent(&e)) {
-            if (e.type == SDL_QUIT) {
-                goto exit;
-            }
-            if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_SPACE) {
-                current_log_level = log_level::debug;
-            }
-        }
-        ctrl->clear();
-        int numkeys{};
-        auto keyboard_state = SDL_GetKeyboardState(&numkeys);
-        if (keyboard_state[SDL_SCANCODE_LEFT])
-            ctrl->down(button::left);
-        if (keyboard_state[SDL_SCANCODE_RIGHT])
-            ctrl->down(button::right);
-        if (keyboard_state[SDL_SCANCODE_UP])
-            ctrl->down(button::up);
-        if (keyboard_state[SDL_SCANCODE_DOWN])
-            ctrl->down(button::down);
-        if (keyboard_state[SDL_SCANCODE_Z])
-            ctrl->down(button::b);
-        if (keyboard_state[SDL_SCANCODE_X])
-            ctrl->down(button::a);
-        if (keyboard_state[SDL_SCANCODE_RETURN])
-            ctrl->down(button::start);
-        if (keyboard_state[SDL_SCANCODE_LSHIFT])
-            ctrl->down(button::select);
-        if (ppu->vblank()) {
-            cpu->nmi();
-        }
 
-        for (int i{0}; i < cycles_per_frame && !cpu->is_faulted(); ++i) {
-            cpu->cycle();
-            if (i % 2 == 0)
-                apu->cycle();
+    // Input for the emulation thread.
+    std::atomic<bool> running{true};
+    std::atomic<bool> debug_view{false};
+    std::atomic<uint8_t> buttons{};
+    // Frames the emulation thread finished after they were due.
+    int64_t late_frames{0};
+    auto const emulate = [&] {
+        using sixtieths = std::chrono::duration<int64_t, std::ratio<1, 60>>;
+        auto const start = std::chrono::steady_clock::now();
+        for (int32_t frames{0}; running.load(std::memory_order_relaxed);
+             ++frames) {
+            if (debug_view.load(std::memory_order_relaxed))
+                current_log_level = log_level::debug;
+            ctrl->set_state(buttons.load(std::memory_order_relaxed));
+            if (record)
+                record.put(static_cast<char>(ctrl->state()));
+            // Starts with vblank, the PPU triggers NMI.
+            cpu->run_until(frame_end_cycle(frames + 2));
+            log(log_level::debug, "skipped {} cycles in idle loops\n",
+                cpu->take_skipped_cycles());
+            log(log_level::debug, "redrew {} background tiles and {} lines\n",
+                ppu->last_frame_stats().tiles_redrawn,
+                ppu->last_frame_stats().lines_rendered);
             if (cpu->is_faulted()) {
                 log(log_level::error, "CPU faulted:\n{}\n", cpu->dump_state());
                 status = 1;
-                break;
             }
+            if (current_log_level == log_level::debug) {
+                ppu->draw_debug();
+            } else {
+                ppu->draw();
+            }
+            apu->play_audio();
+            if (cpu->is_faulted())
+                break;
+            // Aim for 60 frames per second
+            auto const due = start + sixtieths{frames + 1};
+            if (std::chrono::steady_clock::now() > due)
+                ++late_frames;
+            else
+                std::this_thread::sleep_until(due);
         }
-        if (current_log_level == log_level::debug) {
-            ppu->draw_debug();
-        } else {
-            ppu->draw();
+    };
+    // Errors are rethrown on this thread once the presenter has stopped, so
+    // they reach the handler in main as before.
+    std::exception_ptr error{};
+    std::thread emulation{[&] {
+        try {
+            emulate();
+        } catch (...) {
+            error = std::current_exception();
         }
-        apu->play_audio();
-        if (cpu->is_faulted())
-            break;
+        exchange->close();
+    }};
+
+    try {
+        while (exchange->present_next()) {
+            log(log_level::debug, "presented in {} us\n",
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    gfx->last_present_time())
+                    .count());
+            SDL_Event e;
+            while (SDL_PollEvent(&e)) {
+                if (e.type == SDL_QUIT) {
+                    running = false;
+                }
+                if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_SPACE) {
+                    debug_view = true;
+                }
+            }
+            buttons.store(keyboard_buttons(), std::memory_order_relaxed);
+        }
+    } catch (...) {
+        running = false;
+        emulation.join();
+        throw;
     }
-exit:
+    running = false;
+    emulation.join();
+    if (error)
+        std::rethrow_exception(error);
+    auto const stalls = exchange->stalls();
+    log(log_level::info,
+        "Emulation was late for {} frames and {} frames were dropped, "
+        "presentation waited for {} frames\n",
+        late_frames, stalls.dropped, stalls.waited);
     return status;
 }
 
-void print_usage() { std::cout << "Usage:\n\tnestruts [-d] FILENAME\n"; }
+void print_usage() {
+    std::cout << "Usage:\n\tnestruts [-d] [-a] [-c] [-n] [-r INPUTS] "
+                 "[-s SCALING] [-u FILTER] FILENAME\n"
+                 "\t-a: interpret idle loops instead of skipping them\n"
+                 "\t-c: simulate the NTSC composite signal, as on a TV\n"
+                 "\t-n: do not write executed instructions to disasm_dump\n"
+                 "\t-r: record the controller input of each frame to INPUTS\n"
+                 "\t-s: integer (default), aspect or stretch to scale frames "
+                 "to the window\n"
+                 "\t-u: upscale frames with nearest2x, nearest3x, nearest4x, "
+                 "scale2x, scale3x or edge2x first\n";
+}
 
 int main(int argc, char *argv[]) {
     current_log_level = log_level::info;
     int consumed_args{0};
-    if (argc == 3 && "-d"sv == argv[1]) {
-        current_log_level = log_level::debug;
-        consumed_args++;
+    std::string record_filename{};
+    bool disassemble{true};
+    bool accurate{false};
+    scaling mode{scaling::integer};
+    std::optional<upscale_filter> filter{};
+    bool composite{false};
+    while (consumed_args + 2 < argc) {
+        if ("-d"sv == argv[consumed_args + 1]) {
+            current_log_level = log_level::debug;
+            consumed_args++;
+        } else if ("-a"sv == argv[consumed_args + 1]) {
+            accurate = true;
+            consumed_args++;
+        } else if ("-c"sv == argv[consumed_args + 1]) {
+            composite = true;
+            consumed_args++;
+        } else if ("-n"sv == argv[consumed_args + 1]) {
+            disassemble = false;
+            consumed_args++;
+        } else if ("-r"sv == argv[consumed_args + 1]) {
+            record_filename = argv[consumed_args + 2];
+            consumed_args += 2;
+        } else if ("-s"sv == argv[consumed_args + 1]) {
+            std::string_view const name{argv[consumed_args + 2]};
+            if (name == "integer") {
+                mode = scaling::integer;
+            } else if (name == "aspect") {
+                mode = scaling::aspect;
+            } else if (name == "stretch") {
+                mode = scaling::stretch;
+            } else {
+                log(log_level::error, "Unknown scaling '{}'.\n", name);
+                print_usage();
+                return 1;
+            }
+            consumed_args += 2;
+        } else if ("-u"sv == argv[consumed_args + 1]) {
+            for (int i{0}; i < static_cast<int>(upscale_filter::count); ++i) {
+                if (upscale_filter_name(static_cast<upscale_filter>(i)) ==
+                    argv[consumed_args + 2])
+                    filter = static_cast<upscale_filter>(i);
+            }
+            if (!filter) {
+                log(log_level::error, "Unknown filter '{}'.\n",
+                    argv[consumed_args + 2]);
+                print_usage();
+                return 1;
+            }
+            consumed_args += 2;
+        } else {
+            break;
+        }
     }
     if (argc != consumed_args + 2) {
         log(log_level::error, "Unexpected number of command line arguments.\n");
@@ -135,9 +279,11 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     try {
-        return run_game(argv[consumed_args + 1]);
+        return run_game(argv[consumed_args + 1], record_filename,
+                        disassemble, accurate, mode, filter, composite);
     } catch (std::runtime_error const &error) {
         log(log_level::error, "Failed to run: {}\n", error.what());
         print_usage();
+        return 1;
     }
 }
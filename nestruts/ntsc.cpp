@@ -0,0 +1,277 @@
+#include "ntsc.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <numbers>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace {
+// Signal levels in volts of the low and high half of the square wave of a
+// colour, by its luma level.
+constexpr std::array<double, 4> low_levels{0.350, 0.518, 0.962, 1.550};
+constexpr std::array<double, 4> high_levels{1.094, 1.506, 1.962, 1.962};
+constexpr double black{0.518};
+constexpr double white{1.962};
+// Emphasis attenuates the signal during the half of the subcarrier cycle
+// centred on red, green or blue.
+constexpr double emphasis_attenuation{0.746};
+
+constexpr int samples_per_cycle{12};
+constexpr int samples_per_pixel{8};
+// Pixels start at every fourth sample of the subcarrier cycle.
+constexpr int phases{3};
+constexpr int entries{64 << 3};
+// Each output pixel is decoded at the centre of 4 samples, two per pixel.
+// A pixel reaches the outputs of the pixels two to its left through two to
+// its right, kept in pairs of output pixels of B, G, R and 0, fixed point
+// with 4 fraction bits.
+constexpr int kernel_pairs{5};
+constexpr int kernel_size{kernel_pairs * 2 * 4};
+constexpr int fraction_bits{4};
+// Rotates the decoded colours onto those of palette.h, which they match to
+// about 11 in 255 per channel.
+constexpr double hue{112 * std::numbers::pi / 180};
+constexpr double saturation{0.65};
+
+bool in_colour_phase(int colour, int phase) {
+    return (colour + phase) % samples_per_cycle < 6;
+}
+
+// Signal of entry at phase of the subcarrier, 0 at black and 1 at white.
+double signal_level(int entry, int phase) {
+    int const colour = entry & 0x0F;
+    int const level = colour > 13 ? 1 : (entry >> 4) & 0x03;
+    int const emphasis = entry >> 6;
+    double const low = colour == 0 ? high_levels[level] : low_levels[level];
+    double const high = colour > 12 ? low_levels[level] : high_levels[level];
+    double signal = in_colour_phase(colour, phase) ? high : low;
+    if ((emphasis & 0x01 && in_colour_phase(0, phase)) ||
+        (emphasis & 0x02 && in_colour_phase(4, phase)) ||
+        (emphasis & 0x04 && in_colour_phase(8, phase)))
+        signal *= emphasis_attenuation;
+    return (signal - black) / (white - black);
+}
+
+// Weights of the samples distance away from where a pixel is decoded. Both
+// sum up whole subcarrier cycles, which cancel out of luma and leave only
+// the colour of flat areas in chroma. Chroma is averaged over two cycles,
+// so colours bleed further than brightness.
+double luma_weight(int distance) {
+    distance = std::abs(distance);
+    if (distance > 6)
+        return 0;
+    return distance == 6 ? 1.0 / 24 : 1.0 / 12;
+}
+
+double chroma_weight(int distance) {
+    distance = std::abs(distance);
+    return distance < 12 ? (12.0 - distance) / 144 : 0;
+}
+
+// What one pixel of each entry, starting at each phase, adds to the output
+// pixels around it.
+std::vector<int16_t> make_kernels() {
+    std::vector<int16_t> kernels((phases * entries + 1) * kernel_size);
+    for (int phase{0}; phase < phases; ++phase) {
+        for (int entry{0}; entry < entries; ++entry) {
+            auto *const kernel =
+                kernels.data() + (phase * entries + entry) * kernel_size;
+            for (int output{0}; output < 2 * kernel_pairs; ++output) {
+                // Relative to the first sample of the pixel.
+                int const centre = 4 * output - 14;
+                double y{}, i{}, q{};
+                for (int sample{0}; sample < samples_per_pixel; ++sample) {
+                    int const sample_phase =
+                        (4 * phase + sample) % samples_per_cycle;
+                    double const signal = signal_level(entry, sample_phase);
+                    double const angle = 2 * std::numbers::pi * sample_phase /
+                                             samples_per_cycle +
+                                         hue;
+                    double const chroma =
+                        2 * saturation * chroma_weight(sample - centre) *
+                        signal;
+                    y += luma_weight(sample - centre) * signal;
+                    i += chroma * std::cos(angle);
+                    q += chroma * std::sin(angle);
+                }
+                std::array<double, 3> const bgr{
+                    y - 1.106 * i + 1.703 * q,
+                    y - 0.272 * i - 0.647 * q,
+                    y + 0.956 * i + 0.621 * q,
+                };
+                for (int channel{0}; channel < 3; ++channel) {
+                    kernel[4 * output + channel] = static_cast<int16_t>(
+                        std::lround(bgr[channel] * (255 << fraction_bits)));
+                }
+            }
+        }
+    }
+    return kernels;
+}
+
+inline uint32_t clamp_channel(int sum) {
+    return static_cast<uint32_t>(std::clamp(sum >> fraction_bits, 0, 255));
+}
+
+// Output pair q of a line is the sum of pair j of the kernels of pixels
+// q + 2 - j, which are at pixels[q + 4 - j].
+void filter_pair(int16_t const *const *pixels, int q, uint32_t *out) {
+    std::array<int16_t, 8> sums{};
+    for (int j{0}; j < kernel_pairs; ++j) {
+        auto const *const kernel = pixels[q + 4 - j] + 8 * j;
+        for (int lane{0}; lane < 8; ++lane) {
+            sums[lane] = static_cast<int16_t>(sums[lane] + kernel[lane]);
+        }
+    }
+    for (int k{0}; k < 2; ++k) {
+        out[2 * q + k] = 0xFF000000 | clamp_channel(sums[4 * k + 2]) << 16 |
+                         clamp_channel(sums[4 * k + 1]) << 8 |
+                         clamp_channel(sums[4 * k]);
+    }
+}
+
+void filter_line_scalar(int16_t const *const *pixels, int width,
+                        uint32_t *out) {
+    for (int q{0}; q < width; ++q) {
+        filter_pair(pixels, q, out);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) inline __m128i load128(int16_t const *p) {
+    return _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));
+}
+
+__attribute__((target("sse2"))) inline __m128i
+sum_pair128(int16_t const *const *pixels, int q) {
+    auto sum = load128(pixels[q + 4]);
+    for (int j{1}; j < kernel_pairs; ++j) {
+        sum = _mm_add_epi16(sum, load128(pixels[q + 4 - j] + 8 * j));
+    }
+    return sum;
+}
+
+// Pairs q and q + 1, 4 output pixels.
+__attribute__((target("sse2"))) inline void
+filter_pairs128(int16_t const *const *pixels, int q, uint32_t *out) {
+    auto const bgr =
+        _mm_packus_epi16(_mm_srai_epi16(sum_pair128(pixels, q), fraction_bits),
+                         _mm_srai_epi16(sum_pair128(pixels, q + 1),
+                                        fraction_bits));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2 * q),
+                     _mm_or_si128(bgr, _mm_set1_epi32(0xFF000000)));
+}
+
+__attribute__((target("sse2"))) void
+filter_line_sse2(int16_t const *const *pixels, int width, uint32_t *out) {
+    int q{0};
+    for (; q + 2 <= width; q += 2) {
+        filter_pairs128(pixels, q, out);
+    }
+    for (; q < width; ++q) {
+        filter_pair(pixels, q, out);
+    }
+}
+
+// Pairs q and q + 1 in the low and high lane.
+__attribute__((target("avx2"))) inline __m256i
+sum_pair256(int16_t const *const *pixels, int q) {
+    auto sum = _mm256_setzero_si256();
+    for (int j{0}; j < kernel_pairs; ++j) {
+        auto const pair = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(load128(pixels[q + 4 - j] + 8 * j)),
+            load128(pixels[q + 5 - j] + 8 * j), 1);
+        sum = _mm256_add_epi16(sum, pair);
+    }
+    return sum;
+}
+
+__attribute__((target("avx2"))) void
+filter_line_avx2(int16_t const *const *pixels, int width, uint32_t *out) {
+    int q{0};
+    for (; q + 4 <= width; q += 4) {
+        // Packing works within lanes, which hold pairs q, q + 2 and
+        // q + 1, q + 3.
+        auto const bgr = _mm256_packus_epi16(
+            _mm256_srai_epi16(sum_pair256(pixels, q), fraction_bits),
+            _mm256_srai_epi16(sum_pair256(pixels, q + 2), fraction_bits));
+        _mm256_storeu_si256(
+            reinterpret_cast<__m256i *>(out + 2 * q),
+            _mm256_or_si256(_mm256_permute4x64_epi64(bgr, 0xD8),
+                            _mm256_set1_epi32(0xFF000000)));
+    }
+    for (; q + 2 <= width; q += 2) {
+        filter_pairs128(pixels, q, out);
+    }
+    for (; q < width; ++q) {
+        filter_pair(pixels, q, out);
+    }
+}
+#endif
+
+// By level, null where a level has no version of its own.
+constexpr std::array<void (*)(int16_t const *const *, int, uint32_t *), 3>
+    line_filters{
+        filter_line_scalar,
+#if defined(__x86_64__) || defined(__i386__)
+        filter_line_sse2,
+        filter_line_avx2,
+#endif
+    };
+
+auto find_line_filter(simd_level level) {
+    for (auto i = static_cast<std::size_t>(level);; --i) {
+        if (line_filters[i])
+            return line_filters[i];
+    }
+}
+} // namespace
+
+ntsc_filter::ntsc_filter(simd_level level)
+    : filter_line{find_line_filter(level)}, kernels{make_kernels()} {}
+
+void ntsc_filter::filter(std::span<uint8_t const> colours,
+                         std::span<uint8_t const> emphasis, int width,
+                         int64_t frame, uint32_t *out) {
+    int const height = static_cast<int>(colours.size()) / width;
+    auto const *const blank = kernels.data() + phases * entries * kernel_size;
+    line_kernels.assign(width + 4, blank);
+    for (int y{0}; y < height; ++y) {
+        // A line of 341 pixels moves the phase a third of a cycle ahead, a
+        // pixel two thirds.
+        int phase = (y + static_cast<int>(frame & 1)) % phases;
+        int const high_bits = (emphasis[y] & 0x07) << 6;
+        auto const *const line = colours.data() + y * width;
+        for (int x{0}; x < width; ++x) {
+            line_kernels[x + 2] =
+                kernels.data() +
+                (phase * entries + ((line[x] & 0x3F) | high_bits)) *
+                    kernel_size;
+            phase = (phase + 2) % phases;
+        }
+        auto *const row = out + 2 * y * 2 * width;
+        filter_line(line_kernels.data(), width, row);
+        std::memcpy(row + 2 * width, row, 2 * width * sizeof(uint32_t));
+    }
+}
+
+ntsc_video_sink::ntsc_video_sink(std::shared_ptr<video_sink> next,
+                                 simd_level level)
+    : filter{level}, next{std::move(next)} {}
+
+void ntsc_video_sink::present(std::span<uint32_t const> frame, int width) {
+    next->present(frame, width);
+}
+
+void ntsc_video_sink::present_colours(std::span<uint8_t const> frame,
+                                      std::span<uint8_t const> emphasis,
+                                      int width) {
+    filtered.resize(frame.size() * 4);
+    filter.filter(frame, emphasis, width, frames++, filtered.data());
+    next->present(filtered, 2 * width);
+}
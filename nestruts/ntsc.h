@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "upscale.h"
+#include "video_sink.h"
+
+// Simulates the composite signal of an NTSC NES and a TV decoding it, for
+// the colour bleed, fringes and dot crawl of captures from real hardware.
+// Each pixel is 8 samples of a square wave at the phase of its colour, 12
+// samples to a cycle of the colour subcarrier, and the TV separates luma and
+// chroma by averaging over whole cycles. Decoding is linear, so the RGB a
+// pixel adds to the output around it is computed ahead for every colour,
+// emphasis and phase of the subcarrier a pixel can start at, and filtering
+// a line only adds up these kernels.
+class ntsc_filter {
+  public:
+    explicit ntsc_filter(simd_level level = host_simd_level);
+
+    // Filters a frame of NES colours, 6 bits each with greyscale applied,
+    // width pixels per line, into out in ARGB with twice as many pixels in
+    // each direction. emphasis holds the emphasis bits of PPUMASK for each
+    // line, shifted down to bits 0-2. The subcarrier phase of the lines
+    // alternates between even and odd frames, as on hardware when rendering
+    // is enabled and the PPU skips a dot every other frame.
+    void filter(std::span<uint8_t const> colours,
+                std::span<uint8_t const> emphasis, int width, int64_t frame,
+                uint32_t *out);
+
+  private:
+    // Sums the kernels of width pixels, plus two of black beyond each edge,
+    // into a line.
+    using line_filter = void (*)(int16_t const *const *pixels, int width,
+                                 uint32_t *out);
+    line_filter const filter_line;
+    // By phase, then colour | emphasis << 6, then one of zeros for the
+    // pixels beyond the edges.
+    std::vector<int16_t> kernels{};
+    std::vector<int16_t const *> line_kernels{};
+};
+
+// Filters frames the PPU presents as NES colours before passing them on,
+// e.g. to graphics. Other frames, like the debug view, are passed on as they
+// are.
+class ntsc_video_sink final : public video_sink {
+  public:
+    explicit ntsc_video_sink(std::shared_ptr<video_sink> next,
+                             simd_level level = host_simd_level);
+
+    void present(std::span<uint32_t const> frame, int width) override;
+    bool wants_colours() const override { return true; }
+    void present_colours(std::span<uint8_t const> frame,
+                         std::span<uint8_t const> emphasis,
+                         int width) override;
+
+  private:
+    ntsc_filter filter;
+    std::shared_ptr<video_sink> const next;
+    std::vector<uint32_t> filtered{};
+    int64_t frames{};
+};
@@ -0,0 +1,298 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+enum class adr_mode : uint8_t {
+    implied,
+    accumulator,
+    immediate,
+    absolute,
+    x_indexed_absolute,
+    y_indexed_absolute,
+    absolute_indirect,
+    zero_page,
+    x_indexed_zero_page,
+    y_indexed_zero_page,
+    x_indexed_zero_page_indirect,
+    zero_page_indirect_y_indexed,
+    relative
+};
+
+enum class mnemonic : uint8_t {
+    invalid,
+    ADC,
+    AND,
+    ASL,
+    BCC,
+    BCS,
+    BEQ,
+    BIT,
+    BMI,
+    BNE,
+    BPL,
+    BRK,
+    BVC,
+    CLC,
+    CLD,
+    CMP,
+    CPX,
+    CPY,
+    DEC,
+    DEX,
+    DEY,
+    EOR,
+    INC,
+    INX,
+    INY,
+    JMP,
+    JSR,
+    LDA,
+    LDX,
+    LDY,
+    LSR,
+    ORA,
+    PHA,
+    PHP,
+    PLA,
+    PLP,
+    ROL,
+    ROR,
+    RTI,
+    RTS,
+    SBC,
+    SEC,
+    SEI,
+    STA,
+    STX,
+    STY,
+    TAX,
+    TAY,
+    TXA,
+    TXS,
+    TYA,
+};
+
+constexpr std::string_view mnemonic_name(mnemonic name) {
+    constexpr std::array<std::string_view, 51> names{
+        "???", "ADC", "AND", "ASL", "BCC", "BCS", "BEQ", "BIT", "BMI",
+        "BNE", "BPL", "BRK", "BVC", "CLC", "CLD", "CMP", "CPX", "CPY",
+        "DEC", "DEX", "DEY", "EOR", "INC", "INX", "INY", "JMP", "JSR",
+        "LDA", "LDX", "LDY", "LSR", "ORA", "PHA", "PHP", "PLA", "PLP",
+        "ROL", "ROR", "RTI", "RTS", "SBC", "SEC", "SEI", "STA", "STX",
+        "STY", "TAX", "TAY", "TXA", "TXS", "TYA"};
+    return names[static_cast<std::size_t>(name)];
+}
+
+// Number of operand bytes following the opcode.
+constexpr uint8_t operand_size(adr_mode mode) {
+    switch (mode) {
+    case adr_mode::implied:
+    case adr_mode::accumulator:
+        return 0;
+    case adr_mode::absolute:
+    case adr_mode::x_indexed_absolute:
+    case adr_mode::y_indexed_absolute:
+    case adr_mode::absolute_indirect:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+struct opcode {
+    mnemonic name{mnemonic::invalid};
+    adr_mode mode{adr_mode::implied};
+    // Cycles without page crossing or branch penalties.
+    uint8_t cycles{};
+    // Takes one more cycle when indexing crosses a page boundary.
+    bool page_penalty{};
+};
+
+// Decode information for all 256 opcodes. Opcodes that are not implemented
+// are left as mnemonic::invalid.
+constexpr std::array<opcode, 256> make_opcode_table() {
+    std::array<opcode, 256> table{};
+    auto const set = [&table](uint8_t code, mnemonic name, adr_mode mode,
+                              uint8_t cycles, bool page_penalty = false) {
+        table[code] = opcode{name, mode, cycles, page_penalty};
+    };
+    // Shared layout for the ALU instructions (ORA, AND, EOR, ADC, CMP, SBC)
+    // that support all eight addressing modes.
+    auto const set_alu = [&set](uint8_t base, mnemonic name) {
+        set(base + 0x01, name, adr_mode::x_indexed_zero_page_indirect, 6);
+        set(base + 0x05, name, adr_mode::zero_page, 3);
+        set(base + 0x09, name, adr_mode::immediate, 2);
+        set(base + 0x0D, name, adr_mode::absolute, 4);
+        set(base + 0x11, name, adr_mode::zero_page_indirect_y_indexed, 5,
+            true);
+        set(base + 0x15, name, adr_mode::x_indexed_zero_page, 4);
+        set(base + 0x19, name, adr_mode::y_indexed_absolute, 4, true);
+        set(base + 0x1D, name, adr_mode::x_indexed_absolute, 4, true);
+    };
+    // Shared layout for the shift and rotate instructions.
+    auto const set_shift = [&set](uint8_t base, mnemonic name) {
+        set(base + 0x06, name, adr_mode::zero_page, 5);
+        set(base + 0x0A, name, adr_mode::accumulator, 2);
+        set(base + 0x0E, name, adr_mode::absolute, 6);
+        set(base + 0x16, name, adr_mode::x_indexed_zero_page, 6);
+        set(base + 0x1E, name, adr_mode::x_indexed_absolute, 7);
+    };
+
+    set_alu(0x00, mnemonic::ORA);
+    set_alu(0x20, mnemonic::AND);
+    set_alu(0x40, mnemonic::EOR);
+    set_alu(0x60, mnemonic::ADC);
+    set_alu(0xC0, mnemonic::CMP);
+    set_alu(0xE0, mnemonic::SBC);
+    set_alu(0xA0, mnemonic::LDA);
+
+    set_shift(0x00, mnemonic::ASL);
+    set_shift(0x20, mnemonic::ROL);
+    set_shift(0x40, mnemonic::LSR);
+    set_shift(0x60, mnemonic::ROR);
+
+    set(0x81, mnemonic::STA, adr_mode::x_indexed_zero_page_indirect, 6);
+    set(0x85, mnemonic::STA, adr_mode::zero_page, 3);
+    set(0x8D, mnemonic::STA, adr_mode::absolute, 4);
+    set(0x91, mnemonic::STA, adr_mode::zero_page_indirect_y_indexed, 6);
+    set(0x95, mnemonic::STA, adr_mode::x_indexed_zero_page, 4);
+    set(0x99, mnemonic::STA, adr_mode::y_indexed_absolute, 5);
+    set(0x9D, mnemonic::STA, adr_mode::x_indexed_absolute, 5);
+
+    set(0x86, mnemonic::STX, adr_mode::zero_page, 3);
+    set(0x8E, mnemonic::STX, adr_mode::absolute, 4);
+    set(0x96, mnemonic::STX, adr_mode::y_indexed_zero_page, 4);
+
+    set(0x84, mnemonic::STY, adr_mode::zero_page, 3);
+    set(0x8C, mnemonic::STY, adr_mode::absolute, 4);
+    set(0x94, mnemonic::STY, adr_mode::x_indexed_zero_page, 4);
+
+    set(0xA2, mnemonic::LDX, adr_mode::immediate, 2);
+    set(0xA6, mnemonic::LDX, adr_mode::zero_page, 3);
+    set(0xAE, mnemonic::LDX, adr_mode::absolute, 4);
+    set(0xB6, mnemonic::LDX, adr_mode::y_indexed_zero_page, 4);
+    set(0xBE, mnemonic::LDX, adr_mode::y_indexed_absolute, 4, true);
+
+    set(0xA0, mnemonic::LDY, adr_mode::immediate, 2);
+    set(0xA4, mnemonic::LDY, adr_mode::zero_page, 3);
+    set(0xAC, mnemonic::LDY, adr_mode::absolute, 4);
+    set(0xB4, mnemonic::LDY, adr_mode::x_indexed_zero_page, 4);
+    set(0xBC, mnemonic::LDY, adr_mode::x_indexed_absolute, 4, true);
+
+    set(0xE0, mnemonic::CPX, adr_mode::immediate, 2);
+    set(0xE4, mnemonic::CPX, adr_mode::zero_page, 3);
+    set(0xEC, mnemonic::CPX, adr_mode::absolute, 4);
+
+    set(0xC0, mnemonic::CPY, adr_mode::immediate, 2);
+    set(0xC4, mnemonic::CPY, adr_mode::zero_page, 3);
+    set(0xCC, mnemonic::CPY, adr_mode::absolute, 4);
+
+    set(0x24, mnemonic::BIT, adr_mode::zero_page, 3);
+    set(0x2C, mnemonic::BIT, adr_mode::absolute, 4);
+
+    set(0xC6, mnemonic::DEC, adr_mode::zero_page, 5);
+    set(0xCE, mnemonic::DEC, adr_mode::absolute, 6);
+    set(0xD6, mnemonic::DEC, adr_mode::x_indexed_zero_page, 6);
+    set(0xDE, mnemonic::DEC, adr_mode::x_indexed_absolute, 7);
+
+    set(0xE6, mnemonic::INC, adr_mode::zero_page, 5);
+    set(0xEE, mnemonic::INC, adr_mode::absolute, 6);
+    set(0xF6, mnemonic::INC, adr_mode::x_indexed_zero_page, 6);
+    set(0xFE, mnemonic::INC, adr_mode::x_indexed_absolute, 7);
+
+    set(0x10, mnemonic::BPL, adr_mode::relative, 2);
+    set(0x30, mnemonic::BMI, adr_mode::relative, 2);
+    set(0x50, mnemonic::BVC, adr_mode::relative, 2);
+    set(0x90, mnemonic::BCC, adr_mode::relative, 2);
+    set(0xB0, mnemonic::BCS, adr_mode::relative, 2);
+    set(0xD0, mnemonic::BNE, adr_mode::relative, 2);
+    set(0xF0, mnemonic::BEQ, adr_mode::relative, 2);
+
+    set(0x20, mnemonic::JSR, adr_mode::absolute, 6);
+    set(0x4C, mnemonic::JMP, adr_mode::absolute, 3);
+    set(0x6C, mnemonic::JMP, adr_mode::absolute_indirect, 5);
+    set(0x40, mnemonic::RTI, adr_mode::implied, 6);
+    set(0x60, mnemonic::RTS, adr_mode::implied, 6);
+    set(0x00, mnemonic::BRK, adr_mode::implied, 7);
+
+    set(0x08, mnemonic::PHP, adr_mode::implied, 3);
+    set(0x28, mnemonic::PLP, adr_mode::implied, 4);
+    set(0x48, mnemonic::PHA, adr_mode::implied, 3);
+    set(0x68, mnemonic::PLA, adr_mode::implied, 4);
+
+    set(0x18, mnemonic::CLC, adr_mode::implied, 2);
+    set(0x38, mnemonic::SEC, adr_mode::implied, 2);
+    set(0x78, mnemonic::SEI, adr_mode::implied, 2);
+    set(0xD8, mnemonic::CLD, adr_mode::implied, 2);
+
+    set(0x88, mnemonic::DEY, adr_mode::implied, 2);
+    set(0x8A, mnemonic::TXA, adr_mode::implied, 2);
+    set(0x98, mnemonic::TYA, adr_mode::implied, 2);
+    set(0x9A, mnemonic::TXS, adr_mode::implied, 2);
+    set(0xA8, mnemonic::TAY, adr_mode::implied, 2);
+    set(0xAA, mnemonic::TAX, adr_mode::implied, 2);
+    set(0xC8, mnemonic::INY, adr_mode::implied, 2);
+    set(0xCA, mnemonic::DEX, adr_mode::implied, 2);
+    set(0xE8, mnemonic::INX, adr_mode::implied, 2);
+    return table;
+}
+
+inline constexpr std::array<opcode, 256> opcode_table = make_opcode_table();
+
+constexpr bool is_branch(mnemonic name) {
+    switch (name) {
+    case mnemonic::BCC:
+    case mnemonic::BCS:
+    case mnemonic::BEQ:
+    case mnemonic::BMI:
+    case mnemonic::BNE:
+    case mnemonic::BPL:
+    case mnemonic::BVC:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Longest loop considered for idle loop skipping.
+inline constexpr std::size_t max_idle_loop_size = 4;
+
+// Can the instruction be part of an idle loop? It may only change registers
+// and read NES memory where repeated reads return the same value: RAM, ROM,
+// PPUSTATUS and APU status. Indexed reads are left out since their address
+// can change between iterations.
+constexpr bool polls_memory(uint8_t opcode, uint8_t low, uint8_t high) {
+    auto const &entry = opcode_table[opcode];
+    switch (entry.name) {
+    case mnemonic::AND:
+    case mnemonic::BIT:
+    case mnemonic::CMP:
+    case mnemonic::CPX:
+    case mnemonic::CPY:
+    case mnemonic::EOR:
+    case mnemonic::LDA:
+    case mnemonic::LDX:
+    case mnemonic::LDY:
+    case mnemonic::ORA:
+    case mnemonic::TAX:
+    case mnemonic::TAY:
+    case mnemonic::TXA:
+    case mnemonic::TYA:
+        break;
+    default:
+        return false;
+    }
+    uint16_t const adr = low | (high << 8);
+    switch (entry.mode) {
+    case adr_mode::implied:
+    case adr_mode::immediate:
+    case adr_mode::zero_page:
+        return true;
+    case adr_mode::absolute:
+        return adr < 0x2000 || (adr < 0x4000 && adr % 8 == 2) ||
+               adr == 0x4015 || adr >= 0x8000;
+    default:
+        return false;
+    }
+}
@@ -33,3 +33,18 @@ inline constexpr std::array<rgb, 64> palette{
      {0xc8, 0xe3, 0x9e}, {0xbf, 0xe5, 0xb8}, {0xb2, 0xeb, 0xc8},
      {0xb7, 0xe5, 0xeb}, {0xac, 0xac, 0xac}, {0x00, 0x00, 0x00},
      {0x00, 0x00, 0x00}}};
+
+// Host ARGB8888 of colour, with the greyscale and colour emphasis bits of
+// PPUMASK applied. Emphasis darkens the other two channels.
+constexpr uint32_t to_argb(uint8_t colour, uint8_t mask) {
+    auto const c = palette[colour & (mask & 0x01 ? 0x30 : 0x3F)];
+    auto const channel = [mask](uint32_t val, uint8_t own) {
+        for (uint8_t bit{0x20}; bit != 0; bit <<= 1) {
+            if (mask & bit & ~own)
+                val = val * 13 / 16;
+        }
+        return val;
+    };
+    return 0xFF000000 | channel(c.red, 0x20) << 16 |
+           channel(c.green, 0x40) << 8 | channel(c.blue, 0x80);
+}
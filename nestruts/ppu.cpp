@@ -1,16 +1,112 @@
 #include "ppu.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
+#include <utility>
 
+#include "compositor.h"
 #include "log.h"
 #include "palette.h"
 
-picture_processing_unit::picture_processing_unit() = default;
+namespace {
+constexpr uint64_t low_bits{0x0101010101010101};
+// 0xFF in the bytes of non-zero pixels of a tile row.
+constexpr uint64_t opaque_mask(uint64_t row) {
+    return ((row | row >> 1) & low_bits) * 0xFF;
+}
+} // namespace
+
+picture_processing_unit::picture_processing_unit(
+    std::shared_ptr<event_scheduler> events, std::shared_ptr<video_sink> video)
+    : events{std::move(events)}, video{std::move(video)} {
+    this->events->set_handler(event::vblank, [this](uint64_t) {
+        // Finish the frame and start the next.
+        catch_up();
+        last_stats = std::exchange(stats, {});
+        render_line = 0;
+        render_x = 0;
+        prerender_done = false;
+        vblank();
+        this->events->schedule(event::vblank, frame_end_cycle(++frame));
+        schedule_prerender();
+        schedule_sprite_zero();
+    });
+    this->events->set_handler(event::prerender,
+                              [this](uint64_t) { catch_up(); });
+    this->events->set_handler(event::sprite_zero, [this](uint64_t) {
+        catch_up();
+        if (!sprite_zero_hit)
+            find_sprite_zero_hit();
+    });
+    this->events->schedule(event::vblank, frame_end_cycle(frame));
+    schedule_prerender();
+    static constexpr std::array<uint8_t, 0x0400> blank{};
+    for (uint16_t adr{0}; adr < 0x2000; adr += blank.size()) {
+        map_chr(adr, blank.data(), blank.size());
+    }
+    set_mirroring(mirroring::vertical);
+    dirty_tiles.set();
+    update_palette_argb();
+}
+
+void picture_processing_unit::map_chr(uint16_t adr, uint8_t const *data,
+                                      uint16_t size) {
+    catch_up();
+    for (std::size_t offs{0}; offs < size; offs += 0x400) {
+        auto const bank = (adr + offs) >> 10;
+        if (chr_banks[bank] != data + offs)
+            chr_bank_changed(bank);
+        chr_banks[bank] = data + offs;
+        chr_ram_banks[bank] = nullptr;
+    }
+    schedule_sprite_zero();
+}
+
+void picture_processing_unit::map_chr_ram(uint16_t adr, uint8_t *data,
+                                          uint16_t size) {
+    catch_up();
+    for (std::size_t offs{0}; offs < size; offs += 0x400) {
+        auto const bank = (adr + offs) >> 10;
+        if (chr_banks[bank] != data + offs)
+            chr_bank_changed(bank);
+        chr_banks[bank] = data + offs;
+        chr_ram_banks[bank] = data + offs;
+    }
+    schedule_sprite_zero();
+}
 
-void picture_processing_unit::load_rom(uint16_t adr, uint8_t val) {
-    rom.at(adr) = val;
+void picture_processing_unit::chr_bank_changed(std::size_t bank) {
+    tiles.invalidate_bank(bank << 10);
+    for (std::size_t i{bank << 6}; i < (bank + 1) << 6; ++i) {
+        dirty_patterns.set(i);
+    }
+    background_dirty = true;
+    picture_changed();
+}
+
+void picture_processing_unit::set_mirroring(mirroring m) {
+    catch_up();
+    auto const previous = nametables;
+    switch (m) {
+    case mirroring::horizontal:
+        nametables = {0x0000, 0x0000, 0x0400, 0x0400};
+        break;
+    case mirroring::vertical:
+        nametables = {0x0000, 0x0400, 0x0000, 0x0400};
+        break;
+    case mirroring::single_screen_low:
+        nametables = {0x0000, 0x0000, 0x0000, 0x0000};
+        break;
+    case mirroring::single_screen_high:
+        nametables = {0x0400, 0x0400, 0x0400, 0x0400};
+        break;
+    }
+    if (nametables != previous)
+        picture_changed();
+    schedule_sprite_zero();
 }
 
 void picture_processing_unit::draw_tiles(uint16_t base_tile_index, int base_x,
@@ -24,40 +120,31 @@ void picture_processing_unit::draw_tiles(uint16_t base_tile_index, int base_x,
     }
 }
 
-rgb picture_processing_unit::palette_color(bool sprite, int palette_number,
-                                           int val) {
-    std::size_t index{0};
-    if (sprite)
-        index |= (1 << 4);
-    index |= palette_number << 2;
-    index |= val;
-    log(log_level::trace, "sprite: {}, palette_number:, val: {}, index: {}\n",
-        sprite, palette_number, val, index);
-    return palette[palette_data[index]];
+uint32_t picture_processing_unit::palette_color(bool sprite,
+                                                int palette_number,
+                                                int val) const {
+    return palette_argb[(sprite ? 0x10 : 0x00) | palette_number << 2 | val];
 }
 
 void picture_processing_unit::draw_tile(int base_x, int base_y,
                                         uint16_t tile_index, int palette_number,
                                         bool flip_x, bool flip_y, bool sprite) {
-    auto const offset = tile_index * 16;
     auto const flip_func = [](auto const flip, auto const x) {
         if (flip)
             return 7 - x;
         return x;
     };
+    auto const &t = tiles.get(tile_index);
     for (auto y = 0; y < 8; y++) {
-        // Two bit planes for the tile
-        uint8_t low_bits = rom.at(offset + y);
-        uint8_t high_bits = rom.at(offset + y + 8);
+        auto row = t.rows[y];
         for (auto x = 0; x < 8; x++) {
-            // Take out one high and one low bit from the left.
-            auto const val = (low_bits >> 7) + (high_bits >> 7) * 2;
-            low_bits <<= 1;
-            high_bits <<= 1;
+            // Pixels from the left.
+            auto const val = static_cast<int>(row & 0x03);
+            row >>= 8;
             if (val != 0x00) {
-                gfx.draw_pixel(flip_func(flip_x, x) + base_x,
-                               flip_func(flip_y, y) + base_y,
-                               palette_color(sprite, palette_number, val));
+                draw_pixel(flip_func(flip_x, x) + base_x,
+                           flip_func(flip_y, y) + base_y,
+                           palette_color(sprite, palette_number, val));
             }
         }
     }
@@ -66,7 +153,7 @@ void picture_processing_unit::draw_tile(int base_x, int base_y,
 void picture_processing_unit::draw_nametable(int index, int base_x) {
     constexpr auto num_rows = 30;
     constexpr auto num_tiles = 32;
-    auto const base_address = index * 0x400;
+    auto const base_address = nametables[index];
     // Draw nametable zero
     for (auto row = 0; row < num_rows; ++row) {
         for (auto tile = 0; tile < num_tiles; ++tile) {
@@ -103,9 +190,14 @@ void picture_processing_unit::draw_sprites(int base_x) {
     }
 }
 
+void picture_processing_unit::draw_pixel(int x, int y, uint32_t argb) {
+    if (x < debug_width && y < debug_height)
+        debug_pixels[y * debug_width + x] = argb;
+}
+
 void picture_processing_unit::draw_debug() {
     constexpr auto num_tiles = 32;
-    gfx.clear();
+    debug_pixels.assign(debug_width * debug_height, 0xFF000000);
     // Draw left
     draw_tiles(0, 0, 0);
     // Draw right
@@ -120,19 +212,267 @@ void picture_processing_unit::draw_debug() {
     draw_nametable(0, base_x);
     // Right of nametable one
     draw_sprites(base_x);
-    gfx.flip();
+    video->present(debug_pixels, debug_width);
+}
+
+void picture_processing_unit::render_frame() {
+    for (int line{0}; line < screen_height; ++line) {
+        render_scanline(line);
+    }
+}
+
+void picture_processing_unit::nametable_written(uint16_t offset) {
+    int const table = offset >> 10;
+    int const index = offset & 0x03FF;
+    background_dirty = true;
+    if (index < tiles_per_nametable) {
+        dirty_tiles.set(table * tiles_per_nametable + index);
+        return;
+    }
+    // An attribute byte covers 4 x 4 tiles, the last row only the top half.
+    int const top = (index - 0x03C0) / 8 * 4;
+    int const left = (index - 0x03C0) % 8 * 4;
+    for (int row{top}; row < std::min(top + 4, 30); ++row) {
+        for (int column{left}; column < left + 4; ++column) {
+            dirty_tiles.set(table * tiles_per_nametable + row * 32 + column);
+        }
+    }
+}
+
+void picture_processing_unit::update_background_plane() {
+    if (!background_dirty)
+        return;
+    background_dirty = false;
+    auto const changed = ++stamp;
+    uint16_t const pattern_table = PPUCTRL & 0x10 ? 0x100 : 0x000;
+    // Changed patterns are found in the nametables only now, most CHR
+    // writes and bank switches happen with rendering off.
+    if (dirty_patterns.any()) {
+        for (int i{0}; i < 2 * tiles_per_nametable; ++i) {
+            int const table = i / tiles_per_nametable;
+            int const index = i % tiles_per_nametable;
+            if (dirty_patterns[pattern_table + ram[table * 0x0400 + index]])
+                dirty_tiles.set(i);
+        }
+        dirty_patterns.reset();
+    }
+    for (int i{0}; i < 2 * tiles_per_nametable; ++i) {
+        if (!dirty_tiles[i])
+            continue;
+        int const table = i / tiles_per_nametable;
+        int const row = i % tiles_per_nametable / 32;
+        int const column = i % 32;
+        auto const attribute =
+            ram[table * 0x0400 + 0x03C0 + row / 4 * 8 + column / 4];
+        // Two bits per 2 x 2 tiles, see draw_nametable.
+        int const shift = (row & 0x02) * 2 + (column & 0x02);
+        uint8_t const palette = ((attribute >> shift) & 0x03) << 2;
+        auto const &t =
+            tiles.get(pattern_table + ram[table * 0x0400 + row * 32 + column]);
+        auto *const out = background_plane.data() +
+                          (table * screen_height + row * 8) * screen_width +
+                          column * 8;
+        for (int y{0}; y < 8; ++y) {
+            uint64_t const line_pixels =
+                t.rows[y] | (opaque_mask(t.rows[y]) & palette * low_bits);
+            std::memcpy(out + y * screen_width, &line_pixels, 8);
+        }
+        std::fill_n(plane_rows_changed.begin() + table * screen_height + row * 8,
+                    8, changed);
+        ++stats.tiles_redrawn;
+    }
+    dirty_tiles.reset();
+}
+
+uint64_t picture_processing_unit::line_changed(int line) const {
+    int const y = line + PPUSCROLL_Y;
+    int const base_table = (PPUCTRL & 0x03) ^ (y / screen_height % 2 * 2);
+    int const row = y % screen_height;
+    return std::max({state_changed,
+                     plane_rows_changed[(nametables[base_table] >> 10) *
+                                            screen_height +
+                                        row],
+                     plane_rows_changed[(nametables[base_table ^ 1] >> 10) *
+                                            screen_height +
+                                        row]});
+}
+
+void picture_processing_unit::render_background(int line,
+                                                background_line &out) const {
+    if (!(PPUMASK & 0x08))
+        return;
+    // Scrolling past the bottom continues in the nametable below.
+    int const y = line + PPUSCROLL_Y;
+    int const base_table = (PPUCTRL & 0x03) ^ (y / screen_height % 2 * 2);
+    int const row = y % screen_height;
+    auto const plane_row = [&](int table) {
+        return background_plane.data() +
+               ((nametables[table] >> 10) * screen_height + row) * screen_width;
+    };
+    // From the coarse x scroll to the right edge, then on into the nametable
+    // to the right.
+    int const x = PPUSCROLL_X & 0xF8;
+    std::memcpy(out.data(), plane_row(base_table) + x, screen_width - x);
+    std::memcpy(out.data() + screen_width - x, plane_row(base_table ^ 1),
+                x + 8);
+}
+
+void picture_processing_unit::render_sprites(int line,
+                                             sprite_line &out) const {
+    if (!(PPUMASK & 0x10))
+        return;
+    int const height = PPUCTRL & 0x20 ? 16 : 8;
+    // Only the first 8 sprites on the line are drawn.
+    std::array<std::size_t, 8> selected{};
+    std::size_t count{0};
+    for (std::size_t i{0}; i < oam.size() / 4 && count < selected.size();
+         ++i) {
+        // Sprites are offset by one in y.
+        int const row = line - (oam[i * 4] + 1);
+        if (row >= 0 && row < height)
+            selected[count++] = i;
+    }
+    // Drawn last to first so earlier sprites end up on top.
+    while (count > 0) {
+        auto const index = selected[--count];
+        auto const *const sprite = &oam[index * 4];
+        auto const tile_index = sprite[1];
+        auto const attributes = sprite[2];
+        int row = line - (sprite[0] + 1);
+        if (attributes & 0x80)
+            row = height - 1 - row;
+        uint16_t pattern{};
+        if (height == 16) {
+            pattern = (tile_index & 0x01) * 0x1000 +
+                      (tile_index & 0xFE) * 16 + (row & 0x08) * 2 + row % 8;
+        } else {
+            pattern =
+                (PPUCTRL & 0x08 ? 0x1000 : 0x0000) + tile_index * 16 + row;
+        }
+        auto const &t = tiles.get(pattern >> 4);
+        auto const row_pixels =
+            (attributes & 0x40 ? t.flipped_rows : t.rows)[pattern % 8];
+        uint8_t const palette = 0x10 | (attributes & 0x03) << 2 |
+                                (index == 0 ? 0x40 : 0x00) |
+                                (attributes & 0x20 ? 0x80 : 0x00);
+        // Pixels past the right edge land in the padding.
+        auto const opaque = opaque_mask(row_pixels);
+        uint64_t line_pixels{};
+        std::memcpy(&line_pixels, out.data() + sprite[3], 8);
+        line_pixels = (line_pixels & ~opaque) |
+                      (row_pixels | (opaque & palette * low_bits));
+        std::memcpy(out.data() + sprite[3], &line_pixels, 8);
+    }
+}
+
+int picture_processing_unit::compose_scanline(int line, index_line &out,
+                                              int begin, int end) const {
+    background_line background{};
+    sprite_line sprites{};
+    render_background(line, background);
+    render_sprites(line, sprites);
+    scanline_layers const layers{background.data() + (PPUSCROLL_X & 0x07),
+                                 sprites.data(),
+                                 static_cast<bool>(PPUMASK & 0x02),
+                                 static_cast<bool>(PPUMASK & 0x04)};
+    return composite_line(layers, out.data(), begin, end);
+}
+
+void picture_processing_unit::render_scanline(int line, int begin, int end) {
+    update_background_plane();
+    bool const whole = begin == 0 && end == screen_width;
+    if (whole && line_rendered[line] > line_changed(line)) {
+        if (line_hits[line] >= 0)
+            sprite_zero_hit = true;
+        return;
+    }
+    index_line indices{};
+    int const hit = compose_scanline(line, indices, begin, end);
+    if (hit >= 0)
+        sprite_zero_hit = true;
+    auto *const out = pixels.data() + line * screen_width;
+    auto *const argb_out = argb_pixels.data() + line * screen_width;
+    uint8_t const colour_mask = PPUMASK & 0x01 ? 0x30 : 0x3F;
+    for (int x{begin}; x < end; ++x) {
+        out[x] = palette_data[indices[x]] & colour_mask;
+        argb_out[x] = palette_argb[indices[x]];
+    }
+    line_emphasis[line] = PPUMASK >> 5;
+    line_rendered[line] = whole ? ++stamp : 0;
+    line_hits[line] = static_cast<int16_t>(hit);
+    ++stats.lines_rendered;
+}
+
+void picture_processing_unit::catch_up() {
+    auto const dot = 3 * static_cast<int64_t>(events->now() - frame_start());
+    if (!prerender_done && dot > prerender_dot) {
+        vblank_started = false;
+        sprite_zero_hit = false;
+        prerender_done = true;
+    }
+    while (render_line < screen_height) {
+        auto const end = std::min<int64_t>(dot - pixel_dot(render_line, 0),
+                                           screen_width);
+        if (end <= render_x)
+            return;
+        render_scanline(render_line, render_x, static_cast<int>(end));
+        if (end < screen_width) {
+            render_x = static_cast<int>(end);
+            return;
+        }
+        ++render_line;
+        render_x = 0;
+    }
+}
+
+void picture_processing_unit::schedule_prerender() {
+    // The first cycle catch_up sees past prerender_dot.
+    events->schedule(event::prerender, frame_start() + prerender_dot / 3 + 1);
+}
+
+void picture_processing_unit::schedule_sprite_zero() {
+    int const top = oam[0] + 1;
+    int const bottom = top + (PPUCTRL & 0x20 ? 16 : 8);
+    if (top >= screen_height || (prerender_done && sprite_zero_hit) ||
+        render_line >= bottom) {
+        events->cancel(event::sprite_zero);
+        return;
+    }
+    // A pixel is rendered once the dot is past it.
+    auto const dot = pixel_dot(std::max(top, render_line), oam[3]) + 1;
+    events->schedule(event::sprite_zero,
+                     std::max(events->now(), frame_start() + (dot + 2) / 3));
+}
+
+void picture_processing_unit::find_sprite_zero_hit() {
+    update_background_plane();
+    int const top = oam[0] + 1;
+    int const bottom = std::min(top + (PPUCTRL & 0x20 ? 16 : 8), screen_height);
+    for (int line{std::max(top, render_line)}; line < bottom; ++line) {
+        index_line indices{};
+        int const x = compose_scanline(
+            line, indices, line == render_line ? render_x : 0, screen_width);
+        if (x >= 0) {
+            auto const dot = pixel_dot(line, x) + 1;
+            events->schedule(event::sprite_zero,
+                             frame_start() + (dot + 2) / 3);
+            return;
+        }
+    }
 }
 
 void picture_processing_unit::draw() {
-    gfx.clear();
-    draw_nametable(0, 0);
-    draw_sprites(0);
-    gfx.flip();
+    catch_up();
+    if (video->wants_colours())
+        video->present_colours(pixels, line_emphasis, screen_width);
+    else
+        video->present(argb_pixels, screen_width);
 }
 
 uint8_t picture_processing_unit::read_PPUSTATUS() {
     logf(log_level::debug, "\tread PPUSTATUS");
-    auto PPUSTATUS = vblank_started << 7;
+    catch_up();
+    auto PPUSTATUS = vblank_started << 7 | sprite_zero_hit << 6;
     PPUSCROLL_latch = false;
     PPUADDR_latch = false;
     vblank_started = false;
@@ -141,12 +481,27 @@ uint8_t picture_processing_unit::read_PPUSTATUS() {
 
 void picture_processing_unit::set_PPUCTRL(uint8_t val) {
     logf(log_level::debug, "\twrite PPUCTRL %#04x", val);
+    catch_up();
+    if ((PPUCTRL ^ val) & 0x10) {
+        dirty_tiles.set();
+        background_dirty = true;
+    }
+    if (PPUCTRL != val)
+        picture_changed();
     PPUCTRL = val;
+    schedule_sprite_zero();
 }
 
 void picture_processing_unit::set_PPUMASK(uint8_t val) {
     logf(log_level::debug, "\twrite PPUMASK %#04x", val);
+    catch_up();
+    if (PPUMASK != val)
+        picture_changed();
+    bool const colours_changed = (PPUMASK ^ val) & 0xE1;
     PPUMASK = val;
+    if (colours_changed)
+        update_palette_argb();
+    schedule_sprite_zero();
 }
 
 void picture_processing_unit::set_OAMADDR(uint8_t val) {
@@ -156,15 +511,15 @@ void picture_processing_unit::set_OAMADDR(uint8_t val) {
 
 void picture_processing_unit::write_PPUSCROLL(uint8_t val) {
     logf(log_level::debug, "\twrite PPUSCROLL");
+    catch_up();
     // TODO: Determine if it goes back and forth between X and Y
     // or if it goes X, Y, Y, Y ...
-    if (!PPUSCROLL_latch) {
-        PPUSCROLL_X = val;
-        PPUSCROLL_latch = true;
-    } else {
-        PPUSCROLL_Y = val;
-        PPUSCROLL_latch = false;
-    }
+    auto &scroll = PPUSCROLL_latch ? PPUSCROLL_Y : PPUSCROLL_X;
+    if (scroll != val)
+        picture_changed();
+    scroll = val;
+    PPUSCROLL_latch = !PPUSCROLL_latch;
+    schedule_sprite_zero();
 }
 
 void picture_processing_unit::write_PPUADDR(uint8_t val) {
@@ -184,20 +539,29 @@ void picture_processing_unit::write_PPUADDR(uint8_t val) {
 }
 
 void picture_processing_unit::write_PPUDATA(uint8_t val) {
+    catch_up();
     if (PPUADDR < 0x2000) {
-        logf(log_level::debug, "\tTrying to write to PPU ROM");
-    } else if (PPUADDR < 0x3000) {
-        uint16_t mod_adr = PPUADDR - 0x2000;
-        // Outside of VRAM?
-        if (mod_adr > 0x07FF) {
-            // Mirror
-            mod_adr -= 0x0800;
+        if (auto *bank = chr_ram_banks[PPUADDR >> 10]) {
+            if (bank[PPUADDR & 0x3FF] != val) {
+                bank[PPUADDR & 0x3FF] = val;
+                tiles.invalidate(PPUADDR >> 4);
+                dirty_patterns.set(PPUADDR >> 4);
+                background_dirty = true;
+                picture_changed();
+            }
+        } else {
+            logf(log_level::debug, "\tTrying to write to PPU ROM");
         }
+    } else if (PPUADDR < 0x3000) {
         logf(log_level::debug, "\t PPUDATA(%#6x)=%#4x", PPUADDR, val);
-        ram[mod_adr] = val;
-    } else if (PPUADDR >= 0x3f00 && PPUADDR < 0x3f20) {
+        auto const offset = nametable_offset(PPUADDR);
+        if (ram[offset] != val) {
+            ram[offset] = val;
+            nametable_written(offset);
+        }
+    } else if (PPUADDR >= 0x3f00 && PPUADDR < 0x4000) {
         logf(log_level::debug, "\t PPUDATA(%#6x)=%#4x (palette)", PPUADDR, val);
-        palette_data[PPUADDR - 0x3f00] = val;
+        write_palette(PPUADDR & 0x1F, val & 0x3F);
         log(log_level::debug, "\npalette updated:\n\t");
         for (auto const d : palette_data) {
             log(log_level::debug, "{:02x}", d);
@@ -212,23 +576,70 @@ void picture_processing_unit::write_PPUDATA(uint8_t val) {
     } else {
         PPUADDR += 1;
     }
+    schedule_sprite_zero();
+}
+
+void picture_processing_unit::write_palette(uint8_t index, uint8_t val) {
+    if (palette_data[index] == val)
+        return;
+    picture_changed();
+    // $3F10, $3F14, $3F18 and $3F1C are $3F00, $3F04, $3F08 and $3F0C.
+    for (auto const i : {index, static_cast<uint8_t>(index ^ 0x10)}) {
+        palette_data[i] = val;
+        palette_argb[i] = to_argb(val, PPUMASK);
+        if (index & 0x03)
+            break;
+    }
+}
+
+void picture_processing_unit::update_palette_argb() {
+    for (std::size_t i{0}; i < palette_data.size(); ++i) {
+        palette_argb[i] = to_argb(palette_data[i], PPUMASK);
+    }
+}
+
+void picture_processing_unit::write_PPUDATA(std::span<uint8_t const> data) {
+    catch_up();
+    // Copy straight into a nametable when the whole run lands in one.
+    std::size_t const offset = PPUADDR - 0x2000;
+    if (!(PPUCTRL & 0x04) && PPUADDR >= 0x2000 && PPUADDR < 0x3000 &&
+        offset / 0x0400 == (offset + data.size() - 1) / 0x0400) {
+        logf(log_level::debug, "\t PPUDATA(%#6x..)=%zu bytes", PPUADDR,
+             data.size());
+        auto const first = nametable_offset(PPUADDR);
+        for (std::size_t i{0}; i < data.size(); ++i) {
+            if (ram[first + i] != data[i]) {
+                ram[first + i] = data[i];
+                nametable_written(static_cast<uint16_t>(first + i));
+            }
+        }
+        PPUADDR += data.size();
+        schedule_sprite_zero();
+        return;
+    }
+    for (auto const val : data) {
+        write_PPUDATA(val);
+    }
 }
 
 void picture_processing_unit::dma_copy(std::span<uint8_t const, 0x100> data) {
+    catch_up();
+    if (!std::equal(data.begin(), data.end(), oam.begin()))
+        picture_changed();
     std::copy(
         std::begin(data),
         std::end(data),
         std::begin(oam));
+    schedule_sprite_zero();
 }
 
-bool picture_processing_unit::vblank() {
+void picture_processing_unit::vblank() {
     log(log_level::debug, "vblank\n");
     vblank_started = true;
     if (PPUCTRL & 0x80) {
-        // Should trigger nmi
         log(log_level::debug, "nmi triggered\n");
-        return true;
+        events->trigger_nmi();
+        return;
     }
     log(log_level::debug, "nmi suppressed\n");
-    return false;
 }
@@ -1,14 +1,53 @@
 #pragma once
 #include <array>
+#include <bitset>
 #include <cstdint>
+#include <memory>
 #include <span>
+#include <vector>
 
-#include "gfx.h"
+#include "scheduler.h"
+#include "tile_cache.h"
+#include "video_sink.h"
 
+// NTSC runs 29780.5 CPU cycles per frame. Counted in half cycles so the frame
+// boundaries do not drift.
+constexpr uint64_t half_cycles_per_frame{59561};
+constexpr uint64_t frame_end_cycle(int64_t frame) {
+    return frame * half_cycles_per_frame / 2;
+}
+
+// Which nametables share the 2 K of PPU RAM.
+enum class mirroring : uint8_t {
+    horizontal,
+    vertical,
+    single_screen_low,
+    single_screen_high,
+};
+
+// Renders lazily: the PPU stays idle while the CPU runs and catches up to
+// the current dot of the frame in bulk when its registers, OAM, CHR banks or
+// mirroring are about to change, when PPUSTATUS is read and when vblank or
+// sprite 0 hit comes due. Frames the CPU does not touch mid-frame are
+// rendered at once at vblank.
 class picture_processing_unit {
   public:
-    picture_processing_unit();
-    void load_rom(uint16_t adr, uint8_t val);
+    static constexpr int screen_width{256};
+    static constexpr int screen_height{240};
+    static constexpr int64_t dots_per_line{341};
+
+    // Posts vblank at the end of every frame. Frames are presented to video,
+    // the default drops them.
+    explicit picture_processing_unit(
+        std::shared_ptr<event_scheduler> events,
+        std::shared_ptr<video_sink> video = std::make_shared<null_video_sink>());
+    // Bank switching for mappers, points the size bytes of pattern table at
+    // adr to data without copying. Whole 1 K banks. The pattern tables are
+    // blank until a mapper maps its banks.
+    void map_chr(uint16_t adr, uint8_t const *data, uint16_t size);
+    // Same for CHR RAM, which is writable through PPUDATA.
+    void map_chr_ram(uint16_t adr, uint8_t *data, uint16_t size);
+    void set_mirroring(mirroring m);
 
     uint8_t read_PPUSTATUS();
 
@@ -18,16 +57,102 @@ class picture_processing_unit {
     void write_PPUSCROLL(uint8_t val);
     void write_PPUADDR(uint8_t val);
     void write_PPUDATA(uint8_t val);
+    // Same as writing each byte in turn.
+    void write_PPUDATA(std::span<uint8_t const> data);
 
     void dma_copy(std::span<uint8_t const, 0x100> data);
 
-    // Set vblank status and return if NMI should fire.
-    bool vblank();
+    // Render the whole frame with the current state, one scanline at a
+    // time, regardless of timing.
+    void render_frame();
+    // Colours of the frame, indices into palette. Complete from vblank until
+    // the first visible line of the next frame.
+    std::span<uint8_t const> frame_buffer() const { return pixels; }
+    // The same frame in ARGB, with greyscale and colour emphasis.
+    std::span<uint32_t const> argb_frame_buffer() const { return argb_pixels; }
 
+    // Catch up and present the frame.
     void draw();
+    // Present pattern tables, nametables and sprites instead.
     void draw_debug();
 
+    struct render_stats {
+        // Background tiles drawn into the cached nametables.
+        int tiles_redrawn{};
+        // Lines composed, the others were unchanged since the last frame.
+        int lines_rendered{};
+    };
+    // Of the last complete frame.
+    render_stats const &last_frame_stats() const { return last_stats; }
+
   private:
+    std::shared_ptr<event_scheduler> const events{};
+    int64_t frame{1};
+    // Set vblank status and trigger NMI if enabled.
+    void vblank();
+
+    std::array<uint8_t, screen_width * screen_height> pixels{};
+    std::array<uint32_t, screen_width * screen_height> argb_pixels{};
+    // Emphasis bits of PPUMASK each line was rendered with, for sinks that
+    // take colours.
+    std::array<uint8_t, screen_height> line_emphasis{};
+    render_stats stats{};
+    render_stats last_stats{};
+    // Stamps from one counter for when the state the picture depends on
+    // last changed, when rows of the background plane were last redrawn and
+    // when lines were last rendered whole. Lines rendered after everything
+    // they show last changed are left as they are, with the x of their
+    // sprite 0 hit or -1.
+    uint64_t stamp{1};
+    uint64_t state_changed{1};
+    std::array<uint64_t, 2 * screen_height> plane_rows_changed{};
+    std::array<uint64_t, screen_height> line_rendered{};
+    std::array<int16_t, screen_height> line_hits{};
+    void picture_changed() { state_changed = ++stamp; }
+    uint64_t line_changed(int line) const;
+    // Background, then sprites with the first 8 on the line in OAM order,
+    // composed with scroll applied for the pixels in [begin, end).
+    void render_scanline(int line, int begin = 0, int end = screen_width);
+    // Layers of a line as composed by composite_line. The background starts
+    // fine x scroll pixels before the screen, sprites may draw past its
+    // right edge.
+    using background_line = std::array<uint8_t, screen_width + 8>;
+    using sprite_line = std::array<uint8_t, screen_width + 8>;
+    using index_line = std::array<uint8_t, screen_width>;
+    // Copied from the background plane, which needs to be up to date.
+    void render_background(int line, background_line &out) const;
+    void render_sprites(int line, sprite_line &out) const;
+    // Composes the pixels in [begin, end) of line into palette RAM indices,
+    // returns the x of the first sprite 0 hit or -1.
+    int compose_scanline(int line, index_line &out, int begin, int end) const;
+
+    // Dots are counted from the start of vblank, visible line 0 starts 21
+    // lines later.
+    static constexpr int64_t prerender_dot{20 * dots_per_line};
+    static constexpr int64_t pixel_dot(int line, int x) {
+        return (21 + line) * dots_per_line + x;
+    }
+    uint64_t frame_start() const { return frame_end_cycle(frame - 1); }
+    // Pixels are rendered up to, but not including, render_x of
+    // render_line.
+    int render_line{0};
+    int render_x{0};
+    bool prerender_done{};
+    // Posts prerender for the current frame.
+    void schedule_prerender();
+    // Render everything before the current dot.
+    void catch_up();
+    bool sprite_zero_hit{};
+    // Schedules sprite_zero for the first pixel sprite 0 can hit at, the
+    // handler then finds the exact pixel for the state at that time.
+    void schedule_sprite_zero();
+    void find_sprite_zero_hit();
+
+    // The debug view, drawn by draw_debug.
+    static constexpr int debug_width{17 * 9 + 2 * 32 * 8 + 9};
+    static constexpr int debug_height{2 * 17 * 9};
+    std::vector<uint32_t> debug_pixels{};
+    void draw_pixel(int x, int y, uint32_t argb);
     void draw_tiles(uint16_t base_offset, int base_x, int base_y);
     void draw_tile(int base_x, int base_y, uint16_t tile_index,
                    int palette_number, bool flip_x = false, bool flip_y = false,
@@ -35,17 +160,42 @@ class picture_processing_unit {
     void draw_nametable(int index, int base_x);
     void draw_sprites(int base_x);
 
-    rgb palette_color(bool sprite, int palette_number, int val);
-    // 8 K of CHR ROM
-    std::array<uint8_t, 0x2000> rom{};
+    uint32_t palette_color(bool sprite, int palette_number, int val) const;
+    // Pattern tables in 1 K banks, writable ones are also in chr_ram_banks.
+    std::array<uint8_t const *, 8> chr_banks{};
+    std::array<uint8_t *, 8> chr_ram_banks{};
+    // Decoded chr_banks, filled while rendering.
+    mutable tile_cache tiles{chr_banks};
+    void chr_bank_changed(std::size_t bank);
     // 2 K of RAM
     std::array<uint8_t, 0x0800> ram{};
+    // Background of the two nametables in RAM, whole screens in the format
+    // of background_line, independent of scroll and palette colours. Tiles
+    // are redrawn when their nametable entry, attribute or pattern changed.
+    static constexpr int tiles_per_nametable{32 * 30};
+    std::array<uint8_t, 2 * screen_width * screen_height> background_plane{};
+    std::bitset<2 * tiles_per_nametable> dirty_tiles{};
+    std::bitset<tile_cache::tile_count> dirty_patterns{};
+    bool background_dirty{true};
+    // Marks what a write to ram at offset affects.
+    void nametable_written(uint16_t offset);
+    void update_background_plane();
+    // Offset into ram of each of the four nametables.
+    std::array<uint16_t, 4> nametables{};
+    uint16_t nametable_offset(uint16_t adr) const {
+        return nametables[(adr >> 10) & 0x03] + (adr & 0x03FF);
+    }
     // 256 B of OAM
     std::array<uint8_t, 0x0100> oam{};
-    // 32 B of palette data
+    // 32 B of palette data, entry 0 of each sprite palette mirrors the one
+    // of the background palette.
     std::array<uint8_t, 0x0020> palette_data{};
+    // palette_data in ARGB for the current PPUMASK.
+    std::array<uint32_t, 0x0020> palette_argb{};
+    void write_palette(uint8_t index, uint8_t val);
+    void update_palette_argb();
 
-    graphics gfx{};
+    std::shared_ptr<video_sink> const video{};
 
     // registers
     uint8_t PPUCTRL = 0;
@@ -1,74 +1,157 @@
 #include "rom.h"
 
-#include <cstdio>
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
 
-// Helper class for managing FILE lifetime
-class file {
-  private:
-    FILE* m_stream{};
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-  public:
-    file(std::string const &filename)
-        : m_stream{std::fopen(filename.c_str(), "rb")} {
-        if (m_stream == nullptr) {
-            throw std::runtime_error("Failed to open file '" + filename + "'.");
-        }
+#include "log.h"
+#include "mapper.h"
+
+namespace {
+// Size of a ROM from its NES 2.0 size fields.
+std::size_t rom_size(uint8_t lsb, uint8_t msb, std::size_t unit) {
+    if (msb == 0x0F) {
+        // Exponent-multiplier notation
+        return (std::size_t{1} << (lsb >> 2)) * ((lsb & 0x03) * 2 + 1);
     }
-    file(file const &) = delete;
-    file &operator=(file const &) = delete;
-    file(file &&) = delete;
-    file &operator=(file &&) = delete;
-    ~file() { fclose(m_stream); }
+    return ((msb << 8) | lsb) * unit;
+}
 
-    FILE *stream() { return m_stream; }
-};
+// Size of a RAM from a NES 2.0 shift count.
+std::size_t ram_size(uint8_t shift) {
+    return shift ? std::size_t{64} << shift : 0;
+}
 
-void load_rom(std::string const& filename, picture_processing_unit& ppu,
-              memory_bus& bus) {
-    file rom{filename};
+std::mutex open_roms_mutex{};
+std::map<std::filesystem::path, std::weak_ptr<rom_file const>> open_roms{};
+} // namespace
 
-    // read header
+ines_header parse_header(std::span<uint8_t const, 16> header) {
     auto const guard = std::array<uint8_t, 4>{'N', 'E', 'S', 0x1A};
-    for (auto const c : guard) {
-        int const value{fgetc(rom.stream())};
-        if (value < 0)
-            throw std::runtime_error("Failed to read file.");
-        if (value != c)
-            throw std::runtime_error("Unexpected rom file header guard.");
+    if (!std::equal(guard.begin(), guard.end(), header.begin()))
+        throw std::runtime_error("Unexpected rom file header guard.");
+    uint8_t const flags6{header[6]};
+    uint8_t const flags7{header[7]};
+    ines_header h{};
+    h.nes2 = (flags7 & 0x0C) == 0x08;
+    h.nametable_mirroring =
+        flags6 & 0x01 ? mirroring::vertical : mirroring::horizontal;
+    h.battery = flags6 & 0x02;
+    h.trainer = flags6 & 0x04;
+    h.four_screen = flags6 & 0x08;
+    h.mapper = flags6 >> 4;
+    if (h.nes2) {
+        h.mapper |= (flags7 & 0xF0) | ((header[8] & 0x0F) << 8);
+        h.submapper = header[8] >> 4;
+        h.prg_rom_size = rom_size(header[4], header[9] & 0x0F, 0x4000);
+        h.chr_rom_size = rom_size(header[5], header[9] >> 4, 0x2000);
+        h.prg_ram_size = ram_size(header[10] & 0x0F);
+        h.prg_nvram_size = ram_size(header[10] >> 4);
+        h.chr_ram_size = ram_size(header[11] & 0x0F);
+        h.chr_nvram_size = ram_size(header[11] >> 4);
+        h.timing = header[12] & 0x03;
+        return h;
     }
-    int const num_prg_rom_banks{fgetc(rom.stream())};
-    if (num_prg_rom_banks < 0)
-        throw std::runtime_error("Failed to read file.");
-    int const num_chr_rom_banks{fgetc(rom.stream())};
-    if (num_chr_rom_banks < 0)
+    // Some old dumps have garbage such as "DiskDude!" after byte 7.
+    bool const archaic =
+        (flags7 & 0x0C) != 0 ||
+        std::any_of(header.begin() + 12, header.end(),
+                    [](uint8_t b) { return b != 0; });
+    if (!archaic) {
+        h.mapper |= flags7 & 0xF0;
+        h.timing = header[9] & 0x01;
+    }
+    h.prg_rom_size = header[4] * std::size_t{0x4000};
+    h.chr_rom_size = header[5] * std::size_t{0x2000};
+    // iNES cartridges are assumed to have 8 K of PRG RAM, and CHR RAM when
+    // there is no CHR ROM.
+    (h.battery ? h.prg_nvram_size : h.prg_ram_size) = 0x2000;
+    h.chr_ram_size = h.chr_rom_size ? 0 : 0x2000;
+    return h;
+}
+
+rom_file::rom_file(std::string const &filename) {
+    int const fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Failed to open file '" + filename + "'.");
+    struct stat status {};
+    if (::fstat(fd, &status) != 0 || status.st_size == 0) {
+        ::close(fd);
         throw std::runtime_error("Failed to read file.");
+    }
+    m_size = static_cast<std::size_t>(status.st_size);
+    void *const data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping stays valid without the descriptor.
+    ::close(fd);
+    if (data == MAP_FAILED)
+        throw std::runtime_error("Failed to map file '" + filename + "'.");
+    m_data = static_cast<uint8_t const *>(data);
+}
 
-    // Skip rest of header
-    fseek(rom.stream(), 16, 0);
+rom_file::~rom_file() {
+    ::munmap(const_cast<uint8_t *>(m_data), m_size);
+}
 
-    // load PRG ROM
-    for (int i{0x8000}; i < 0x10000; i++) {
-        if (num_prg_rom_banks == 1 && i == 0xC000) {
-            // Mirror the single ROM bank twice.
-            fseek(rom.stream(), 16, 0);
-        }
-        int const value{fgetc(rom.stream())};
-        if (value < 0)
-            throw std::runtime_error("Failed reading file.");
-        if (i % 0x1000 == 0)
-            logf(log_level::debug, "loaded: %#06x\n", i);
-        bus.load_rom(static_cast<uint16_t>(i), static_cast<uint8_t>(value));
-    }
+std::shared_ptr<rom_file const> open_rom(std::string const &filename) {
+    std::error_code error{};
+    std::filesystem::path key = std::filesystem::canonical(filename, error);
+    if (error)
+        key = filename;
+    std::lock_guard const lock{open_roms_mutex};
+    std::erase_if(open_roms,
+                  [](auto const &entry) { return entry.second.expired(); });
+    auto &cached = open_roms[key];
+    if (auto rom = cached.lock())
+        return rom;
+    auto rom = std::make_shared<rom_file const>(filename);
+    cached = rom;
+    return rom;
+}
 
-    // Load CHR ROM
-    if (num_chr_rom_banks != 1)
-        throw std::runtime_error(
-            "Not implemented reading multiple CHR ROM banks.");
-    for (int i{0}; i < 0x2000; i++) {
-        int const value{fgetc(rom.stream())};
-        if (value < 0)
-            throw std::runtime_error("Failed reading file.");
-        ppu.load_rom(static_cast<uint16_t>(i), static_cast<uint8_t>(value));
-    }
+void load_rom(std::string const& filename, picture_processing_unit& ppu,
+              memory_bus& bus) {
+    auto rom = open_rom(filename);
+    auto const data = rom->data();
+    if (data.size() < 16)
+        throw std::runtime_error("Failed to read file.");
+    auto const header = parse_header(data.first<16>());
+    if (header.four_screen)
+        log(log_level::error, "Four-screen nametables are not supported.\n");
+    log(log_level::debug,
+        "{}: mapper: {}, PRG ROM: {} K, CHR ROM: {} K, CHR RAM: {} K\n",
+        header.nes2 ? "NES 2.0" : "iNES", header.mapper,
+        header.prg_rom_size / 1024, header.chr_rom_size / 1024,
+        (header.chr_ram_size + header.chr_nvram_size) / 1024);
+
+    // The trainer is not loaded.
+    std::size_t const offset = 16 + (header.trainer ? 512 : 0);
+    if (header.prg_rom_size == 0)
+        throw std::runtime_error("No PRG ROM.");
+    // Mappers switch whole 4 K pages of PRG ROM and 1 K banks of CHR ROM,
+    // the exponent-multiplier sizes of NES 2.0 can be anything.
+    if (header.prg_rom_size % 0x1000 != 0)
+        throw std::runtime_error("PRG ROM is not a multiple of 4 K.");
+    if (header.chr_rom_size % 0x400 != 0)
+        throw std::runtime_error("CHR ROM is not a multiple of 1 K.");
+    if (data.size() < offset + header.prg_rom_size + header.chr_rom_size)
+        throw std::runtime_error("Failed reading file, it is truncated.");
+
+    cartridge cart{};
+    cart.mapper_number = header.mapper;
+    cart.prg_rom = data.subspan(offset, header.prg_rom_size);
+    cart.chr_rom = data.subspan(offset + header.prg_rom_size,
+                                header.chr_rom_size);
+    cart.chr_ram_size = header.chr_ram_size + header.chr_nvram_size;
+    cart.nametable_mirroring = header.nametable_mirroring;
+    cart.storage = std::move(rom);
+    bus.set_mapper(make_mapper(std::move(cart), bus, &ppu));
     log(log_level::info, "Finished loading\n");
 }
@@ -1,10 +1,55 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
 #include <string>
 
 #include "mem.h"
 #include "ppu.h"
 
+// Contents of an iNES or NES 2.0 header. Sizes are in bytes.
+struct ines_header {
+    bool nes2{};
+    uint16_t mapper{};
+    uint8_t submapper{};
+    std::size_t prg_rom_size{};
+    std::size_t chr_rom_size{};
+    // Volatile and battery backed RAM.
+    std::size_t prg_ram_size{};
+    std::size_t prg_nvram_size{};
+    std::size_t chr_ram_size{};
+    std::size_t chr_nvram_size{};
+    mirroring nametable_mirroring{};
+    bool four_screen{};
+    bool battery{};
+    bool trainer{};
+    // 0: NTSC, 1: PAL, 2: multiple regions, 3: Dendy
+    uint8_t timing{};
+};
+
+// Throws for anything that is not an iNES header.
+ines_header parse_header(std::span<uint8_t const, 16> header);
+
+// A ROM file mapped read-only into memory.
+class rom_file {
+  public:
+    explicit rom_file(std::string const &filename);
+    rom_file(rom_file const &) = delete;
+    rom_file &operator=(rom_file const &) = delete;
+    ~rom_file();
+
+    std::span<uint8_t const> data() const { return {m_data, m_size}; }
+
+  private:
+    uint8_t const *m_data{};
+    std::size_t m_size{};
+};
+
+// Maps filename, or shares the mapping with every other open instance of it.
+std::shared_ptr<rom_file const> open_rom(std::string const &filename);
 
 void load_rom(std::string const& filename, picture_processing_unit& ppu,
          memory_bus& mem);
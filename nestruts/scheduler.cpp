@@ -0,0 +1,33 @@
+#include "scheduler.h"
+
+#include <algorithm>
+
+void event_scheduler::set_handler(event e, handler h) {
+    handlers[static_cast<std::size_t>(e)] = std::move(h);
+}
+
+void event_scheduler::schedule(event e, uint64_t cycle) {
+    due[static_cast<std::size_t>(e)] = cycle;
+    update_next();
+    lower_deadline(cycle);
+}
+
+void event_scheduler::cancel(event e) {
+    due[static_cast<std::size_t>(e)] = never;
+    update_next();
+}
+
+void event_scheduler::run_due(uint64_t cycle) {
+    while (next <= cycle) {
+        auto const slot = std::min_element(due.begin(), due.end());
+        auto const at = std::exchange(*slot, never);
+        update_next();
+        // Handlers may schedule the next occurrence.
+        if (auto const &h = handlers[slot - due.begin()])
+            h(at);
+    }
+}
+
+void event_scheduler::update_next() {
+    next = *std::min_element(due.begin(), due.end());
+}
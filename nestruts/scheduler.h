@@ -0,0 +1,103 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <utility>
+
+// Timed device events, in CPU cycles since power on.
+enum class event : uint8_t {
+    // Start of vblank, posted by the PPU once per frame.
+    vblank,
+    // APU frame counter interrupt.
+    apu_frame,
+    // Cartridge interrupt, e.g. the MMC3 scanline counter.
+    mapper_irq,
+    // Sprite 0 hit, so loops polling PPUSTATUS end on time.
+    sprite_zero,
+    // Pre-render line, which clears the vblank and sprite 0 hit flags, so
+    // loops polling PPUSTATUS for them to clear end on time too.
+    prerender,
+    count
+};
+
+// Sources of the IRQ line, one bit each.
+enum class irq_line : uint8_t {
+    apu_frame = 1 << 0,
+    mapper = 1 << 1,
+};
+
+// Posts device events for the cycle they happen at and collects the
+// interrupt lines devices assert. core6502 runs due events between
+// instructions and ends its blocks at the next event, so device timing does
+// not depend on how instructions are batched. Between instructions the CPU
+// only checks pending() for interrupts, and its cycle budget, which
+// schedules and interrupts during a block lower so the block ends in time.
+class event_scheduler final {
+  public:
+    using handler = std::function<void(uint64_t cycle)>;
+    static constexpr uint64_t never = std::numeric_limits<uint64_t>::max();
+
+    event_scheduler() { due.fill(never); }
+
+    // Cycle counter of the CPU, set by core6502.
+    void set_clock(uint64_t const *cycles) { clock = cycles; }
+    uint64_t now() const { return clock ? *clock : 0; }
+    // Cycle budget of the running block, set by core6502.
+    void set_deadline(uint64_t *cycle) { deadline = cycle; }
+
+    // Called with the scheduled cycle when e is due.
+    void set_handler(event e, handler h);
+    // Replaces an earlier schedule of e.
+    void schedule(event e, uint64_t cycle);
+    void cancel(event e);
+    // Cycle of the earliest scheduled event, never if none is.
+    uint64_t next_event() const { return next; }
+    // Run the handlers of all events due at cycle in the order they are due.
+    void run_due(uint64_t cycle);
+
+    void assert_irq(irq_line line) {
+        lines |= static_cast<uint8_t>(line);
+        lower_deadline(now());
+    }
+    void release_irq(irq_line line) { lines &= ~static_cast<uint8_t>(line); }
+    void trigger_nmi() {
+        lines |= nmi_bit;
+        lower_deadline(now());
+    }
+    // Non-zero while an NMI or IRQ is pending.
+    uint8_t pending() const { return lines; }
+    bool irq() const { return lines & ~nmi_bit; }
+    // NMI is edge triggered, taking it clears it.
+    bool take_nmi() {
+        bool const nmi = lines & nmi_bit;
+        lines &= ~nmi_bit;
+        return nmi;
+    }
+
+    // Halt the CPU, e.g. for OAM DMA.
+    void stall(uint16_t cycles) { stall_cycles += cycles; }
+    uint16_t take_stall() { return std::exchange(stall_cycles, 0); }
+
+  private:
+    static constexpr uint8_t nmi_bit = 1 << 7;
+    static constexpr std::size_t event_count =
+        static_cast<std::size_t>(event::count);
+
+    // One slot per event, there are few enough to find the earliest by
+    // scanning.
+    std::array<uint64_t, event_count> due{};
+    std::array<handler, event_count> handlers{};
+    uint64_t next{never};
+    uint8_t lines{};
+    uint16_t stall_cycles{};
+    uint64_t const *clock{};
+    uint64_t *deadline{};
+
+    void update_next();
+    void lower_deadline(uint64_t cycle) {
+        if (deadline && cycle < *deadline)
+            *deadline = cycle;
+    }
+};
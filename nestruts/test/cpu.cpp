@@ -1,17 +1,43 @@
+#include "nestruts/compositor.h"
 #include "nestruts/core6502.h"
+#include "nestruts/core6502_ops.h"
+#include "nestruts/frame_exchange.h"
+#include "nestruts/mapper.h"
 #include "nestruts/mem.h"
+#include "nestruts/ntsc.h"
+#include "nestruts/palette.h"
+#include "nestruts/rom.h"
+#include "nestruts/tile_cache.h"
+#include "nestruts/upscale.h"
+#include <algorithm>
 #include <catch2/catch_test_macros.hpp>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
 #include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 std::unique_ptr<memory_bus> create_mem() {
     return std::make_unique<memory_bus>(nullptr, nullptr, nullptr);
 }
 
+// Writes data to PPU memory from adr through PPUADDR and PPUDATA.
+void write_ppu(picture_processing_unit &ppu, uint16_t adr,
+               std::vector<uint8_t> data) {
+    ppu.write_PPUADDR(adr >> 8);
+    ppu.write_PPUADDR(adr & 0xFF);
+    ppu.write_PPUDATA(data);
+}
+
 TEST_CASE("LDA Immediate", "[instruction]") {
     auto m = create_mem();
     m->write(0x0000, 0xA9); // LDA immediate
     m->write(0x0001, 0x11); // value
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     cpu->cycle();
     REQUIRE(cpu->get_acc() == 0x11);
@@ -23,7 +49,7 @@ TEST_CASE("LDA Absolute", "[instruction]") {
     m->write(0x0001, 0x34); // addr low
     m->write(0x0002, 0x12); // addr high
     m->write(0x1234, 0xAB); // value to read
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     cpu->cycle();
     REQUIRE(cpu->get_acc() == 0xAB);
@@ -37,7 +63,7 @@ TEST_CASE("LDA X-Indexed Absolute", "[instruction]") {
     m->write(0x0003, 0x34); // addr low
     m->write(0x0004, 0x12); // addr high
     m->write(0x1244, 0xCD); // value to read
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     cpu->cycle(); // LDX 0x10
     cpu->cycle(); // LDA
@@ -52,7 +78,7 @@ TEST_CASE("LDA Y-Indexed Absolute", "[instruction]") {
     m->write(0x0003, 0x34); // addr low
     m->write(0x0004, 0x12); // addr high
     m->write(0x1244, 0xCE); // value to read
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     cpu->cycle(); // LDX 0x10
     cpu->cycle(); // LDA
@@ -64,7 +90,7 @@ TEST_CASE("LDA Zero Page", "[instruction]") {
     m->write(0x0000, 0xA5); // LDA Zero Page
     m->write(0x0001, 0x44); // offset
     m->write(0x0044, 0xBA); // value to read
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     cpu->cycle(); // LDA
     REQUIRE(cpu->get_acc() == 0xBA);
@@ -77,7 +103,7 @@ TEST_CASE("LDA X-Indexed Zero Page", "[instruction]") {
     m->write(0x0002, 0xB5); // LDA X-Indexed Zero Page
     m->write(0x0003, 0x44); // offset
     m->write(0x0055, 0xCB); // value to read
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     cpu->cycle(); // LDX
     cpu->cycle(); // LDA
@@ -93,7 +119,7 @@ TEST_CASE("LDA X-Indexed Zero Page Indirect", "[instruction]") {
     m->write(0x0043, 0xAB); // address low
     m->write(0x0044, 0x12); // address high
     m->write(0x12AB, 0x17); // value to read
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     cpu->cycle(); // LDX
     cpu->cycle(); // LDA
@@ -109,7 +135,7 @@ TEST_CASE("LDA Zero Page Indirect Y-Indexed", "[instruction]") {
     m->write(0x0020, 0xFF); // addr low (added with Y)
     m->write(0x0021, 0x11); // addr high
     m->write(0x1201, 0x21); // value to read
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     cpu->cycle(); // LDY
     cpu->cycle(); // LDA
@@ -123,7 +149,7 @@ TEST_CASE("LDX Y-Indexed Zero Page", "[instruction]") {
     m->write(0x0002, 0xB6); // LDX Y-Indexed Zero Page
     m->write(0x0003, 0x31); // offset
     m->write(0x0041, 0x19); // value to read
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     cpu->cycle(); // LDY
     cpu->cycle(); // LDX
@@ -136,7 +162,7 @@ TEST_CASE("ADC Immediate", "[instruction]") {
     m->write(0x0001, 0x11); // value
     m->write(0x0002, 0x69); // ADC immediate
     m->write(0x0003, 0x22); // value
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     cpu->cycle();
     cpu->cycle();
@@ -151,7 +177,7 @@ TEST_CASE("ADC Absolute", "[instruction]") {
     m->write(0x0003, 0x34); // low adr
     m->write(0x0004, 0x12); // high adr
     m->write(0x1234, 0x09); // value
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     cpu->cycle();
     cpu->cycle();
@@ -163,7 +189,7 @@ TEST_CASE("PHP", "[instruction]") {
     m->write(0x0000, 0x38); // SEC
     m->write(0x0001, 0x08); // PHP
     m->write(0x0002, 0x68); // PLA
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     cpu->cycle();
     auto expected_state = cpu->dump_state();
@@ -186,7 +212,7 @@ TEST_CASE("AND Immediate", "[instruction]") {
     m->write(0x0005, 0x81); // value
     m->write(0x0006, 0x29); // AND Immediate
     m->write(0x0007, 0x82); // value
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     cpu->cycle(); // LDA 0x11
     {
@@ -218,7 +244,7 @@ TEST_CASE("JMP Indirect", "[instruction]") {
     m->write(0x0002, 0x12); // Address high
     m->write(0x1234, 0x02); // Jump address low
     m->write(0x1235, 0x10); // Jump address high
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     auto expected_state = cpu->dump_state();
     expected_state.pp = 0x1002;
@@ -235,10 +261,1356 @@ TEST_CASE("JMP Indirect Wrapping", "[instruction]") {
     m->write(0x12FF, 0x03); // Jump address low
     // We don't go to 0x1300 next!
     m->write(0x1200, 0x11); // Jump address high
-    auto cpu = std::make_unique<core6502>(std::move(m), [] { return false; });
+    auto cpu = std::make_unique<core6502>(std::move(m));
     cpu->setpp(0x0000);
     auto expected_state = cpu->dump_state();
     expected_state.pp = 0x1103;
     cpu->cycle(); // JMP
     REQUIRE(expected_state == cpu->dump_state());
 }
+
+TEST_CASE("LSR Zero Page", "[instruction]") {
+    auto m = create_mem();
+    m->write(0x0000, 0x46); // LSR Zero Page
+    m->write(0x0001, 0x44); // offset
+    m->write(0x0044, 0x81); // value to shift
+    m->write(0x0002, 0xA5); // LDA Zero Page
+    m->write(0x0003, 0x44); // offset
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    cpu->setpp(0x0000);
+    cpu->cycle(); // LSR
+    REQUIRE((cpu->dump_state().status & 0x01) == 0x01); // Carry from bit 0
+    cpu->cycle(); // LDA
+    REQUIRE(cpu->get_acc() == 0x40);
+}
+
+TEST_CASE("INC And DEC Absolute Mirrored RAM", "[instruction]") {
+    auto m = create_mem();
+    auto *bus = m.get();
+    m->write(0x0000, 0xEE); // INC Absolute
+    m->write(0x0001, 0x44); // addr low
+    m->write(0x0002, 0x08); // addr high, mirror of $0044
+    m->write(0x0003, 0xCE); // DEC Absolute
+    m->write(0x0004, 0x45); // addr low
+    m->write(0x0005, 0x18); // addr high, mirror of $0045
+    m->write(0x0044, 0xFF); // value to increment
+    m->write(0x0045, 0x00); // value to decrement
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    cpu->setpp(0x0000);
+    cpu->cycle(); // INC
+    REQUIRE(bus->read(0x0044) == 0x00);
+    REQUIRE((cpu->dump_state().status & 0x02) == 0x02); // Zero
+    cpu->cycle(); // DEC
+    REQUIRE(bus->read(0x0045) == 0xFF);
+    REQUIRE((cpu->dump_state().status & 0x82) == 0x80); // Negative
+    REQUIRE(cpu->get_cycles() == 12);
+}
+
+TEST_CASE("STX Y-Indexed Zero Page", "[instruction]") {
+    auto m = create_mem();
+    m->write(0x0000, 0xA2); // LDX immediate
+    m->write(0x0001, 0x21); // value
+    m->write(0x0002, 0xA0); // LDY immediate
+    m->write(0x0003, 0x04); // value
+    m->write(0x0004, 0x96); // STX Y-Indexed Zero Page
+    m->write(0x0005, 0x40); // offset
+    m->write(0x0006, 0xA5); // LDA Zero Page
+    m->write(0x0007, 0x44); // offset
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    cpu->setpp(0x0000);
+    cpu->cycle(); // LDX
+    cpu->cycle(); // LDY
+    cpu->cycle(); // STX
+    cpu->cycle(); // LDA
+    REQUIRE(cpu->get_acc() == 0x21);
+}
+
+TEST_CASE("Cycles Page Crossing", "[cycles]") {
+    auto m = create_mem();
+    m->write(0x0000, 0xA2); // LDX immediate, 2 cycles
+    m->write(0x0001, 0x01); // value
+    m->write(0x0002, 0xBD); // LDA X-Indexed Absolute, 4 cycles
+    m->write(0x0003, 0x10); // addr low
+    m->write(0x0004, 0x12); // addr high
+    m->write(0x0005, 0xBD); // LDA X-Indexed Absolute, 4 + 1 cycles
+    m->write(0x0006, 0xFF); // addr low
+    m->write(0x0007, 0x12); // addr high
+    m->write(0x0008, 0x9D); // STA X-Indexed Absolute, always 5 cycles
+    m->write(0x0009, 0xFF); // addr low
+    m->write(0x000A, 0x12); // addr high
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    cpu->setpp(0x0000);
+    cpu->cycle(); // LDX
+    REQUIRE(cpu->get_cycles() == 2);
+    cpu->cycle(); // LDA
+    REQUIRE(cpu->get_cycles() == 6);
+    cpu->cycle(); // LDA
+    REQUIRE(cpu->get_cycles() == 11);
+    cpu->cycle(); // STA
+    REQUIRE(cpu->get_cycles() == 16);
+}
+
+TEST_CASE("Cycles Branches", "[cycles]") {
+    auto m = create_mem();
+    m->write(0x00FA, 0x18); // CLC, 2 cycles
+    m->write(0x00FB, 0xB0); // BCS not taken, 2 cycles
+    m->write(0x00FC, 0x10); // offset
+    m->write(0x00FD, 0x90); // BCC taken to next page, 2 + 2 cycles
+    m->write(0x00FE, 0x02); // offset
+    m->write(0x0101, 0x90); // BCC taken within page, 2 + 1 cycles
+    m->write(0x0102, 0x00); // offset
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    cpu->setpp(0x00FA);
+    cpu->cycle(); // CLC
+    cpu->cycle(); // BCS
+    REQUIRE(cpu->get_cycles() == 4);
+    cpu->cycle(); // BCC
+    REQUIRE(cpu->get_cycles() == 8);
+    REQUIRE(cpu->dump_state().pp == 0x0101);
+    cpu->cycle(); // BCC
+    REQUIRE(cpu->get_cycles() == 11);
+}
+
+TEST_CASE("Run Until", "[cycles]") {
+    auto m = create_mem();
+    m->write(0x0000, 0xE8); // INX, 2 cycles
+    m->write(0x0001, 0x4C); // JMP Absolute, 3 cycles
+    m->write(0x0002, 0x00); // addr low
+    m->write(0x0003, 0x00); // addr high
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    cpu->setpp(0x0000);
+    cpu->run_until(100);
+    // Stops on the first instruction boundary at or past the target.
+    REQUIRE(cpu->get_cycles() == 100);
+    REQUIRE(cpu->get_x() == 20);
+    cpu->run_until(101);
+    REQUIRE(cpu->get_cycles() == 102);
+}
+
+TEST_CASE("Predecoded ROM Loop", "[instruction]") {
+    auto m = create_mem();
+    m->load_rom(0x8000, 0xA2); // LDX immediate
+    m->load_rom(0x8001, 0x00); // value
+    m->load_rom(0x8002, 0x8A); // TXA
+    m->load_rom(0x8003, 0x95); // STA X-Indexed Zero Page
+    m->load_rom(0x8004, 0x10); // offset
+    m->load_rom(0x8005, 0xE8); // INX
+    m->load_rom(0x8006, 0xE0); // CPX immediate
+    m->load_rom(0x8007, 0x04); // value
+    m->load_rom(0x8008, 0xD0); // BNE $8002
+    m->load_rom(0x8009, 0xF8); // offset
+    m->load_rom(0x800A, 0xB5); // LDA X-Indexed Zero Page
+    m->load_rom(0x800B, 0x0F); // offset
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    cpu->setpp(0x8000);
+    // LDX, then four iterations of five instructions, then LDA.
+    for (int i{0}; i < 1 + 4 * 5 + 1; ++i) {
+        cpu->cycle();
+    }
+    REQUIRE(cpu->get_x() == 0x04);
+    REQUIRE(cpu->get_acc() == 0x03);
+    REQUIRE(cpu->dump_state().pp == 0x800C);
+}
+
+TEST_CASE("Blocks Match Interpreter", "[blocks]") {
+    // Fill $0200-$020F with $42 using fused LDA/STA and CPX/BNE pairs.
+    auto const load = [](memory_bus &m) {
+        m.load_rom(0x8000, 0xA2); // LDX immediate
+        m.load_rom(0x8001, 0x00); // value
+        m.load_rom(0x8002, 0xA9); // LDA immediate
+        m.load_rom(0x8003, 0x42); // value
+        m.load_rom(0x8004, 0x9D); // STA X-Indexed Absolute
+        m.load_rom(0x8005, 0x00); // addr low
+        m.load_rom(0x8006, 0x02); // addr high
+        m.load_rom(0x8007, 0xE8); // INX
+        m.load_rom(0x8008, 0xE0); // CPX immediate
+        m.load_rom(0x8009, 0x10); // value
+        m.load_rom(0x800A, 0xD0); // BNE $8002
+        m.load_rom(0x800B, 0xF6); // offset
+        m.load_rom(0x800C, 0xAD); // LDA Absolute
+        m.load_rom(0x800D, 0x0F); // addr low
+        m.load_rom(0x800E, 0x02); // addr high
+        m.load_rom(0x800F, 0x4C); // JMP $800F
+        m.load_rom(0x8010, 0x0F); // addr low
+        m.load_rom(0x8011, 0x80); // addr high
+    };
+    auto stepped_mem = create_mem();
+    load(*stepped_mem);
+    auto stepped = std::make_unique<core6502>(std::move(stepped_mem));
+    stepped->setpp(0x8000);
+    // LDX, 16 iterations of five instructions, then LDA.
+    for (int i{0}; i < 1 + 16 * 5 + 1; ++i) {
+        stepped->cycle();
+    }
+    REQUIRE(stepped->get_acc() == 0x42);
+
+    auto blocks_mem = create_mem();
+    load(*blocks_mem);
+    auto blocks = std::make_unique<core6502>(std::move(blocks_mem));
+    blocks->setpp(0x8000);
+    blocks->run_until(stepped->get_cycles());
+    REQUIRE(blocks->get_cycles() == stepped->get_cycles());
+    REQUIRE(blocks->dump_state() == stepped->dump_state());
+}
+
+TEST_CASE("Blocks Invalidated On ROM Change", "[blocks]") {
+    auto m = create_mem();
+    auto *bus = m.get();
+    m->load_rom(0x8000, 0xE8); // INX
+    m->load_rom(0x8001, 0x4C); // JMP $8000
+    m->load_rom(0x8002, 0x00); // addr low
+    m->load_rom(0x8003, 0x80); // addr high
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    cpu->setpp(0x8000);
+    cpu->run_until(50); // Ten iterations of INX and JMP
+    REQUIRE(cpu->get_x() == 10);
+    bus->load_rom(0x8000, 0xC8); // INY
+    cpu->run_until(100);
+    REQUIRE(cpu->get_x() == 10);
+    REQUIRE(cpu->dump_state().y == 10);
+}
+
+// The loop of "Blocks Match Interpreter" as struts_recompile generates it.
+int static_loop_runs{};
+void static_loop(core6502 &cpu) {
+    ++static_loop_runs;
+    switch (cpu.get_pp()) {
+    case 0x8000: // LDX #$00
+        if (!cpu.execute_static<0xa2>(0x00, 0x00))
+            return;
+        [[fallthrough]];
+    case 0x8002: // LDA #$42
+        if (!cpu.execute_static<0xa9>(0x42, 0x00))
+            return;
+        [[fallthrough]];
+    case 0x8004: // STA $0200,X
+        if (!cpu.execute_static<0x9d>(0x00, 0x02))
+            return;
+        [[fallthrough]];
+    case 0x8007: // INX
+        if (!cpu.execute_static<0xe8>(0x00, 0x00))
+            return;
+        [[fallthrough]];
+    case 0x8008: // CPX #$10
+        if (!cpu.execute_static<0xe0>(0x10, 0x00))
+            return;
+        [[fallthrough]];
+    case 0x800A: // BNE $8002
+        if (!cpu.execute_static<0xd0>(0xf6, 0x00))
+            return;
+    }
+}
+
+TEST_CASE("Static Code Matches Interpreter", "[static]") {
+    auto const load = [](memory_bus &m) {
+        m.load_rom(0x8000, 0xA2); // LDX immediate
+        m.load_rom(0x8001, 0x00); // value
+        m.load_rom(0x8002, 0xA9); // LDA immediate
+        m.load_rom(0x8003, 0x42); // value
+        m.load_rom(0x8004, 0x9D); // STA X-Indexed Absolute
+        m.load_rom(0x8005, 0x00); // addr low
+        m.load_rom(0x8006, 0x02); // addr high
+        m.load_rom(0x8007, 0xE8); // INX
+        m.load_rom(0x8008, 0xE0); // CPX immediate
+        m.load_rom(0x8009, 0x10); // value
+        m.load_rom(0x800A, 0xD0); // BNE $8002
+        m.load_rom(0x800B, 0xF6); // offset
+        m.load_rom(0x800C, 0xAD); // LDA Absolute
+        m.load_rom(0x800D, 0x0F); // addr low
+        m.load_rom(0x800E, 0x02); // addr high
+        m.load_rom(0x800F, 0x4C); // JMP $800F
+        m.load_rom(0x8010, 0x0F); // addr low
+        m.load_rom(0x8011, 0x80); // addr high
+    };
+    auto stepped_mem = create_mem();
+    load(*stepped_mem);
+    auto stepped = std::make_unique<core6502>(std::move(stepped_mem));
+    stepped->setpp(0x8000);
+    for (int i{0}; i < 1 + 16 * 5 + 1; ++i) {
+        stepped->cycle();
+    }
+
+    auto static_mem = create_mem();
+    auto *bus = static_mem.get();
+    load(*static_mem);
+    auto cpu = std::make_unique<core6502>(std::move(static_mem));
+    for (uint16_t adr : {0x8000, 0x8002, 0x8004, 0x8007, 0x8008, 0x800A}) {
+        cpu->add_static_block(adr, static_loop);
+    }
+    cpu->setpp(0x8000);
+    static_loop_runs = 0;
+    // Stops within the loop and resumes there.
+    cpu->run_until(105);
+    cpu->run_until(stepped->get_cycles());
+    // One run per iteration and one to resume.
+    REQUIRE(static_loop_runs == 17);
+    REQUIRE(cpu->get_cycles() == stepped->get_cycles());
+    REQUIRE(cpu->dump_state() == stepped->dump_state());
+
+    // Changed ROM falls back to the interpreter.
+    bus->load_rom(0x8000, 0xA2);
+    cpu->setpp(0x8000);
+    cpu->run_until(cpu->get_cycles() + 2);
+    REQUIRE(static_loop_runs == 17);
+}
+
+TEST_CASE("Disassembly Of Executed Instructions", "[disasm]") {
+    auto m = create_mem();
+    m->load_rom(0x8000, 0xA9); // LDA immediate
+    m->load_rom(0x8001, 0x11); // value
+    m->load_rom(0x8002, 0x8D); // STA Absolute
+    m->load_rom(0x8003, 0x34); // addr low
+    m->load_rom(0x8004, 0x12); // addr high
+    m->load_rom(0x8005, 0x4C); // JMP $8000
+    m->load_rom(0x8006, 0x00); // addr low
+    m->load_rom(0x8007, 0x80); // addr high
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    cpu->setpp(0x8000);
+    for (int i{0}; i < 6; ++i) {
+        cpu->cycle();
+    }
+    auto const filename =
+        std::filesystem::temp_directory_path() / "struts_test_disasm";
+    cpu->write_disassembly(filename.string());
+    std::stringstream disassembly{};
+    disassembly << std::ifstream{filename}.rdbuf();
+    std::filesystem::remove(filename);
+    REQUIRE(disassembly.str() == "$8000: LDA #11\n"
+                                 "$8002: STA $1234\n"
+                                 "$8005: JMP $8000\n\n");
+}
+
+TEST_CASE("Idle Loop Skipped", "[blocks]") {
+    auto const create_cpu = [] {
+        auto m = create_mem();
+        m->write(0x0010, 0x00);
+        m->load_rom(0x8000, 0xA5); // LDA Zero Page
+        m->load_rom(0x8001, 0x10); // addr
+        m->load_rom(0x8002, 0xF0); // BEQ $8000
+        m->load_rom(0x8003, 0xFC); // offset
+        auto cpu = std::make_unique<core6502>(std::move(m));
+        cpu->setpp(0x8000);
+        return cpu;
+    };
+    auto interpreted = create_cpu();
+    interpreted->set_idle_loop_skipping(false);
+    interpreted->run_until(10000);
+    REQUIRE(interpreted->take_skipped_cycles() == 0);
+
+    auto skipping = create_cpu();
+    skipping->run_until(10000);
+    // LDA and taken BEQ take 6 cycles, the first two iterations and the
+    // last partial one are interpreted.
+    REQUIRE(skipping->take_skipped_cycles() == 10000 / 6 * 6 - 2 * 6);
+    REQUIRE(skipping->get_cycles() == interpreted->get_cycles());
+    REQUIRE(skipping->dump_state() == interpreted->dump_state());
+}
+
+TEST_CASE("Native Fill And Copy Loops", "[blocks]") {
+    auto const create_cpu = [](memory_bus *&bus) {
+        auto m = create_mem();
+        bus = m.get();
+        m->write(0x0310, 0x55);
+        m->load_rom(0x8000, 0xA9); // LDA immediate
+        m->load_rom(0x8001, 0xAA); // value
+        m->load_rom(0x8002, 0xA2); // LDX immediate
+        m->load_rom(0x8003, 0x00); // value
+        m->load_rom(0x8004, 0x9D); // STA X-Indexed Absolute
+        m->load_rom(0x8005, 0x00); // addr low
+        m->load_rom(0x8006, 0x02); // addr high
+        m->load_rom(0x8007, 0x9D); // STA X-Indexed Absolute
+        m->load_rom(0x8008, 0x00); // addr low
+        m->load_rom(0x8009, 0x03); // addr high
+        m->load_rom(0x800A, 0xE8); // INX
+        m->load_rom(0x800B, 0xD0); // BNE $8004
+        m->load_rom(0x800C, 0xF7); // offset
+        m->load_rom(0x800D, 0xA0); // LDY immediate
+        m->load_rom(0x800E, 0x10); // value
+        m->load_rom(0x800F, 0xB9); // LDA Y-Indexed Absolute
+        m->load_rom(0x8010, 0xFF); // addr low
+        m->load_rom(0x8011, 0x02); // addr high
+        m->load_rom(0x8012, 0x99); // STA Y-Indexed Absolute
+        m->load_rom(0x8013, 0x00); // addr low
+        m->load_rom(0x8014, 0x04); // addr high
+        m->load_rom(0x8015, 0x88); // DEY
+        m->load_rom(0x8016, 0xD0); // BNE $800F
+        m->load_rom(0x8017, 0xF7); // offset
+        m->load_rom(0x8018, 0x4C); // JMP $8018
+        m->load_rom(0x8019, 0x18); // addr low
+        m->load_rom(0x801A, 0x80); // addr high
+        auto cpu = std::make_unique<core6502>(std::move(m));
+        cpu->setpp(0x8000);
+        return cpu;
+    };
+    memory_bus *stepped_bus{};
+    auto stepped = create_cpu(stepped_bus);
+    while (stepped->dump_state().pp != 0x8018) {
+        stepped->cycle();
+    }
+    REQUIRE(stepped_bus->read(0x02FF) == 0xAA);
+    REQUIRE(stepped_bus->read(0x0410) == 0xAA);
+
+    memory_bus *bus{};
+    auto cpu = create_cpu(bus);
+    // Stop in the middle of the fill loop, then run both loops to the end.
+    cpu->run_until(1000);
+    // LDA and LDX, 66 iterations of 15 cycles, then two STA.
+    REQUIRE(cpu->get_cycles() == 4 + 66 * 15 + 2 * 5);
+    REQUIRE(cpu->get_x() == 66);
+    cpu->run_until(stepped->get_cycles());
+    REQUIRE(cpu->get_cycles() == stepped->get_cycles());
+    REQUIRE(cpu->dump_state() == stepped->dump_state());
+    std::vector<uint8_t> ram{};
+    std::vector<uint8_t> stepped_ram{};
+    for (uint16_t adr{0x0200}; adr < 0x0420; ++adr) {
+        ram.push_back(bus->read(adr));
+        stepped_ram.push_back(stepped_bus->read(adr));
+    }
+    REQUIRE(ram == stepped_ram);
+}
+
+TEST_CASE("Scheduled Events And Interrupts", "[events]") {
+    auto m = create_mem();
+    auto &events = m->scheduler();
+    m->load_rom(0x8000, 0xA2); // LDX immediate
+    m->load_rom(0x8001, 0x00); // value
+    m->load_rom(0x8002, 0x4C); // JMP $8002
+    m->load_rom(0x8003, 0x02); // addr low
+    m->load_rom(0x8004, 0x80); // addr high
+    m->load_rom(0x9000, 0xE8); // INX
+    m->load_rom(0x9001, 0x4C); // JMP $9001
+    m->load_rom(0x9002, 0x01); // addr low
+    m->load_rom(0x9003, 0x90); // addr high
+    m->load_rom(0xFFFA, 0x00); // NMI vector low
+    m->load_rom(0xFFFB, 0x90); // NMI vector high
+    m->load_rom(0xFFFE, 0x00); // IRQ vector low
+    m->load_rom(0xFFFF, 0x90); // IRQ vector high
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    cpu->setpp(0x8000);
+
+    std::vector<uint64_t> ran_at{};
+    events.set_handler(event::apu_frame, [&](uint64_t cycle) {
+        ran_at.push_back(events.now());
+        events.assert_irq(irq_line::mapper);
+        events.schedule(event::vblank, cycle + 50);
+    });
+    events.set_handler(event::vblank, [&](uint64_t) {
+        ran_at.push_back(events.now());
+        events.trigger_nmi();
+    });
+    events.schedule(event::apu_frame, 100);
+
+    // The block stops at the first instruction boundary after the event.
+    cpu->run_until(1000);
+    REQUIRE(ran_at.size() == 2);
+    REQUIRE(ran_at[0] == 2 + 3 * 33);
+    // IRQ, then NMI while the interrupt disable flag masks the IRQ line.
+    REQUIRE(ran_at[1] == ran_at[0] + 7 + 2 + 3 * 14);
+    REQUIRE(cpu->get_x() == 2);
+    REQUIRE(cpu->get_pp() == 0x9001);
+    REQUIRE(events.pending() == static_cast<uint8_t>(irq_line::mapper));
+    REQUIRE(events.next_event() == event_scheduler::never);
+}
+
+// PRG ROM of banks 16 K banks, each filled with its bank number, code is
+// copied to the start of the last bank.
+std::vector<uint8_t> create_prg_rom(int banks,
+                                    std::vector<uint8_t> const &code) {
+    std::vector<uint8_t> prg_rom(banks * 0x4000);
+    for (int bank{0}; bank < banks; ++bank) {
+        std::fill_n(prg_rom.begin() + bank * 0x4000, 0x4000, bank);
+    }
+    auto const last = prg_rom.end() - 0x4000;
+    std::copy(code.begin(), code.end(), last);
+    // Reset and IRQ vectors point at the code at $C000.
+    for (auto const vector : {0x3FFC, 0x3FFE}) {
+        last[vector] = 0x00;
+        last[vector + 1] = 0xC0;
+    }
+    return prg_rom;
+}
+
+cartridge create_cartridge(uint16_t mapper_number,
+                           std::vector<uint8_t> prg_rom) {
+    auto storage = std::make_shared<std::vector<uint8_t> const>(
+        std::move(prg_rom));
+    cartridge cart{};
+    cart.mapper_number = mapper_number;
+    cart.prg_rom = *storage;
+    cart.storage = std::move(storage);
+    return cart;
+}
+
+TEST_CASE("UxROM Bank Switching", "[mapper]") {
+    auto prg_rom = create_prg_rom(4, {
+        0xA2, 0x01,       // $C000: LDX #$01
+        0x8E, 0x00, 0x80, // $C002: STX $8000
+        0x20, 0x00, 0x80, // $C005: JSR $8000
+        0xA2, 0x00,       // $C008: LDX #$00
+        0x8E, 0x00, 0x80, // $C00A: STX $8000
+        0x20, 0x00, 0x80, // $C00D: JSR $8000
+        0xA2, 0x01,       // $C010: LDX #$01
+        0x8E, 0x00, 0x80, // $C012: STX $8000
+        0x20, 0x00, 0x80, // $C015: JSR $8000
+        0x4C, 0x18, 0xC0, // $C018: JMP $C018
+    });
+    // Each bank increments a different counter from $8000.
+    for (uint8_t bank{0}; bank < 2; ++bank) {
+        auto const code = prg_rom.begin() + bank * 0x4000;
+        code[0] = 0xE6; // INC Zero Page
+        code[1] = 0x10 + bank;
+        code[2] = 0x60; // RTS
+    }
+    auto m = create_mem();
+    auto *bus = m.get();
+    bus->set_mapper(make_mapper(create_cartridge(2, std::move(prg_rom)), *bus,
+                                nullptr));
+    REQUIRE(bus->read(0x8003) == 0x00);
+    REQUIRE(bus->read(0xC000) == 0xA2);
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    cpu->setpp(0xC000);
+    cpu->run_until(200);
+    REQUIRE(!cpu->is_faulted());
+    REQUIRE(cpu->get_pp() == 0xC018);
+    REQUIRE(bus->read(0x0010) == 1);
+    REQUIRE(bus->read(0x0011) == 2);
+    REQUIRE(bus->read(0x8003) == 0x01);
+}
+
+TEST_CASE("MMC1 Serial Bank Switching", "[mapper]") {
+    auto prg_rom = create_prg_rom(8, {
+        0xA9, 0x05,       // $C000: LDA #$05
+        0x8D, 0x00, 0xE0, // $C002: STA $E000
+        0x4A,             // $C005: LSR A
+        0x8D, 0x00, 0xE0, // $C006: STA $E000
+        0x4A,             // $C009: LSR A
+        0x8D, 0x00, 0xE0, // $C00A: STA $E000
+        0x4A,             // $C00D: LSR A
+        0x8D, 0x00, 0xE0, // $C00E: STA $E000
+        0x4A,             // $C011: LSR A
+        0x8D, 0x00, 0xE0, // $C012: STA $E000
+        0xAD, 0x00, 0x80, // $C015: LDA $8000
+        0x4C, 0x18, 0xC0, // $C018: JMP $C018
+    });
+    auto m = create_mem();
+    auto *bus = m.get();
+    bus->set_mapper(make_mapper(create_cartridge(1, std::move(prg_rom)), *bus,
+                                nullptr));
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    cpu->setpp(0xC000);
+    // The fixed last bank is at $C000 at power on.
+    REQUIRE(bus->read(0xC100) == 7);
+    cpu->run_until(100);
+    REQUIRE(cpu->get_pp() == 0xC018);
+    REQUIRE(cpu->get_acc() == 5);
+}
+
+TEST_CASE("MMC3 Scanline IRQ", "[mapper]") {
+    auto prg_rom = create_prg_rom(4, {
+        0xA9, 0x05,       // $C000: LDA #$05
+        0x8D, 0x00, 0xC0, // $C002: STA $C000, latch
+        0x8D, 0x01, 0xC0, // $C005: STA $C001, reload
+        0x8D, 0x01, 0xE0, // $C008: STA $E001, enable
+        0x4C, 0x0B, 0xC0, // $C00B: JMP $C00B
+    });
+    // The IRQ handler in the fixed last 8 K.
+    auto const handler = prg_rom.end() - 0x2000;
+    handler[0] = 0xE8; // $E000: INX
+    handler[1] = 0x8D; // $E001: STA $E000, acknowledge
+    handler[2] = 0x00;
+    handler[3] = 0xE0;
+    handler[4] = 0x4C; // $E004: JMP $E004
+    handler[5] = 0x04;
+    handler[6] = 0xE0;
+    prg_rom.end()[-2] = 0x00;
+    prg_rom.end()[-1] = 0xE0;
+    auto m = create_mem();
+    auto *bus = m.get();
+    bus->set_mapper(make_mapper(create_cartridge(4, std::move(prg_rom)), *bus,
+                                nullptr));
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    // $C000 holds the second last 8 K, the first at power on.
+    cpu->setpp(0xC000);
+
+    // The counter is reloaded on the pre-render line of the first frame
+    // and reaches zero five visible lines later.
+    uint64_t const irq_cycle = (20 * 341 + 259 + 5 * 341) / 3;
+    cpu->run_until(irq_cycle);
+    REQUIRE(cpu->get_x() == 0);
+    cpu->run_until(irq_cycle + 20);
+    REQUIRE(cpu->get_x() == 1);
+    REQUIRE(cpu->get_pp() == 0xE004);
+    REQUIRE(bus->scheduler().pending() == 0);
+}
+
+TEST_CASE("Events Scheduled Mid-Block", "[events]") {
+    // Enabling the IRQ with a zero latch schedules it for the next counter
+    // clock, less than a line away, while the block of increments after it
+    // takes longer than a line.
+    std::vector<uint8_t> code{
+        0xA9, 0x00,       // $C000: LDA #$00
+        0x8D, 0x00, 0xC0, // $C002: STA $C000, latch
+        0x8D, 0x01, 0xC0, // $C005: STA $C001, reload
+        0x8D, 0x01, 0xE0, // $C008: STA $E001, enable
+    };
+    for (int i{0}; i < 25; ++i) {
+        code.insert(code.end(), {0xE6, 0x10}); // INC $10
+    }
+    code.insert(code.end(), {0x4C, 0x3D, 0xC0}); // $C03D: JMP $C03D
+    code.insert(code.end(), {0x4C, 0x40, 0xC0}); // $C040: JMP $C040
+    auto prg_rom = create_prg_rom(4, code);
+    // The IRQ handler in the fixed last 8 K keeps the count.
+    auto const handler = prg_rom.end() - 0x2000;
+    handler[0] = 0xA5; // $E000: LDA $10
+    handler[1] = 0x10;
+    handler[2] = 0x85; // $E002: STA $11
+    handler[3] = 0x11;
+    handler[4] = 0x4C; // $E004: JMP $E004
+    handler[5] = 0x04;
+    handler[6] = 0xE0;
+    prg_rom.end()[-2] = 0x00;
+    prg_rom.end()[-1] = 0xE0;
+    auto const create_cpu = [&prg_rom](memory_bus *&bus) {
+        auto m = create_mem();
+        bus = m.get();
+        bus->set_mapper(
+            make_mapper(create_cartridge(4, prg_rom), *bus, nullptr));
+        auto cpu = std::make_unique<core6502>(std::move(m));
+        // Wait until the middle of a frame first.
+        cpu->setpp(0xC040);
+        cpu->run_until(frame_end_cycle(2) + 100 * 341 / 3);
+        cpu->setpp(0xC000);
+        return cpu;
+    };
+    memory_bus *stepped_bus{};
+    auto stepped = create_cpu(stepped_bus);
+    memory_bus *blocks_bus{};
+    auto blocks = create_cpu(blocks_bus);
+    uint64_t const end = blocks->get_cycles() + 400;
+    while (stepped->get_cycles() < end) {
+        stepped->cycle();
+    }
+    blocks->run_until(end);
+    REQUIRE(blocks->get_pp() == 0xE004);
+    REQUIRE(stepped_bus->read(0x11) < 25);
+    REQUIRE(blocks_bus->read(0x11) == stepped_bus->read(0x11));
+}
+
+TEST_CASE("iNES Header", "[rom]") {
+    std::array<uint8_t, 16> header{'N', 'E', 'S', 0x1A, 2, 1, 0x41, 0x00};
+    auto h = parse_header(header);
+    REQUIRE(!h.nes2);
+    REQUIRE(h.mapper == 4);
+    REQUIRE(h.prg_rom_size == 0x8000);
+    REQUIRE(h.chr_rom_size == 0x2000);
+    REQUIRE(h.chr_ram_size == 0);
+    REQUIRE(h.nametable_mirroring == mirroring::vertical);
+
+    // Garbage after byte 7 leaves only the low nibble of the mapper.
+    std::copy_n("DiskDude!", 9, header.begin() + 7);
+    REQUIRE(parse_header(header).mapper == 4);
+
+    header[3] = 0;
+    REQUIRE_THROWS(parse_header(header));
+}
+
+TEST_CASE("NES 2.0 Header", "[rom]") {
+    std::array<uint8_t, 16> header{'N', 'E', 'S', 0x1A, 0x02, 0x00,
+                                   0x12, 0x48, 0x31, 0x01, 0x70, 0x07};
+    auto h = parse_header(header);
+    REQUIRE(h.nes2);
+    REQUIRE(h.mapper == 0x141);
+    REQUIRE(h.submapper == 3);
+    REQUIRE(h.battery);
+    REQUIRE(h.prg_rom_size == 0x102 * 0x4000);
+    REQUIRE(h.chr_rom_size == 0);
+    REQUIRE(h.prg_ram_size == 0);
+    REQUIRE(h.prg_nvram_size == 0x2000);
+    REQUIRE(h.chr_ram_size == 0x2000);
+    // Exponent-multiplier notation, 2^4 * 3.
+    header[5] = 0x11;
+    header[9] = 0xF1;
+    REQUIRE(parse_header(header).chr_rom_size == 48);
+}
+
+TEST_CASE("Load Mapped ROM File", "[rom]") {
+    auto const filename =
+        std::filesystem::temp_directory_path() / "struts_test.nes";
+    auto const write_file = [&filename](std::array<uint8_t, 16> header,
+                                        std::vector<uint8_t> contents) {
+        std::ofstream file{filename, std::ios::binary};
+        file.write(reinterpret_cast<char const *>(header.data()),
+                   header.size());
+        file.write(reinterpret_cast<char const *>(contents.data()),
+                   contents.size());
+    };
+    // Exponent-multiplier sizes too small for a bank, 2^4 * 3 bytes of PRG
+    // ROM, then of CHR ROM.
+    for (auto const &[prg_rom_size, chr_rom_size] :
+         {std::pair{0x11, 0x00}, std::pair{0x01, 0x11}}) {
+        write_file({'N', 'E', 'S', 0x1A, static_cast<uint8_t>(prg_rom_size),
+                    static_cast<uint8_t>(chr_rom_size), 0x00, 0x08, 0x00,
+                    static_cast<uint8_t>(chr_rom_size ? 0xF0 : 0x0F)},
+                   std::vector<uint8_t>(0x4000 + 48));
+        auto events = std::make_shared<event_scheduler>();
+        auto ppu = std::make_shared<picture_processing_unit>(events);
+        memory_bus bus{ppu, nullptr, nullptr, events};
+        REQUIRE_THROWS(load_rom(filename, *ppu, bus));
+    }
+
+    write_file({'N', 'E', 'S', 0x1A, 1, 0, 0x21},
+               create_prg_rom(1, {0xA9, 0x42})); // LDA #$42
+    auto const rom = open_rom(filename);
+    REQUIRE(rom->data().size() == 16 + 0x4000);
+    // Instances share the mapping.
+    REQUIRE(open_rom(filename) == rom);
+
+    auto events = std::make_shared<event_scheduler>();
+    auto ppu = std::make_shared<picture_processing_unit>(events);
+    memory_bus bus{ppu, nullptr, nullptr, events};
+    load_rom(filename, *ppu, bus);
+    // The single 16 K bank is mirrored, without copying.
+    REQUIRE(bus.read_data(0x8000) == rom->data().data() + 16);
+    REQUIRE(bus.read_data(0xC000) == rom->data().data() + 16);
+    REQUIRE(bus.read(0xC001) == 0x42);
+    std::filesystem::remove(filename);
+}
+
+TEST_CASE("Scanline Rendering", "[ppu]") {
+    auto events = std::make_shared<event_scheduler>();
+    picture_processing_unit ppu{events};
+    // Background tile 1 is solid colour 1, sprite tile 2 solid colour 2.
+    std::array<uint8_t, 0x2000> chr{};
+    std::fill_n(chr.begin() + 0x1000 + 1 * 16, 8, 0xFF);
+    std::fill_n(chr.begin() + 2 * 16 + 8, 8, 0xFF);
+    ppu.map_chr(0x0000, chr.data(), chr.size());
+    write_ppu(ppu, 0x3F00, {0x0F, 0x01});
+    write_ppu(ppu, 0x3F12, {0x22});
+    // With vertical mirroring $2400 is right of $2000.
+    write_ppu(ppu, 0x2001, {0x01});
+    write_ppu(ppu, 0x2400, {0x01});
+    // Nine sprites on line 20.
+    std::array<uint8_t, 0x100> oam{};
+    std::fill(oam.begin(), oam.end(), 0xFF);
+    for (uint8_t i{0}; i < 9; ++i) {
+        oam[i * 4 + 0] = 19;
+        oam[i * 4 + 1] = 2;
+        oam[i * 4 + 2] = 0;
+        oam[i * 4 + 3] = 10 * i;
+    }
+    ppu.dma_copy(oam);
+    ppu.set_PPUCTRL(0x10);
+    ppu.set_PPUMASK(0x1E);
+    ppu.write_PPUSCROLL(4);
+    ppu.write_PPUSCROLL(0);
+
+    ppu.render_frame();
+    auto const frame = ppu.frame_buffer();
+    auto const pixel = [&frame](int x, int y) {
+        return frame[y * picture_processing_unit::screen_width + x];
+    };
+    REQUIRE(pixel(3, 0) == 0x0F);
+    REQUIRE(pixel(4, 0) == 0x01);
+    REQUIRE(pixel(11, 7) == 0x01);
+    REQUIRE(pixel(12, 0) == 0x0F);
+    REQUIRE(pixel(4, 8) == 0x0F);
+    // Scrolled in from the next nametable.
+    REQUIRE(pixel(251, 0) == 0x0F);
+    REQUIRE(pixel(252, 0) == 0x01);
+    // Only the first 8 sprites are drawn.
+    REQUIRE(pixel(0, 19) == 0x0F);
+    REQUIRE(pixel(0, 20) == 0x22);
+    REQUIRE(pixel(77, 27) == 0x22);
+    REQUIRE(pixel(80, 20) == 0x0F);
+    REQUIRE(pixel(0, 28) == 0x0F);
+}
+
+TEST_CASE("Lazy PPU Catch-Up", "[ppu]") {
+    auto events = std::make_shared<event_scheduler>();
+    uint64_t cycles{0};
+    events->set_clock(&cycles);
+    auto ppu = std::make_shared<picture_processing_unit>(events);
+    // Tile 1 is solid colour 1 in both pattern tables.
+    std::array<uint8_t, 0x2000> chr{};
+    std::fill_n(chr.begin() + 1 * 16, 8, 0xFF);
+    std::fill_n(chr.begin() + 0x1000 + 1 * 16, 8, 0xFF);
+    ppu->map_chr(0x0000, chr.data(), chr.size());
+    write_ppu(*ppu, 0x3F00, {0x0F, 0x01});
+    // Column 2 of the first nametable.
+    for (uint16_t row{0}; row < 30; ++row) {
+        write_ppu(*ppu, 0x2002 + row * 32, {0x01});
+    }
+    // Sprite 0 over the column on line 100.
+    std::array<uint8_t, 0x100> oam{};
+    std::fill(oam.begin(), oam.end(), 0xFF);
+    oam[0] = 99;
+    oam[1] = 1;
+    oam[2] = 0;
+    oam[3] = 4;
+    ppu->dma_copy(oam);
+    ppu->set_PPUCTRL(0x10);
+    ppu->set_PPUMASK(0x1E);
+
+    // Dot of a pixel of the first frame, counted from power on.
+    auto const cycle_at = [](int line, int x) {
+        return static_cast<uint64_t>((21 + line) * 341 + x) / 3;
+    };
+    // Scrolled by 8 from line 50.
+    cycles = cycle_at(50, 0);
+    ppu->write_PPUSCROLL(8);
+    ppu->write_PPUSCROLL(0);
+
+    // The pre-render line is due first.
+    REQUIRE(events->next_event() == 20 * 341 / 3 + 1);
+    events->run_due(cycles);
+
+    // Sprite 0 hit is scheduled for the first pixel of the sprite, then for
+    // the first pixel overlapping the background. Pixels are rendered once
+    // the dot is past them.
+    REQUIRE(events->next_event() == cycle_at(100, 4 + 3));
+    cycles = events->next_event();
+    events->run_due(cycles);
+    uint64_t const hit_cycle = cycle_at(100, 8 + 3);
+    REQUIRE(events->next_event() == hit_cycle);
+    cycles = hit_cycle - 1;
+    REQUIRE((ppu->read_PPUSTATUS() & 0x40) == 0);
+    cycles = hit_cycle;
+    events->run_due(cycles);
+    REQUIRE((ppu->read_PPUSTATUS() & 0x40) == 0x40);
+
+    // Vblank finishes the frame.
+    cycles = frame_end_cycle(1);
+    events->run_due(cycles);
+    auto const frame = ppu->frame_buffer();
+    auto const pixel = [&frame](int x, int y) {
+        return frame[y * picture_processing_unit::screen_width + x];
+    };
+    REQUIRE(pixel(16, 49) == 0x01);
+    REQUIRE(pixel(8, 49) == 0x0F);
+    REQUIRE(pixel(16, 50) == 0x0F);
+    REQUIRE(pixel(8, 50) == 0x01);
+    REQUIRE(pixel(8, 239) == 0x01);
+    // Cleared on the pre-render line.
+    cycles = frame_end_cycle(1) + 20 * 341 / 3 + 1;
+    REQUIRE(ppu->read_PPUSTATUS() == 0x00);
+}
+
+TEST_CASE("Polling Sprite 0 Hit", "[ppu]") {
+    auto events = std::make_shared<event_scheduler>();
+    auto ppu = std::make_shared<picture_processing_unit>(events);
+    std::array<uint8_t, 0x2000> chr{};
+    std::fill_n(chr.begin() + 0x1000, 8, 0xFF);
+    std::fill_n(chr.begin(), 8, 0xFF);
+    ppu->map_chr(0x0000, chr.data(), chr.size());
+    // Tile 0 everywhere, sprite 0 on line 200.
+    std::array<uint8_t, 0x100> oam{};
+    oam[0] = 199;
+    oam[3] = 100;
+    ppu->dma_copy(oam);
+    ppu->set_PPUCTRL(0x10);
+    ppu->set_PPUMASK(0x1E);
+    auto m = std::make_unique<memory_bus>(ppu, nullptr, nullptr, events);
+    m->load_rom(0x8000, 0x2C); // BIT Absolute
+    m->load_rom(0x8001, 0x02);
+    m->load_rom(0x8002, 0x20);
+    m->load_rom(0x8003, 0x50); // BVC $8000
+    m->load_rom(0x8004, 0xFB);
+    m->load_rom(0x8005, 0xE8); // INX
+    m->load_rom(0x8006, 0x4C); // JMP $8006
+    m->load_rom(0x8007, 0x06);
+    m->load_rom(0x8008, 0x80);
+    auto cpu = std::make_unique<core6502>(std::move(m));
+    cpu->setpp(0x8000);
+    // Skipping the idle loop stops at the hit.
+    uint64_t const hit_cycle = ((21 + 200) * 341 + 100 + 3) / 3;
+    cpu->run_until(hit_cycle - 10);
+    REQUIRE(cpu->get_x() == 0);
+    cpu->run_until(hit_cycle + 20);
+    REQUIRE(cpu->get_x() == 1);
+    REQUIRE(cpu->take_skipped_cycles() > 0);
+}
+
+TEST_CASE("Polling Sprite 0 Clear", "[ppu]") {
+    // Waits for the hit, then for the pre-render line to clear it, as in
+    // Super Mario Bros.
+    auto const create_cpu = [](std::shared_ptr<event_scheduler> events) {
+        auto ppu = std::make_shared<picture_processing_unit>(events);
+        static std::array<uint8_t, 0x2000> chr{};
+        std::fill_n(chr.begin() + 0x1000, 8, 0xFF);
+        std::fill_n(chr.begin(), 8, 0xFF);
+        ppu->map_chr(0x0000, chr.data(), chr.size());
+        std::array<uint8_t, 0x100> oam{};
+        oam[0] = 199;
+        oam[3] = 100;
+        ppu->dma_copy(oam);
+        ppu->set_PPUCTRL(0x10);
+        ppu->set_PPUMASK(0x1E);
+        auto m = std::make_unique<memory_bus>(ppu, nullptr, nullptr, events);
+        m->load_rom(0x8000, 0x2C); // BIT Absolute
+        m->load_rom(0x8001, 0x02);
+        m->load_rom(0x8002, 0x20);
+        m->load_rom(0x8003, 0x50); // BVC $8000
+        m->load_rom(0x8004, 0xFB);
+        m->load_rom(0x8005, 0xAD); // LDA Absolute
+        m->load_rom(0x8006, 0x02);
+        m->load_rom(0x8007, 0x20);
+        m->load_rom(0x8008, 0x29); // AND #$40
+        m->load_rom(0x8009, 0x40);
+        m->load_rom(0x800A, 0xD0); // BNE $8005
+        m->load_rom(0x800B, 0xF9);
+        m->load_rom(0x800C, 0xE8); // INX
+        m->load_rom(0x800D, 0x4C); // JMP $800D
+        m->load_rom(0x800E, 0x0D);
+        m->load_rom(0x800F, 0x80);
+        auto cpu = std::make_unique<core6502>(std::move(m));
+        cpu->setpp(0x8000);
+        return cpu;
+    };
+    auto interpreted = create_cpu(std::make_shared<event_scheduler>());
+    interpreted->set_idle_loop_skipping(false);
+    auto skipping = create_cpu(std::make_shared<event_scheduler>());
+    // Long runs, so only events bound the skipped iterations. Line 100 of
+    // the second frame is after the pre-render line but before the next
+    // sprite 0 hit.
+    uint64_t const line_100 = frame_end_cycle(1) + (21 + 100) * 341 / 3;
+    for (auto const &[cycle, x] : {std::pair{frame_end_cycle(1), 0},
+                                   std::pair{line_100, 1},
+                                   std::pair{frame_end_cycle(2), 1}}) {
+        interpreted->run_until(cycle);
+        skipping->run_until(cycle);
+        REQUIRE(skipping->get_cycles() == interpreted->get_cycles());
+        REQUIRE(skipping->dump_state() == interpreted->dump_state());
+        REQUIRE(skipping->get_x() == x);
+    }
+    REQUIRE(skipping->take_skipped_cycles() > 0);
+}
+
+TEST_CASE("CHR Tile Cache", "[ppu]") {
+    std::array<uint8_t, 0x2000> chr{};
+    std::array<uint8_t const *, 8> banks{};
+    for (std::size_t i{0}; i < banks.size(); ++i) {
+        banks[i] = chr.data() + i * 0x400;
+    }
+    // Row 0 of tile 0x41: 0, 1, 2, 3, 0, 0, 0, 3 from the left.
+    chr[0x410] = 0b0101'0001;
+    chr[0x418] = 0b0011'0001;
+    tile_cache tiles{banks};
+    REQUIRE(tiles.get(0x41).rows[0] == 0x0300000003020100);
+    REQUIRE(tiles.get(0x41).flipped_rows[0] == 0x0001020300000003);
+    chr[0x410] = 0x00;
+    REQUIRE(tiles.get(0x41).rows[0] == 0x0300000003020100);
+    tiles.invalidate(0x41);
+    REQUIRE(tiles.get(0x41).rows[0] == 0x0200000002020000);
+
+    // Writing CHR RAM through PPUDATA updates the rendered tile.
+    auto events = std::make_shared<event_scheduler>();
+    picture_processing_unit ppu{events};
+    ppu.map_chr_ram(0x0000, chr.data(), chr.size());
+    ppu.set_PPUMASK(0x0A);
+    ppu.write_PPUADDR(0x3F);
+    ppu.write_PPUADDR(0x00);
+    ppu.write_PPUDATA(std::vector<uint8_t>{0x0F, 0x01, 0x02, 0x03});
+    ppu.render_frame();
+    REQUIRE(ppu.frame_buffer()[0] == 0x0F);
+    ppu.write_PPUADDR(0x00);
+    ppu.write_PPUADDR(0x00);
+    ppu.write_PPUDATA(0x80);
+    ppu.render_frame();
+    REQUIRE(ppu.frame_buffer()[0] == 0x01);
+    REQUIRE(ppu.frame_buffer()[1] == 0x0F);
+}
+
+TEST_CASE("Scanline Compositor", "[ppu]") {
+    std::vector<compositor> compositors{&composite_scalar};
+#if defined(__x86_64__) || defined(__i386__)
+    compositors.push_back(&composite_sse2);
+    if (__builtin_cpu_supports("avx2"))
+        compositors.push_back(&composite_avx2);
+#endif
+    for (auto const composite : compositors) {
+        std::array<uint8_t, 256> background{};
+        std::array<uint8_t, 256> sprites{};
+        std::array<uint8_t, 256> out{};
+        scanline_layers layers{background.data(), sprites.data()};
+        // Opaque sprites in front, behind only on transparent background.
+        background[100] = 0x05;
+        sprites[100] = 0x11;
+        background[101] = 0x05;
+        sprites[101] = 0x91;
+        sprites[102] = 0x92;
+        background[103] = 0x07;
+        sprites[103] = 0x10;
+        REQUIRE(composite(layers, out.data(), 0, 256) == -1);
+        REQUIRE(out[100] == 0x11);
+        REQUIRE(out[101] == 0x05);
+        REQUIRE(out[102] == 0x12);
+        REQUIRE(out[103] == 0x07);
+        REQUIRE(out[104] == 0x00);
+        // Sprite 0 hits even behind the background, but not at x 255 or
+        // where PPUMASK hides a layer.
+        background[255] = 0x01;
+        sprites[255] = 0x51;
+        REQUIRE(composite(layers, out.data(), 0, 256) == -1);
+        sprites[101] = 0xD1;
+        REQUIRE(composite(layers, out.data(), 0, 256) == 101);
+        REQUIRE(composite(layers, out.data(), 102, 256) == -1);
+        background[3] = 0x01;
+        sprites[3] = 0x41;
+        REQUIRE(composite(layers, out.data(), 0, 256) == 3);
+        layers.show_sprites_left = false;
+        REQUIRE(composite(layers, out.data(), 0, 256) == 101);
+        REQUIRE(out[3] == 0x01);
+    }
+
+    // The vector versions match the reference on random lines.
+    std::array<uint8_t, 256> background{};
+    std::array<uint8_t, 256> sprites{};
+    scanline_layers layers{background.data(), sprites.data()};
+    uint32_t seed{12345};
+    auto const random = [&seed] {
+        seed = seed * 1103515245 + 12345;
+        return seed >> 16;
+    };
+    for (int i{0}; i < 200; ++i) {
+        // Sprite 0 pixels get rarer so hits land anywhere on the line.
+        for (std::size_t x{0}; x < background.size(); ++x) {
+            background[x] = random() % 4 == 0 ? 0 : random() & 0x0F;
+            sprites[x] = random() % 2 == 0 ? 0 : random() & 0x9F;
+            if (random() % 256 < static_cast<unsigned>(i))
+                sprites[x] |= 0x40;
+        }
+        layers.show_background_left = random() & 1;
+        layers.show_sprites_left = random() & 1;
+        int const begin = random() % 40;
+        int const end = i % 2 ? 256 : 200 + random() % 56;
+        std::array<uint8_t, 256> expected{};
+        int const expected_hit =
+            composite_scalar(layers, expected.data(), begin, end);
+        for (auto const composite : compositors) {
+            std::array<uint8_t, 256> out{};
+            REQUIRE(composite(layers, out.data(), begin, end) == expected_hit);
+            REQUIRE(out == expected);
+        }
+    }
+}
+
+TEST_CASE("Dirty Tile Rendering", "[ppu]") {
+    auto events = std::make_shared<event_scheduler>();
+    uint64_t cycles{0};
+    events->set_clock(&cycles);
+    auto ppu = std::make_shared<picture_processing_unit>(events);
+    // Tile 1 is solid colour 1.
+    std::vector<uint8_t> chr(0x2000);
+    std::fill_n(chr.begin() + 1 * 16, 8, 0xFF);
+    ppu->map_chr_ram(0x0000, chr.data(), static_cast<uint16_t>(chr.size()));
+    write_ppu(*ppu, 0x3F00, {0x0F, 0x01, 0x02, 0x03, 0x0F, 0x11});
+    ppu->set_PPUMASK(0x0A);
+    int64_t frame{0};
+    auto const next_frame = [&] {
+        cycles = frame_end_cycle(++frame);
+        events->run_due(cycles);
+        return ppu->last_frame_stats();
+    };
+    auto const pixel = [&ppu](int x, int y) {
+        return ppu->frame_buffer()[y * picture_processing_unit::screen_width +
+                                   x];
+    };
+
+    auto stats = next_frame();
+    REQUIRE(stats.tiles_redrawn == 2 * 32 * 30);
+    REQUIRE(stats.lines_rendered == 240);
+    stats = next_frame();
+    REQUIRE(stats.tiles_redrawn == 0);
+    REQUIRE(stats.lines_rendered == 0);
+    // Writing the same value changes nothing.
+    write_ppu(*ppu, 0x2021, {0x00});
+    REQUIRE(next_frame().lines_rendered == 0);
+
+    // Only the lines of the tile are rendered again.
+    write_ppu(*ppu, 0x2021, {0x01});
+    stats = next_frame();
+    REQUIRE(stats.tiles_redrawn == 1);
+    REQUIRE(stats.lines_rendered == 8);
+    REQUIRE(pixel(8, 8) == 0x01);
+    REQUIRE(pixel(16, 8) == 0x0F);
+
+    // Palette 1 for the top left 2 x 2 tiles.
+    write_ppu(*ppu, 0x23C0, {0x01});
+    REQUIRE(next_frame().tiles_redrawn == 16);
+    REQUIRE(pixel(8, 8) == 0x11);
+
+    // Only where the pattern is used.
+    write_ppu(*ppu, 0x0010, {0x00});
+    REQUIRE(next_frame().tiles_redrawn == 1);
+    REQUIRE(pixel(8, 8) == 0x0F);
+    REQUIRE(pixel(8, 9) == 0x11);
+
+    // Scrolling and palette changes only compose lines again.
+    ppu->write_PPUSCROLL(8);
+    ppu->write_PPUSCROLL(0);
+    stats = next_frame();
+    REQUIRE(stats.tiles_redrawn == 0);
+    REQUIRE(stats.lines_rendered == 240);
+    REQUIRE(pixel(0, 9) == 0x11);
+    write_ppu(*ppu, 0x3F05, {0x21});
+    REQUIRE(next_frame().tiles_redrawn == 0);
+    REQUIRE(pixel(0, 9) == 0x21);
+
+    // The other pattern table redraws everything.
+    ppu->set_PPUCTRL(0x10);
+    REQUIRE(next_frame().tiles_redrawn == 2 * 32 * 30);
+    REQUIRE(pixel(0, 9) == 0x0F);
+}
+
+TEST_CASE("Palette Colours", "[ppu]") {
+    REQUIRE(to_argb(0x30, 0x00) == 0xFFFCFCFC);
+    // Greyscale keeps the brightness column.
+    REQUIRE(to_argb(0x16, 0x01) == to_argb(0x10, 0x00));
+    // Emphasising red darkens green and blue.
+    REQUIRE(to_argb(0x30, 0x20) == 0xFFFCCCCC);
+    REQUIRE(to_argb(0x30, 0xE0) == 0xFFA5A5A5);
+
+    auto events = std::make_shared<event_scheduler>();
+    auto ppu = std::make_shared<picture_processing_unit>(events);
+    auto const backdrop = [&] {
+        ppu->render_frame();
+        return std::pair{ppu->frame_buffer()[0], ppu->argb_frame_buffer()[0]};
+    };
+    write_ppu(*ppu, 0x3F00, {0x16});
+    REQUIRE(backdrop() == std::pair<uint8_t, uint32_t>{0x16, to_argb(0x16, 0)});
+    // $3F10 mirrors $3F00, so does $3F30.
+    write_ppu(*ppu, 0x3F10, {0x2A});
+    REQUIRE(backdrop() == std::pair<uint8_t, uint32_t>{0x2A, to_argb(0x2A, 0)});
+    write_ppu(*ppu, 0x3F30, {0x21});
+    REQUIRE(backdrop() == std::pair<uint8_t, uint32_t>{0x21, to_argb(0x21, 0)});
+    ppu->set_PPUMASK(0x41);
+    REQUIRE(backdrop() ==
+            std::pair<uint8_t, uint32_t>{0x20, to_argb(0x21, 0x41)});
+}
+
+TEST_CASE("Headless Sinks", "[ppu]") {
+    auto events = std::make_shared<event_scheduler>();
+    auto video = std::make_shared<offscreen_video_sink>();
+    auto ppu = std::make_shared<picture_processing_unit>(events, video);
+    ppu->write_PPUADDR(0x3F);
+    ppu->write_PPUADDR(0x00);
+    ppu->write_PPUDATA(0x21);
+    ppu->render_frame();
+    ppu->draw();
+    REQUIRE(video->frame_count() == 1);
+    REQUIRE(video->width() == picture_processing_unit::screen_width);
+    REQUIRE(video->frame().size() == 256 * 240);
+    REQUIRE(video->frame()[256 * 240 - 1] == to_argb(0x21, 0x00));
+
+    auto audio = std::make_shared<buffer_audio_sink>(48000);
+    audio_processing_unit apu{events, audio};
+    apu.play_audio();
+    apu.play_audio();
+    REQUIRE(audio->samples().size() == 2 * 800);
+
+    auto const filename =
+        std::filesystem::temp_directory_path() / "struts_test.ppm";
+    {
+        ppm_video_sink ppm{filename};
+        ppm.present(std::array<uint32_t, 2>{0xFF102030, 0xFF405060}, 1);
+    }
+    std::ifstream file{filename, std::ios::binary};
+    std::string const contents{std::istreambuf_iterator<char>{file}, {}};
+    REQUIRE(contents == "P6\n1 2\n255\n\x10\x20\x30\x40\x50\x60");
+    std::filesystem::remove(filename);
+}
+
+TEST_CASE("Upscalers", "[gfx]") {
+    constexpr uint32_t w{0xFFFFFFFF};
+    constexpr uint32_t k{0xFF000000};
+    std::array<uint32_t, 4> const frame{w, k, k, k};
+    auto const scale = [&frame](upscale_filter filter, simd_level level) {
+        std::vector<uint32_t> out(frame.size() * 4);
+        find_upscaler(filter, level)(frame.data(), 2, 2, out.data());
+        return out;
+    };
+    REQUIRE(scale(upscale_filter::nearest2x, simd_level::scalar) ==
+            std::vector<uint32_t>{w, w, k, k, w, w, k, k, //
+                                  k, k, k, k, k, k, k, k});
+    // The corner facing the black pixels is cut off.
+    REQUIRE(scale(upscale_filter::scale2x, simd_level::scalar) ==
+            std::vector<uint32_t>{w, w, k, k, w, k, k, k, //
+                                  k, k, k, k, k, k, k, k});
+    REQUIRE(scale(upscale_filter::edge2x, simd_level::scalar) ==
+            std::vector<uint32_t>{w, w, k, k, w, 0xFF808080, k, k, //
+                                  k, k, k, k, k, k, k, k});
+
+    // SIMD versions match, on sizes that leave pixels over at line ends.
+    std::mt19937 random{7};
+    for (auto const &[width, height] : {std::pair{1, 1}, std::pair{3, 2},
+                                       std::pair{13, 5}, std::pair{37, 9},
+                                       std::pair{256, 16}}) {
+        std::vector<uint32_t> in(width * height);
+        for (auto &pixel : in) {
+            pixel = to_argb(static_cast<uint8_t>(random() % 3 * 16), 0);
+        }
+        for (int i{0}; i < static_cast<int>(upscale_filter::count); ++i) {
+            auto const filter = static_cast<upscale_filter>(i);
+            int const factor = upscale_factor(filter);
+            std::vector<uint32_t> expected(in.size() * factor * factor);
+            find_upscaler(filter, simd_level::scalar)(in.data(), width, height,
+                                                      expected.data());
+            for (int level{1}; level <= static_cast<int>(host_simd_level);
+                 ++level) {
+                std::vector<uint32_t> out(expected.size());
+                find_upscaler(filter, static_cast<simd_level>(level))(
+                    in.data(), width, height, out.data());
+                REQUIRE(out == expected);
+            }
+        }
+    }
+
+    auto offscreen = std::make_shared<offscreen_video_sink>();
+    upscaling_video_sink upscaling{upscale_filter::scale3x, offscreen};
+    upscaling.present(frame, 2);
+    REQUIRE(offscreen->width() == 6);
+    REQUIRE(offscreen->frame().size() == 36);
+}
+
+TEST_CASE("NTSC Filter", "[gfx]") {
+    constexpr int width{16};
+    constexpr int height{2};
+    std::array<uint8_t, height> emphasis{};
+    ntsc_filter filter{simd_level::scalar};
+    auto const flat = [&](uint8_t colour, int64_t frame) {
+        std::array<uint8_t, width * height> colours{};
+        colours.fill(colour);
+        std::vector<uint32_t> out(colours.size() * 4);
+        filter.filter(colours, emphasis, width, frame, out.data());
+        return out;
+    };
+    auto const channels = [](uint32_t argb) {
+        return std::array<int, 3>{static_cast<int>(argb >> 16 & 0xFF),
+                                  static_cast<int>(argb >> 8 & 0xFF),
+                                  static_cast<int>(argb & 0xFF)};
+    };
+    // Away from the black beyond the edges, flat areas decode to their
+    // colour, lines are doubled.
+    auto const black = flat(0x0F, 0);
+    REQUIRE(std::all_of(black.begin(), black.end(),
+                        [](uint32_t argb) { return argb == 0xFF000000; }));
+    auto const white = flat(0x30, 0);
+    for (auto const channel : channels(white[2 * width / 2])) {
+        REQUIRE(channel >= 0xF0);
+    }
+    REQUIRE(white[2 * width / 2] == white[2 * width + 2 * width / 2]);
+    auto const [red, green, blue] = channels(flat(0x16, 0)[width]);
+    REQUIRE(red > 2 * green);
+    REQUIRE(red > 2 * blue);
+    emphasis.fill(0x04);
+    auto const [white_red, white_green, white_blue] =
+        channels(flat(0x30, 0)[width]);
+    REQUIRE(white_blue > white_red + 0x20);
+    REQUIRE(white_blue > white_green + 0x20);
+    emphasis.fill(0x00);
+
+    // Fringes along edges change colour from frame to frame.
+    std::array<uint8_t, width * height> stripes{};
+    for (int x{0}; x < width; ++x) {
+        stripes[x] = stripes[width + x] = x % 4 < 2 ? 0x30 : 0x0F;
+    }
+    std::vector<uint32_t> even(stripes.size() * 4);
+    std::vector<uint32_t> odd(even.size());
+    filter.filter(stripes, emphasis, width, 0, even.data());
+    filter.filter(stripes, emphasis, width, 1, odd.data());
+    REQUIRE(even != odd);
+
+    // SIMD versions match, on sizes that leave pixels over at line ends.
+    std::mt19937 random{11};
+    for (int const size : {1, 3, 13, 37, 256}) {
+        std::vector<uint8_t> colours(size * 3);
+        for (auto &colour : colours) {
+            colour = static_cast<uint8_t>(random() % 64);
+        }
+        std::array<uint8_t, 3> const line_emphasis{0, 5, 7};
+        std::vector<uint32_t> expected(colours.size() * 4);
+        filter.filter(colours, line_emphasis, size, 1, expected.data());
+        for (int level{1}; level <= static_cast<int>(host_simd_level);
+             ++level) {
+            ntsc_filter simd{static_cast<simd_level>(level)};
+            std::vector<uint32_t> out(expected.size());
+            simd.filter(colours, line_emphasis, size, 1, out.data());
+            REQUIRE(out == expected);
+        }
+    }
+
+    // The PPU presents colours to the sink, the debug view stays ARGB.
+    auto events = std::make_shared<event_scheduler>();
+    auto offscreen = std::make_shared<offscreen_video_sink>();
+    picture_processing_unit ppu{events,
+                                std::make_shared<ntsc_video_sink>(offscreen)};
+    ppu.set_PPUMASK(0x20);
+    ppu.render_frame();
+    ppu.draw();
+    REQUIRE(offscreen->width() == 2 * picture_processing_unit::screen_width);
+    REQUIRE(offscreen->frame().size() == 4 * 256 * 240);
+    ppu.draw_debug();
+    REQUIRE(offscreen->width() == 674);
+}
+
+TEST_CASE("Frame Exchange", "[gfx]") {
+    auto offscreen = std::make_shared<offscreen_video_sink>();
+    frame_exchange exchange{offscreen};
+    REQUIRE_FALSE(exchange.wants_colours());
+    exchange.present(std::array<uint32_t, 2>{1, 1}, 2);
+    REQUIRE(exchange.present_next());
+    REQUIRE(offscreen->frame()[0] == 1);
+    // The newest frame is presented, the one before it dropped.
+    exchange.present(std::array<uint32_t, 2>{2, 2}, 2);
+    exchange.present(std::array<uint32_t, 2>{3, 3}, 2);
+    REQUIRE(exchange.present_next());
+    REQUIRE(offscreen->frame()[0] == 3);
+    REQUIRE(offscreen->frame_count() == 2);
+    REQUIRE(exchange.stalls().dropped == 1);
+    exchange.close();
+    REQUIRE_FALSE(exchange.present_next());
+
+    // Colours pass through to sinks that take them.
+    frame_exchange ntsc{std::make_shared<ntsc_video_sink>(offscreen)};
+    REQUIRE(ntsc.wants_colours());
+    ntsc.present_colours(std::array<uint8_t, 4>{0x30, 0x30, 0x30, 0x30},
+                         std::array<uint8_t, 2>{}, 2);
+    ntsc.close();
+    REQUIRE(ntsc.present_next());
+    REQUIRE(offscreen->width() == 4);
+    REQUIRE_FALSE(ntsc.present_next());
+
+    // Between threads, frames arrive in order and none is torn, presented
+    // or dropped twice, and the last one is presented after closing.
+    struct checking_sink final : video_sink {
+        uint32_t last{};
+        int64_t frames{};
+        bool in_order{true};
+        void present(std::span<uint32_t const> frame, int) override {
+            in_order = in_order && frame.front() > last &&
+                       std::all_of(frame.begin(), frame.end(),
+                                   [&](uint32_t pixel) {
+                                       return pixel == frame.front();
+                                   });
+            last = frame.front();
+            ++frames;
+        }
+    };
+    auto checking = std::make_shared<checking_sink>();
+    frame_exchange threaded{checking};
+    constexpr uint32_t count{2000};
+    std::thread emulation{[&threaded] {
+        std::vector<uint32_t> frame(256 * 240);
+        for (uint32_t i{1}; i <= count; ++i) {
+            std::fill(frame.begin(), frame.end(), i);
+            threaded.present(frame, 256);
+        }
+        threaded.close();
+    }};
+    while (threaded.present_next()) {
+    }
+    emulation.join();
+    REQUIRE(checking->in_order);
+    REQUIRE(checking->last == count);
+    REQUIRE(checking->frames + threaded.stalls().dropped == count);
+}
@@ -0,0 +1,63 @@
+#include "tile_cache.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace {
+// Bit i of a bit plane to byte i, which puts the rightmost pixel first.
+constexpr auto spread_bits = [] {
+    std::array<uint64_t, 256> table{};
+    for (std::size_t val{0}; val < table.size(); ++val) {
+        for (int bit{0}; bit < 8; ++bit) {
+            table[val] |= static_cast<uint64_t>((val >> bit) & 0x01)
+                          << (bit * 8);
+        }
+    }
+    return table;
+}();
+
+void decode_generic(uint8_t const *planes, tile_cache::tile &t) {
+    for (int y{0}; y < 8; ++y) {
+        auto const flipped =
+            spread_bits[planes[y]] | spread_bits[planes[y + 8]] << 1;
+        t.flipped_rows[y] = flipped;
+        t.rows[y] = __builtin_bswap64(flipped);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Same with a bit deposit per plane instead of table lookups.
+__attribute__((target("bmi2"))) void decode_bmi2(uint8_t const *planes,
+                                                 tile_cache::tile &t) {
+    constexpr uint64_t low_bits{0x0101010101010101};
+    for (int y{0}; y < 8; ++y) {
+        auto const flipped = _pdep_u64(planes[y], low_bits) |
+                             _pdep_u64(planes[y + 8], low_bits << 1);
+        t.flipped_rows[y] = flipped;
+        t.rows[y] = __builtin_bswap64(flipped);
+    }
+}
+#endif
+
+using decoder = void (*)(uint8_t const *, tile_cache::tile &);
+decoder const decode_tile = [] {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("bmi2"))
+        return &decode_bmi2;
+#endif
+    return &decode_generic;
+}();
+} // namespace
+
+void tile_cache::invalidate_bank(uint16_t adr) {
+    std::size_t const first = (adr & 0x1C00) >> 4;
+    for (std::size_t i{first}; i < first + 0x40; ++i) {
+        valid[i] = false;
+    }
+}
+
+void tile_cache::decode(uint16_t index) {
+    decode_tile(banks[index >> 6] + (index & 0x3F) * 16, tiles[index]);
+    valid[index] = true;
+}
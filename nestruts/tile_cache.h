@@ -0,0 +1,42 @@
+#pragma once
+#include <array>
+#include <bit>
+#include <bitset>
+#include <cstdint>
+
+// Pattern table tiles expanded from two bit planes to one byte per pixel.
+// Tiles are decoded when first used after their pattern data changed, so
+// rendering reads whole pixel rows.
+class tile_cache final {
+  public:
+    // Eight pixel values of a tile row, 0-3 each, with the leftmost pixel in
+    // the lowest byte. Copied to memory as is, which needs a little endian
+    // host.
+    static_assert(std::endian::native == std::endian::little);
+    struct tile {
+        std::array<uint64_t, 8> rows{};
+        // Flipped horizontally.
+        std::array<uint64_t, 8> flipped_rows{};
+    };
+    static constexpr std::size_t tile_count{512};
+
+    // Decodes from the pattern tables in 1 K banks.
+    explicit tile_cache(std::array<uint8_t const *, 8> const &banks)
+        : banks{banks} {}
+
+    // Tile at pattern table address index * 16.
+    tile const &get(uint16_t index) {
+        if (!valid[index])
+            decode(index);
+        return tiles[index];
+    }
+    void invalidate(uint16_t index) { valid[index] = false; }
+    // All tiles of the 1 K bank of adr.
+    void invalidate_bank(uint16_t adr);
+
+  private:
+    std::array<uint8_t const *, 8> const &banks;
+    std::array<tile, tile_count> tiles{};
+    std::bitset<tile_count> valid{};
+    void decode(uint16_t index);
+};
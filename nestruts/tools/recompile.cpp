@@ -0,0 +1,320 @@
+// struts_recompile : Ahead-of-time recompiler for PRG ROM
+//
+// Disassembles the PRG ROM of an iNES file starting at the NMI, reset and
+// IRQ vectors and writes a C++ file with one function per discovered basic
+// block. Each function runs its instructions through
+// core6502::execute_static(), so the generated code shares the instruction
+// implementations, cycle counting and bus access of the interpreter.
+// Code that was not discovered, e.g. targets of indirect jumps, or that was
+// invalidated by bank switching is run by the interpreter.
+//
+// Usage: struts_recompile ROM OUTPUT
+
+#include "log.h"
+#include "opcodes.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+constexpr uint16_t prg_rom_start{0x8000};
+// Blocks never cross a page so the pages can be bank switched independently,
+// matching the code pages of core6502.
+constexpr uint16_t code_page_size{0x1000};
+
+// PRG ROM of an NROM cartridge: 32 K, a single 16 K bank is mirrored.
+using prg_rom = std::array<uint8_t, 0x8000>;
+
+prg_rom read_prg_rom(std::string const &filename) {
+    FILE *stream = std::fopen(filename.c_str(), "rb");
+    if (stream == nullptr)
+        throw std::runtime_error("Failed to open file '" + filename + "'.");
+    std::array<uint8_t, 16> header{};
+    prg_rom rom{};
+    bool ok = std::fread(header.data(), 1, header.size(), stream) ==
+              header.size();
+    ok = ok && header[0] == 'N' && header[1] == 'E' && header[2] == 'S' &&
+         header[3] == 0x1A;
+    // Bank switched code is left to the interpreter.
+    ok = ok && (header[6] >> 4 | (header[7] & 0xF0)) == 0;
+    std::size_t const size = header[4] == 1 ? 0x4000 : rom.size();
+    ok = ok && std::fread(rom.data(), 1, size, stream) == size;
+    std::fclose(stream);
+    if (!ok)
+        throw std::runtime_error("Failed to read NROM iNES file '" +
+                                 filename + "'.");
+    if (size == 0x4000)
+        std::copy_n(rom.begin(), 0x4000, rom.begin() + 0x4000);
+    return rom;
+}
+
+struct instruction {
+    uint8_t opcode{};
+    uint8_t operand_low{};
+    uint8_t operand_high{};
+    uint8_t size{};
+    mnemonic name{};
+    adr_mode mode{};
+};
+
+class disassembler {
+  public:
+    explicit disassembler(prg_rom const &rom) : rom{rom} {}
+
+    // Follows all statically known control flow from adr.
+    void discover(uint16_t adr) {
+        std::vector<uint16_t> work{adr};
+        while (!work.empty()) {
+            uint16_t const pp = work.back();
+            work.pop_back();
+            if (pp < prg_rom_start || code.contains(pp))
+                continue;
+            auto const instr = decode(pp);
+            if (instr.name == mnemonic::invalid ||
+                pp + instr.size > 0x10000)
+                continue;
+            code[pp] = instr;
+            uint16_t const next = pp + instr.size;
+            uint16_t const target =
+                instr.operand_low | (instr.operand_high << 8);
+            switch (instr.name) {
+            case mnemonic::BCC:
+            case mnemonic::BCS:
+            case mnemonic::BEQ:
+            case mnemonic::BMI:
+            case mnemonic::BNE:
+            case mnemonic::BPL:
+            case mnemonic::BVC:
+                work.push_back(next + static_cast<int8_t>(instr.operand_low));
+                work.push_back(next);
+                break;
+            case mnemonic::JSR:
+                work.push_back(target);
+                work.push_back(next);
+                break;
+            case mnemonic::JMP:
+                if (instr.mode == adr_mode::absolute)
+                    work.push_back(target);
+                break;
+            case mnemonic::BRK:
+            case mnemonic::RTI:
+            case mnemonic::RTS:
+                break;
+            default:
+                work.push_back(next);
+            }
+        }
+    }
+
+    uint16_t vector(uint16_t adr) const {
+        return read(adr) | (read(adr + 1) << 8);
+    }
+
+    // Discovered instructions by address.
+    std::map<uint16_t, instruction> const &instructions() const {
+        return code;
+    }
+
+  private:
+    prg_rom const &rom;
+    std::map<uint16_t, instruction> code{};
+
+    uint8_t read(uint16_t adr) const { return rom[adr - prg_rom_start]; }
+
+    instruction decode(uint16_t adr) const {
+        auto const &entry = opcode_table[read(adr)];
+        instruction instr{read(adr), 0, 0,
+                          static_cast<uint8_t>(1 + operand_size(entry.mode)),
+                          entry.name, entry.mode};
+        if (instr.size > 1 && adr + 1 <= 0xFFFF)
+            instr.operand_low = read(adr + 1);
+        if (instr.size > 2 && adr + 2 <= 0xFFFF)
+            instr.operand_high = read(adr + 2);
+        return instr;
+    }
+};
+
+constexpr bool ends_block(mnemonic name) {
+    switch (name) {
+    case mnemonic::BCC:
+    case mnemonic::BCS:
+    case mnemonic::BEQ:
+    case mnemonic::BMI:
+    case mnemonic::BNE:
+    case mnemonic::BPL:
+    case mnemonic::BVC:
+    case mnemonic::BRK:
+    case mnemonic::JMP:
+    case mnemonic::JSR:
+    case mnemonic::RTI:
+    case mnemonic::RTS:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool crosses_page(uint16_t adr, instruction const &instr) {
+    return adr / code_page_size != (adr + instr.size - 1) / code_page_size;
+}
+
+std::string disassemble(uint16_t adr, instruction const &instr) {
+    auto const name = mnemonic_name(instr.name);
+    auto const low = instr.operand_low;
+    auto const word = low | (instr.operand_high << 8);
+    switch (instr.mode) {
+    case adr_mode::implied:
+        return fmt::format("{}", name);
+    case adr_mode::accumulator:
+        return fmt::format("{} A", name);
+    case adr_mode::immediate:
+        return fmt::format("{} #${:02x}", name, low);
+    case adr_mode::absolute:
+        return fmt::format("{} ${:04x}", name, word);
+    case adr_mode::x_indexed_absolute:
+        return fmt::format("{} ${:04x},X", name, word);
+    case adr_mode::y_indexed_absolute:
+        return fmt::format("{} ${:04x},Y", name, word);
+    case adr_mode::absolute_indirect:
+        return fmt::format("{} (${:04x})", name, word);
+    case adr_mode::zero_page:
+        return fmt::format("{} ${:02x}", name, low);
+    case adr_mode::x_indexed_zero_page:
+        return fmt::format("{} ${:02x},X", name, low);
+    case adr_mode::y_indexed_zero_page:
+        return fmt::format("{} ${:02x},Y", name, low);
+    case adr_mode::x_indexed_zero_page_indirect:
+        return fmt::format("{} (${:02x},X)", name, low);
+    case adr_mode::zero_page_indirect_y_indexed:
+        return fmt::format("{} (${:02x}),Y", name, low);
+    case adr_mode::relative:
+        return fmt::format("{} ${:04x}", name,
+                           static_cast<uint16_t>(adr + 2 +
+                                                 static_cast<int8_t>(low)));
+    }
+    return std::string{name};
+}
+
+// Same check as core6502::build_block(). Idle loops are left to the
+// interpreter, which can skip their iterations.
+std::vector<uint16_t> idle_loop(std::map<uint16_t, instruction> const &code,
+                                uint16_t start) {
+    std::vector<uint16_t> loop{};
+    for (auto adr = start; loop.size() < max_idle_loop_size;) {
+        auto const it = code.find(adr);
+        if (it == code.end())
+            break;
+        auto const &instr = it->second;
+        loop.push_back(adr);
+        adr += instr.size;
+        if (is_branch(instr.name)) {
+            if (static_cast<uint16_t>(
+                    adr + static_cast<int8_t>(instr.operand_low)) == start)
+                return loop;
+            break;
+        }
+        if (!polls_memory(instr.opcode, instr.operand_low,
+                          instr.operand_high))
+            break;
+    }
+    return {};
+}
+
+// Splits the discovered instructions into basic blocks and writes one
+// function per block. A block may be entered at any of its instructions.
+std::string generate(std::map<uint16_t, instruction> const &code,
+                     std::string const &rom_filename) {
+    std::string out = fmt::format(
+        "// Generated by struts_recompile from {}, do not edit.\n\n"
+        "#include \"core6502_ops.h\"\n"
+        "#include \"tools/static_code.h\"\n\n"
+        "namespace {{\n",
+        rom_filename);
+    // Address of every compiled instruction and the block containing it.
+    std::vector<std::pair<uint16_t, uint16_t>> entries{};
+    std::set<uint16_t> compiled{};
+    for (auto const &[start, first] : code) {
+        for (auto const adr : idle_loop(code, start)) {
+            compiled.insert(adr);
+        }
+    }
+    for (auto const &[start, first] : code) {
+        if (compiled.contains(start) || crosses_page(start, first))
+            continue;
+        out += fmt::format("void block_{:04x}(core6502 &cpu) {{\n"
+                           "    switch (cpu.get_pp()) {{\n",
+                           start);
+        auto adr = start;
+        for (;;) {
+            auto const &instr = code.at(adr);
+            compiled.insert(adr);
+            entries.emplace_back(adr, start);
+            out += fmt::format(
+                "    case 0x{:04x}: // {}\n"
+                "        if (!cpu.execute_static<0x{:02x}>(0x{:02x}, "
+                "0x{:02x}))\n"
+                "            return;\n",
+                adr, disassemble(adr, instr), instr.opcode, instr.operand_low,
+                instr.operand_high);
+            uint16_t const next = adr + instr.size;
+            auto const it = code.find(next);
+            // Overlapping, already compiled or idle loop code continues in
+            // its own block after returning to run_until().
+            if (ends_block(instr.name) || it == code.end() ||
+                compiled.contains(next) || crosses_page(next, it->second) ||
+                next % code_page_size == 0)
+                break;
+            out += "        [[fallthrough]];\n";
+            adr = next;
+        }
+        out += "    }\n}\n\n";
+    }
+    out += "} // namespace\n\n"
+           "void install_static_code(core6502 &cpu) {\n";
+    for (auto const &[adr, block] : entries) {
+        out += fmt::format(
+            "    cpu.add_static_block(0x{:04x}, block_{:04x});\n", adr, block);
+    }
+    out += "}\n";
+    return out;
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+    current_log_level = log_level::info;
+    if (argc != 3) {
+        log(log_level::error, "Usage:\n\tstruts_recompile ROM OUTPUT\n");
+        return 1;
+    }
+    try {
+        auto const rom = read_prg_rom(argv[1]);
+        disassembler code{rom};
+        // NMI, reset and IRQ/BRK vectors.
+        for (uint16_t const vector : {0xFFFA, 0xFFFC, 0xFFFE}) {
+            code.discover(code.vector(vector));
+        }
+        auto const source = generate(code.instructions(), argv[1]);
+        FILE *output = std::fopen(argv[2], "w");
+        if (output == nullptr)
+            throw std::runtime_error(std::string{"Failed to open file '"} +
+                                     argv[2] + "'.");
+        bool const ok =
+            std::fwrite(source.data(), 1, source.size(), output) ==
+            source.size();
+        if (std::fclose(output) != 0 || !ok)
+            throw std::runtime_error("Failed to write output.");
+        log(log_level::info, "Recompiled {} instructions\n",
+            code.instructions().size());
+    } catch (std::runtime_error const &error) {
+        log(log_level::error, "Failed to recompile: {}\n", error.what());
+        return 1;
+    }
+    return 0;
+}
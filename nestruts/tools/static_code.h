@@ -0,0 +1,6 @@
+#pragma once
+// Entry point of the code generated by struts_recompile.
+#include "core6502.h"
+
+// Registers the statically recompiled blocks of the ROM with cpu.
+void install_static_code(core6502 &cpu);
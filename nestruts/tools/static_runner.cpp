@@ -0,0 +1,156 @@
+// nestruts_static : Runs a ROM with its statically recompiled code
+//
+// Replays controller input recorded with `nestruts -r` without presenting
+// frames. With --lockstep an interpreter-only system runs the same input and
+// the CPU state, RAM and rendered frame of both are compared after every
+// frame. The interpreter also runs every idle loop iteration, so this checks
+// idle loop skipping too.
+//
+// Usage: nestruts_static ROM INPUTS [--lockstep]
+
+#include "apu.h"
+#include "controller.h"
+#include "core6502.h"
+#include "log.h"
+#include "mem.h"
+#include "ppu.h"
+#include "rom.h"
+#include "tools/static_code.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+// Same frame loop as run_game().
+struct nes {
+    std::shared_ptr<event_scheduler> events{};
+    std::shared_ptr<picture_processing_unit> ppu{};
+    std::shared_ptr<audio_processing_unit> apu{};
+    std::shared_ptr<controller> ctrl{};
+    std::unique_ptr<core6502> cpu{};
+    // Owned by cpu.
+    memory_bus *bus{};
+
+    nes(std::string const &filename, bool static_code)
+        : events{std::make_shared<event_scheduler>()},
+          ppu{std::make_shared<picture_processing_unit>(events)},
+          apu{std::make_shared<audio_processing_unit>(events)},
+          ctrl{std::make_shared<controller>()} {
+        auto m = std::make_unique<memory_bus>(ppu, apu, ctrl, events);
+        bus = m.get();
+        load_rom(filename, *ppu, *bus);
+        uint16_t const reset_vector =
+            bus->read(0xFFFC) + (bus->read(0xFFFD) << 8);
+        cpu = std::make_unique<core6502>(std::move(m));
+        cpu->setpp(reset_vector);
+        if (static_code)
+            install_static_code(*cpu);
+        else
+            cpu->set_idle_loop_skipping(false);
+        cpu->run_until(frame_end_cycle(1));
+    }
+
+    void run_frame(int64_t frame, uint8_t input) {
+        ctrl->set_state(input);
+        cpu->run_until(frame_end_cycle(frame + 2));
+        ppu->draw();
+    }
+
+    // The 2 K of RAM.
+    std::span<uint8_t const> ram() const { return {bus->read_data(0), 0x800}; }
+};
+
+// Names what differs between the systems, if anything does.
+std::string_view difference(nes const &a, nes const &b) {
+    if (a.cpu->dump_state() != b.cpu->dump_state() ||
+        a.cpu->get_cycles() != b.cpu->get_cycles())
+        return "CPU state";
+    if (!std::ranges::equal(a.ram(), b.ram()))
+        return "RAM";
+    if (!std::ranges::equal(a.ppu->frame_buffer(), b.ppu->frame_buffer()))
+        return "Frame";
+    return {};
+}
+
+std::vector<uint8_t> read_inputs(std::string const &filename) {
+    std::ifstream stream{filename, std::ios::binary};
+    if (!stream)
+        throw std::runtime_error("Failed to open file '" + filename + "'.");
+    return {std::istreambuf_iterator<char>{stream},
+            std::istreambuf_iterator<char>{}};
+}
+
+int run(std::string const &rom_filename, std::string const &inputs_filename,
+        bool lockstep) {
+    auto const inputs = read_inputs(inputs_filename);
+    nes recompiled{rom_filename, true};
+    std::unique_ptr<nes> reference{};
+    if (lockstep)
+        reference = std::make_unique<nes>(rom_filename, false);
+
+    uint64_t skipped_cycles{};
+    auto const start = std::chrono::steady_clock::now();
+    for (std::size_t frame{0}; frame < inputs.size(); ++frame) {
+        recompiled.run_frame(frame, inputs[frame]);
+        skipped_cycles += recompiled.cpu->take_skipped_cycles();
+        if (recompiled.cpu->is_faulted()) {
+            log(log_level::error, "CPU faulted in frame {}:\n{}\n", frame,
+                recompiled.cpu->dump_state());
+            return 1;
+        }
+        if (!reference)
+            continue;
+        reference->run_frame(frame, inputs[frame]);
+        if (auto const differs = difference(recompiled, *reference);
+            !differs.empty()) {
+            log(log_level::error,
+                "{} diverged from interpreter in frame {}:\n"
+                "recompiled ({} cycles):\n{}\n"
+                "interpreter ({} cycles):\n{}\n",
+                differs, frame, recompiled.cpu->get_cycles(),
+                recompiled.cpu->dump_state(), reference->cpu->get_cycles(),
+                reference->cpu->dump_state());
+            return 1;
+        }
+    }
+    std::chrono::duration<double> const elapsed =
+        std::chrono::steady_clock::now() - start;
+    log(log_level::info, "Ran {} frames in {:.3f} s{}, skipped {} cycles\n",
+        inputs.size(), elapsed.count(),
+        lockstep ? " in lockstep with the interpreter" : "", skipped_cycles);
+    return 0;
+}
+
+void print_usage() {
+    log(log_level::error,
+        "Usage:\n\tnestruts_static ROM INPUTS [--lockstep]\n");
+}
+} // namespace
+
+int main(int argc, char *argv[]) {
+    current_log_level = log_level::info;
+    bool const lockstep = argc == 4 && "--lockstep"sv == argv[3];
+    if (argc != 3 && !lockstep) {
+        log(log_level::error, "Unexpected number of command line arguments.\n");
+        print_usage();
+        return 1;
+    }
+    try {
+        return run(argv[1], argv[2], lockstep);
+    } catch (std::runtime_error const &error) {
+        log(log_level::error, "Failed to run: {}\n", error.what());
+        print_usage();
+        return 1;
+    }
+}
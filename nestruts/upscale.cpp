@@ -0,0 +1,500 @@
+#include "upscale.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace {
+// Lines of the frame around line y, the edges repeat.
+struct line_rows {
+    uint32_t const *up;
+    uint32_t const *row;
+    uint32_t const *down;
+};
+
+inline line_rows rows_around(uint32_t const *in, int width, int height,
+                             int y) {
+    auto const *const row = in + y * width;
+    return {y > 0 ? row - width : row, row,
+            y + 1 < height ? row + width : row};
+}
+
+// A pixel e and its eight neighbours:
+//   a b c
+//   d e f
+//   g h i
+struct neighbours {
+    uint32_t a, b, c, d, e, f, g, h, i;
+};
+
+inline neighbours around(line_rows const &rows, int x, int width) {
+    int const left = std::max(x - 1, 0);
+    int const right = std::min(x + 1, width - 1);
+    return {rows.up[left],   rows.up[x],   rows.up[right],
+            rows.row[left],  rows.row[x],  rows.row[right],
+            rows.down[left], rows.down[x], rows.down[right]};
+}
+
+// The output pixels of one input pixel, factor x factor of them from out
+// with pitch between the lines.
+void scale2x_pixel(neighbours const &n, uint32_t *out, int pitch) {
+    bool const edge = n.b != n.h && n.d != n.f;
+    out[0] = edge && n.d == n.b ? n.d : n.e;
+    out[1] = edge && n.b == n.f ? n.f : n.e;
+    out[pitch] = edge && n.d == n.h ? n.d : n.e;
+    out[pitch + 1] = edge && n.h == n.f ? n.f : n.e;
+}
+
+void scale3x_pixel(neighbours const &n, uint32_t *out, int pitch) {
+    bool const edge = n.b != n.h && n.d != n.f;
+    bool const db = edge && n.d == n.b;
+    bool const bf = edge && n.b == n.f;
+    bool const dh = edge && n.d == n.h;
+    bool const hf = edge && n.h == n.f;
+    out[0] = db ? n.d : n.e;
+    out[1] = (db && n.e != n.c) || (bf && n.e != n.a) ? n.b : n.e;
+    out[2] = bf ? n.f : n.e;
+    out += pitch;
+    out[0] = (db && n.e != n.g) || (dh && n.e != n.a) ? n.d : n.e;
+    out[1] = n.e;
+    out[2] = (bf && n.e != n.i) || (hf && n.e != n.c) ? n.f : n.e;
+    out += pitch;
+    out[0] = dh ? n.d : n.e;
+    out[1] = (dh && n.e != n.i) || (hf && n.e != n.g) ? n.h : n.e;
+    out[2] = hf ? n.f : n.e;
+}
+
+// Per channel, rounding up like pavgb.
+inline uint32_t average(uint32_t x, uint32_t y) {
+    return (x | y) - (((x ^ y) >> 1) & 0x7F7F7F7F);
+}
+
+// Sum of the differences of red, green and blue.
+inline int distance(uint32_t x, uint32_t y) {
+    int sum{0};
+    for (int shift{0}; shift < 24; shift += 8) {
+        sum += std::abs(static_cast<int>(x >> shift & 0xFF) -
+                        static_cast<int>(y >> shift & 0xFF));
+    }
+    return sum;
+}
+
+// Corner of e between its neighbours p and q, across from r.
+inline uint32_t edge_corner(uint32_t e, uint32_t p, uint32_t q, uint32_t r) {
+    return distance(p, q) < distance(e, r) ? average(e, average(p, q)) : e;
+}
+
+void edge2x_pixel(neighbours const &n, uint32_t *out, int pitch) {
+    out[0] = edge_corner(n.e, n.d, n.b, n.a);
+    out[1] = edge_corner(n.e, n.b, n.f, n.c);
+    out[pitch] = edge_corner(n.e, n.d, n.h, n.g);
+    out[pitch + 1] = edge_corner(n.e, n.h, n.f, n.i);
+}
+
+// Pixels [begin, end) of a line one at a time, out points at the first
+// output line of it.
+template <int factor, void (*pixel)(neighbours const &, uint32_t *, int)>
+void scale_pixels(line_rows const &rows, int width, uint32_t *out, int begin,
+                  int end) {
+    for (int x{begin}; x < end; ++x) {
+        pixel(around(rows, x, width), out + x * factor, width * factor);
+    }
+}
+
+template <int factor, void (*pixel)(neighbours const &, uint32_t *, int)>
+void scale_scalar(uint32_t const *in, int width, int height, uint32_t *out) {
+    for (int y{0}; y < height; ++y) {
+        scale_pixels<factor, pixel>(rows_around(in, width, height, y), width,
+                                    out + y * factor * factor * width, 0,
+                                    width);
+    }
+}
+
+// Copies the first output line of a line to the others.
+inline void repeat_line(uint32_t *out, int pitch, int factor) {
+    for (int line{1}; line < factor; ++line) {
+        std::memcpy(out + line * pitch, out, pitch * sizeof(uint32_t));
+    }
+}
+
+template <int factor>
+void nearest_scalar(uint32_t const *in, int width, int height,
+                    uint32_t *out) {
+    int const pitch = width * factor;
+    for (int y{0}; y < height; ++y) {
+        auto *const line = out + y * factor * pitch;
+        for (int x{0}; x < width; ++x) {
+            std::fill_n(line + x * factor, factor, in[y * width + x]);
+        }
+        repeat_line(line, pitch, factor);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// The SIMD versions run the scalar steps on whole vectors of pixels, with
+// comparisons giving masks to select by. The first and last pixels of each
+// line, whose neighbours repeat the edge, and any left over go through the
+// scalar ones.
+
+__attribute__((target("sse2"))) inline __m128i load128(uint32_t const *p) {
+    return _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));
+}
+
+__attribute__((target("sse2"))) inline void store128(uint32_t *p, __m128i v) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v);
+}
+
+// mask ? x : y
+__attribute__((target("sse2"))) inline __m128i select128(__m128i mask,
+                                                          __m128i x,
+                                                          __m128i y) {
+    return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+
+// Stores x0 y0 x1 y1 x2 y2 x3 y3.
+__attribute__((target("sse2"))) inline void store_interleaved(uint32_t *p,
+                                                               __m128i x,
+                                                               __m128i y) {
+    store128(p, _mm_unpacklo_epi32(x, y));
+    store128(p + 4, _mm_unpackhi_epi32(x, y));
+}
+
+// Stores x0 y0 z0 x1 y1 z1 x2 y2 z2 x3 y3 z3.
+__attribute__((target("sse2"))) inline void
+store_interleaved(uint32_t *p, __m128i x, __m128i y, __m128i z) {
+    auto const xy_low = _mm_castsi128_ps(_mm_unpacklo_epi32(x, y));
+    auto const yz_low = _mm_castsi128_ps(_mm_unpacklo_epi32(y, z));
+    auto const zx_low = _mm_castsi128_ps(_mm_unpacklo_epi32(z, x));
+    auto const xy_high = _mm_castsi128_ps(_mm_unpackhi_epi32(x, y));
+    auto const yz_high = _mm_castsi128_ps(_mm_unpackhi_epi32(y, z));
+    auto const zx_high = _mm_castsi128_ps(_mm_unpackhi_epi32(z, x));
+    store128(p, _mm_castps_si128(
+                    _mm_shuffle_ps(xy_low, zx_low, _MM_SHUFFLE(3, 0, 1, 0))));
+    store128(p + 4, _mm_castps_si128(_mm_shuffle_ps(
+                        yz_low, xy_high, _MM_SHUFFLE(1, 0, 3, 2))));
+    store128(p + 8, _mm_castps_si128(_mm_shuffle_ps(
+                        zx_high, yz_high, _MM_SHUFFLE(3, 2, 3, 0))));
+}
+
+template <int factor>
+__attribute__((target("sse2"))) void
+nearest_sse2(uint32_t const *in, int width, int height, uint32_t *out) {
+    int const pitch = width * factor;
+    for (int y{0}; y < height; ++y) {
+        auto const *const row = in + y * width;
+        auto *const line = out + y * factor * pitch;
+        int x{0};
+        for (; x + 4 <= width; x += 4) {
+            auto const v = load128(row + x);
+            auto *const p = line + x * factor;
+            if constexpr (factor == 2) {
+                store_interleaved(p, v, v);
+            } else if constexpr (factor == 3) {
+                store128(p, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+                store128(p + 4,
+                         _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+                store128(p + 8,
+                         _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+            } else {
+                static_assert(factor == 4);
+                store128(p, _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 0, 0, 0)));
+                store128(p + 4,
+                         _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 1, 1, 1)));
+                store128(p + 8,
+                         _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 2, 2)));
+                store128(p + 12,
+                         _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3)));
+            }
+        }
+        for (; x < width; ++x) {
+            std::fill_n(line + x * factor, factor, row[x]);
+        }
+        repeat_line(line, pitch, factor);
+    }
+}
+
+// mask && !flat
+__attribute__((target("sse2"))) inline __m128i unless_flat128(__m128i flat,
+                                                               __m128i mask) {
+    return _mm_andnot_si128(flat, mask);
+}
+
+// mask && e != p
+__attribute__((target("sse2"))) inline __m128i unless_equal128(__m128i mask,
+                                                                __m128i e,
+                                                                __m128i p) {
+    return _mm_andnot_si128(_mm_cmpeq_epi32(e, p), mask);
+}
+
+// Pixels [x, x + 4) of a line.
+__attribute__((target("sse2"))) inline void
+scale2x_step128(line_rows const &rows, int x, uint32_t *line, int pitch) {
+    auto const b = load128(rows.up + x);
+    auto const d = load128(rows.row + x - 1);
+    auto const e = load128(rows.row + x);
+    auto const f = load128(rows.row + x + 1);
+    auto const h = load128(rows.down + x);
+    auto const flat =
+        _mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f));
+    auto const db = unless_flat128(flat, _mm_cmpeq_epi32(d, b));
+    auto const bf = unless_flat128(flat, _mm_cmpeq_epi32(b, f));
+    auto const dh = unless_flat128(flat, _mm_cmpeq_epi32(d, h));
+    auto const hf = unless_flat128(flat, _mm_cmpeq_epi32(h, f));
+    store_interleaved(line + x * 2, select128(db, d, e),
+                      select128(bf, f, e));
+    store_interleaved(line + pitch + x * 2, select128(dh, d, e),
+                      select128(hf, f, e));
+}
+
+__attribute__((target("sse2"))) void
+scale2x_sse2(uint32_t const *in, int width, int height, uint32_t *out) {
+    int const pitch = width * 2;
+    for (int y{0}; y < height; ++y) {
+        auto const rows = rows_around(in, width, height, y);
+        auto *const line = out + y * 2 * pitch;
+        scale_pixels<2, scale2x_pixel>(rows, width, line, 0, 1);
+        int x{1};
+        for (; x + 5 <= width; x += 4) {
+            scale2x_step128(rows, x, line, pitch);
+        }
+        scale_pixels<2, scale2x_pixel>(rows, width, line, x, width);
+    }
+}
+
+__attribute__((target("sse2"))) void
+scale3x_sse2(uint32_t const *in, int width, int height, uint32_t *out) {
+    int const pitch = width * 3;
+    for (int y{0}; y < height; ++y) {
+        auto const rows = rows_around(in, width, height, y);
+        auto *const line = out + y * 3 * pitch;
+        scale_pixels<3, scale3x_pixel>(rows, width, line, 0, 1);
+        int x{1};
+        for (; x + 5 <= width; x += 4) {
+            auto const a = load128(rows.up + x - 1);
+            auto const b = load128(rows.up + x);
+            auto const c = load128(rows.up + x + 1);
+            auto const d = load128(rows.row + x - 1);
+            auto const e = load128(rows.row + x);
+            auto const f = load128(rows.row + x + 1);
+            auto const g = load128(rows.down + x - 1);
+            auto const h = load128(rows.down + x);
+            auto const i = load128(rows.down + x + 1);
+            auto const flat =
+                _mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f));
+            auto const db = unless_flat128(flat, _mm_cmpeq_epi32(d, b));
+            auto const bf = unless_flat128(flat, _mm_cmpeq_epi32(b, f));
+            auto const dh = unless_flat128(flat, _mm_cmpeq_epi32(d, h));
+            auto const hf = unless_flat128(flat, _mm_cmpeq_epi32(h, f));
+            auto *p = line + x * 3;
+            store_interleaved(p, select128(db, d, e),
+                              select128(_mm_or_si128(unless_equal128(db, e, c),
+                                                     unless_equal128(bf, e, a)),
+                                        b, e),
+                              select128(bf, f, e));
+            p += pitch;
+            store_interleaved(p,
+                              select128(_mm_or_si128(unless_equal128(db, e, g),
+                                                     unless_equal128(dh, e, a)),
+                                        d, e),
+                              e,
+                              select128(_mm_or_si128(unless_equal128(bf, e, i),
+                                                     unless_equal128(hf, e, c)),
+                                        f, e));
+            p += pitch;
+            store_interleaved(p, select128(dh, d, e),
+                              select128(_mm_or_si128(unless_equal128(dh, e, i),
+                                                     unless_equal128(hf, e, g)),
+                                        h, e),
+                              select128(hf, f, e));
+        }
+        scale_pixels<3, scale3x_pixel>(rows, width, line, x, width);
+    }
+}
+
+__attribute__((target("sse2"))) inline __m128i distance128(__m128i x,
+                                                            __m128i y) {
+    auto const low = _mm_set1_epi32(0xFF);
+    auto const diff =
+        _mm_and_si128(_mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x)),
+                      _mm_set1_epi32(0x00FFFFFF));
+    return _mm_add_epi32(
+        _mm_add_epi32(_mm_and_si128(diff, low),
+                      _mm_and_si128(_mm_srli_epi32(diff, 8), low)),
+        _mm_srli_epi32(diff, 16));
+}
+
+__attribute__((target("sse2"))) inline __m128i
+edge_corner128(__m128i e, __m128i p, __m128i q, __m128i r) {
+    auto const cut = _mm_cmpgt_epi32(distance128(e, r), distance128(p, q));
+    return select128(cut, _mm_avg_epu8(e, _mm_avg_epu8(p, q)), e);
+}
+
+// Pixels [x, x + 4) of a line.
+__attribute__((target("sse2"))) inline void
+edge2x_step128(line_rows const &rows, int x, uint32_t *line, int pitch) {
+    auto const a = load128(rows.up + x - 1);
+    auto const b = load128(rows.up + x);
+    auto const c = load128(rows.up + x + 1);
+    auto const d = load128(rows.row + x - 1);
+    auto const e = load128(rows.row + x);
+    auto const f = load128(rows.row + x + 1);
+    auto const g = load128(rows.down + x - 1);
+    auto const h = load128(rows.down + x);
+    auto const i = load128(rows.down + x + 1);
+    store_interleaved(line + x * 2, edge_corner128(e, d, b, a),
+                      edge_corner128(e, b, f, c));
+    store_interleaved(line + pitch + x * 2, edge_corner128(e, d, h, g),
+                      edge_corner128(e, h, f, i));
+}
+
+__attribute__((target("sse2"))) void
+edge2x_sse2(uint32_t const *in, int width, int height, uint32_t *out) {
+    int const pitch = width * 2;
+    for (int y{0}; y < height; ++y) {
+        auto const rows = rows_around(in, width, height, y);
+        auto *const line = out + y * 2 * pitch;
+        scale_pixels<2, edge2x_pixel>(rows, width, line, 0, 1);
+        int x{1};
+        for (; x + 5 <= width; x += 4) {
+            edge2x_step128(rows, x, line, pitch);
+        }
+        scale_pixels<2, edge2x_pixel>(rows, width, line, x, width);
+    }
+}
+
+__attribute__((target("avx2"))) inline __m256i load256(uint32_t const *p) {
+    return _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p));
+}
+
+__attribute__((target("avx2"))) inline void store256(uint32_t *p, __m256i v) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), v);
+}
+
+// Stores x0 y0 ... x7 y7, unpacking works within 128 bit lanes.
+__attribute__((target("avx2"))) inline void store_interleaved256(uint32_t *p,
+                                                                  __m256i x,
+                                                                  __m256i y) {
+    auto const low = _mm256_unpacklo_epi32(x, y);
+    auto const high = _mm256_unpackhi_epi32(x, y);
+    store256(p, _mm256_permute2x128_si256(low, high, 0x20));
+    store256(p + 8, _mm256_permute2x128_si256(low, high, 0x31));
+}
+
+__attribute__((target("avx2"))) inline __m256i distance256(__m256i x,
+                                                            __m256i y) {
+    auto const low = _mm256_set1_epi32(0xFF);
+    auto const diff = _mm256_and_si256(
+        _mm256_or_si256(_mm256_subs_epu8(x, y), _mm256_subs_epu8(y, x)),
+        _mm256_set1_epi32(0x00FFFFFF));
+    return _mm256_add_epi32(
+        _mm256_add_epi32(_mm256_and_si256(diff, low),
+                         _mm256_and_si256(_mm256_srli_epi32(diff, 8), low)),
+        _mm256_srli_epi32(diff, 16));
+}
+
+__attribute__((target("avx2"))) inline __m256i
+edge_corner256(__m256i e, __m256i p, __m256i q, __m256i r) {
+    auto const cut =
+        _mm256_cmpgt_epi32(distance256(e, r), distance256(p, q));
+    return _mm256_blendv_epi8(e, _mm256_avg_epu8(e, _mm256_avg_epu8(p, q)),
+                              cut);
+}
+
+__attribute__((target("avx2"))) void
+edge2x_avx2(uint32_t const *in, int width, int height, uint32_t *out) {
+    int const pitch = width * 2;
+    for (int y{0}; y < height; ++y) {
+        auto const rows = rows_around(in, width, height, y);
+        auto *const line = out + y * 2 * pitch;
+        scale_pixels<2, edge2x_pixel>(rows, width, line, 0, 1);
+        int x{1};
+        for (; x + 9 <= width; x += 8) {
+            auto const a = load256(rows.up + x - 1);
+            auto const b = load256(rows.up + x);
+            auto const c = load256(rows.up + x + 1);
+            auto const d = load256(rows.row + x - 1);
+            auto const e = load256(rows.row + x);
+            auto const f = load256(rows.row + x + 1);
+            auto const g = load256(rows.down + x - 1);
+            auto const h = load256(rows.down + x);
+            auto const i = load256(rows.down + x + 1);
+            store_interleaved256(line + x * 2, edge_corner256(e, d, b, a),
+                                 edge_corner256(e, b, f, c));
+            store_interleaved256(line + pitch + x * 2,
+                                 edge_corner256(e, d, h, g),
+                                 edge_corner256(e, h, f, i));
+        }
+        for (; x + 5 <= width; x += 4) {
+            edge2x_step128(rows, x, line, pitch);
+        }
+        scale_pixels<2, edge2x_pixel>(rows, width, line, x, width);
+    }
+}
+#endif
+
+// By filter, then level. Null where a level has no version of its own, AVX2
+// only pays off for edge2x, the others are bound by storing the output.
+constexpr std::array<std::array<upscaler, 3>,
+                     static_cast<std::size_t>(upscale_filter::count)>
+    upscalers{{
+#if defined(__x86_64__) || defined(__i386__)
+        {nearest_scalar<2>, nearest_sse2<2>, nullptr},
+        {nearest_scalar<3>, nearest_sse2<3>, nullptr},
+        {nearest_scalar<4>, nearest_sse2<4>, nullptr},
+        {scale_scalar<2, scale2x_pixel>, scale2x_sse2, nullptr},
+        {scale_scalar<3, scale3x_pixel>, scale3x_sse2, nullptr},
+        {scale_scalar<2, edge2x_pixel>, edge2x_sse2, edge2x_avx2},
+#else
+        {nearest_scalar<2>},
+        {nearest_scalar<3>},
+        {nearest_scalar<4>},
+        {scale_scalar<2, scale2x_pixel>},
+        {scale_scalar<3, scale3x_pixel>},
+        {scale_scalar<2, edge2x_pixel>},
+#endif
+    }};
+} // namespace
+
+std::string_view upscale_filter_name(upscale_filter filter) {
+    constexpr std::array<std::string_view,
+                         static_cast<std::size_t>(upscale_filter::count)>
+        names{"nearest2x", "nearest3x", "nearest4x",
+              "scale2x",   "scale3x",   "edge2x"};
+    return names[static_cast<std::size_t>(filter)];
+}
+
+simd_level const host_simd_level = [] {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        return simd_level::avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return simd_level::sse2;
+#endif
+    return simd_level::scalar;
+}();
+
+upscaler find_upscaler(upscale_filter filter, simd_level level) {
+    auto const &versions = upscalers[static_cast<std::size_t>(filter)];
+    for (auto i = static_cast<std::size_t>(level);; --i) {
+        if (versions[i])
+            return versions[i];
+    }
+}
+
+upscaling_video_sink::upscaling_video_sink(upscale_filter filter,
+                                           std::shared_ptr<video_sink> next)
+    : scale{find_upscaler(filter)}, factor{upscale_factor(filter)},
+      next{std::move(next)} {}
+
+void upscaling_video_sink::present(std::span<uint32_t const> frame,
+                                   int width) {
+    int const height = static_cast<int>(frame.size()) / width;
+    scaled.resize(frame.size() * factor * factor);
+    scale(frame.data(), width, height, scaled.data());
+    next->present(scaled, width * factor);
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "video_sink.h"
+
+// Scales a frame of width x height ARGB pixels into out, which holds the
+// factor of the filter times as many pixels in each direction.
+using upscaler = void (*)(uint32_t const *in, int width, int height,
+                          uint32_t *out);
+
+enum class upscale_filter : uint8_t {
+    // Repeats each pixel.
+    nearest2x,
+    nearest3x,
+    nearest4x,
+    // Scale2x and Scale3x (AdvMAME), round off corners where two
+    // neighbours of a pixel are the same colour.
+    scale2x,
+    scale3x,
+    // Blends each corner of a pixel with its two neighbours there when they
+    // differ less from each other than the pixel from the diagonal one, so
+    // edges are interpolated along their direction.
+    edge2x,
+    count
+};
+
+constexpr int upscale_factor(upscale_filter filter) {
+    switch (filter) {
+    case upscale_filter::nearest3x:
+    case upscale_filter::scale3x:
+        return 3;
+    case upscale_filter::nearest4x:
+        return 4;
+    default:
+        return 2;
+    }
+}
+
+// Name of filter as on the command line, e.g. "scale2x".
+std::string_view upscale_filter_name(upscale_filter filter);
+
+// Instruction sets the filters are written for, each level has all of them,
+// some only as the version of the level below.
+enum class simd_level : uint8_t {
+    scalar,
+    sse2,
+    avx2,
+};
+// The highest the host CPU supports.
+extern simd_level const host_simd_level;
+
+// Version of filter for level, which must not be above host_simd_level.
+// Scalar ones are the reference.
+upscaler find_upscaler(upscale_filter filter,
+                       simd_level level = host_simd_level);
+
+// Upscales frames before passing them on, e.g. to graphics or a file.
+class upscaling_video_sink final : public video_sink {
+  public:
+    upscaling_video_sink(upscale_filter filter,
+                         std::shared_ptr<video_sink> next);
+
+    void present(std::span<uint32_t const> frame, int width) override;
+
+  private:
+    upscaler const scale;
+    int const factor;
+    std::shared_ptr<video_sink> const next;
+    std::vector<uint32_t> scaled{};
+};
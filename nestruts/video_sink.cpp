@@ -0,0 +1,23 @@
+#include "video_sink.h"
+
+#include <stdexcept>
+#include <string>
+
+ppm_video_sink::ppm_video_sink(std::filesystem::path const &filename)
+    : file{filename, std::ios::binary} {
+    if (!file)
+        throw std::runtime_error("Failed to create file '" +
+                                 filename.string() + "'.");
+}
+
+void ppm_video_sink::present(std::span<uint32_t const> frame, int width) {
+    auto const height = frame.size() / width;
+    file << "P6\n" << width << ' ' << height << "\n255\n";
+    rgb.resize(frame.size() * 3);
+    for (std::size_t i{0}; i < frame.size(); ++i) {
+        rgb[i * 3] = static_cast<char>(frame[i] >> 16);
+        rgb[i * 3 + 1] = static_cast<char>(frame[i] >> 8);
+        rgb[i * 3 + 2] = static_cast<char>(frame[i]);
+    }
+    file.write(rgb.data(), static_cast<std::streamsize>(rgb.size()));
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <vector>
+
+// Where the PPU presents finished frames. The core does not depend on SDL,
+// graphics in gfx.h presents to a window.
+class video_sink {
+  public:
+    virtual ~video_sink() = default;
+    // A frame of ARGB pixels, width pixels per line. Only valid during the
+    // call.
+    virtual void present(std::span<uint32_t const> frame, int width) = 0;
+    // Sinks that filter the video signal take the frames of the PPU as NES
+    // colours with present_colours instead: 6 bits each with greyscale
+    // applied, width per line, and the emphasis bits of PPUMASK for each
+    // line, shifted down to bits 0-2.
+    virtual bool wants_colours() const { return false; }
+    virtual void present_colours(std::span<uint8_t const>,
+                                 std::span<uint8_t const>, int) {}
+};
+
+// Drops frames, for running headless.
+class null_video_sink final : public video_sink {
+  public:
+    void present(std::span<uint32_t const>, int) override {}
+};
+
+// Keeps a copy of the last frame, e.g. for tests and screenshots.
+class offscreen_video_sink final : public video_sink {
+  public:
+    void present(std::span<uint32_t const> frame, int width) override {
+        pixels.assign(frame.begin(), frame.end());
+        frame_width = width;
+        ++frames;
+    }
+
+    std::span<uint32_t const> frame() const { return pixels; }
+    int width() const { return frame_width; }
+    int64_t frame_count() const { return frames; }
+
+  private:
+    std::vector<uint32_t> pixels{};
+    int frame_width{};
+    int64_t frames{};
+};
+
+// Appends frames to a file as binary PPM images, which ffmpeg reads with
+// -f image2pipe. Throws if the file cannot be created.
+class ppm_video_sink final : public video_sink {
+  public:
+    explicit ppm_video_sink(std::filesystem::path const &filename);
+
+    void present(std::span<uint32_t const> frame, int width) override;
+
+  private:
+    std::ofstream file{};
+    std::vector<char> rgb{};
+};